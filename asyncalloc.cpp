@@ -0,0 +1,359 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Async Allocator
+//
+//   Description:  Allocation requests that wait for memory to be freed rather
+//                 than failing straight away, for pipelines where a stage can
+//                 afford to stall until a later stage gives memory back. Both
+//                 a callback form and (under C++20) a co_await form are given.
+//
+// Notes:
+// * A request that can't be met is queued by its order (FIFO), all under the
+//   heap lock, so there's no gap between the failed malloc and the queueing in
+//   which a free could be missed.
+// * The heap keeps a bitmask of the orders with waiters. A free checks the mask
+//   against the order of the block it ends up with - one load and a compare -
+//   and only looks at the queues if a waiter could now be met. So a free that
+//   can't help anybody costs the same as it did before.
+// * A free that can help serves every waiter it can, oldest first, while it
+//   holds the lock, then runs all of their callbacks in one batch once the lock
+//   is released. Callbacks therefore run on the thread that freed the memory;
+//   they may malloc and free from the heap themselves.
+// * Timeouts are handled by one timer thread, which sleeps until the earliest
+//   deadline. The purger and the handle compactor also serve waiters, as they
+//   can produce large free blocks too.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <stdexcept>
+
+#include "asyncalloc.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+AsyncAllocator::AsyncAllocator() {
+    this->heap = NULL;
+    this->running = false;
+}
+
+AsyncAllocator::~AsyncAllocator() {
+    this->stop();
+}
+
+/**
+ * Attaches to 'heap', which is made thread safe, as requests are met from whichever thread
+ * frees the memory. Only one AsyncAllocator can be attached to a heap at a time.
+ */
+void AsyncAllocator::start(BuddySystem* heap) {
+    if(this->running) {
+        throw std::logic_error("AsyncAllocator::start has failed - the allocator is already running!");
+    }
+
+    for(int k = 0; k < SIZE_OF_FREE_LIST; k++) {
+        this->queueHead[k] = NULL;
+        this->queueTail[k] = NULL;
+    }
+
+    this->heap = heap;
+    this->nextSequence = 0;
+    this->stats = AsyncStats();
+    this->hasNextDeadline = false;
+
+    heap->setThreadSafe(true);
+    heap->acquireLock();
+    if(heap->asyncAllocator != NULL) {
+        heap->releaseLock();
+        throw std::logic_error("AsyncAllocator::start has failed - the heap already has an async allocator!");
+    }
+
+    heap->asyncAllocator = this;
+    heap->waitingOrders = 0;
+    heap->releaseLock();
+
+    this->running = true;
+    this->timer = std::thread(&AsyncAllocator::run, this);
+}
+
+/**
+ * Detaches from the heap. Every request still waiting completes with NULL. Can't be called
+ * from a callback made by the timer thread (one for a timeout), as it waits for that thread.
+ */
+void AsyncAllocator::stop() {
+    if(std::this_thread::get_id() == this->timer.get_id()) {
+        throw std::logic_error("AsyncAllocator::stop has failed - it can't be called from a timeout's callback!");
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(this->timerLock);
+        if(!this->running) {
+            return;
+        }
+
+        this->running = false;
+    }
+
+    this->timerWake.notify_all();
+    this->timer.join();
+
+    this->heap->acquireLock();
+    AsyncRequest* waiting = this->takeAll();
+    this->heap->asyncAllocator = NULL;
+    this->heap->waitingOrders = 0;
+    this->heap->releaseLock();
+
+    AsyncAllocator::complete(waiting);
+}
+
+/**
+ * Allocates 'request_memory' bytes from the heap, calling 'callback' with the memory once it
+ * has it. If the memory is there already the callback is made before this returns; otherwise
+ * the request waits for enough memory to be freed, for up to 'timeoutMs' milliseconds (-1 to
+ * wait for as long as it takes).
+ */
+void AsyncAllocator::mallocAsync(int request_memory, long long timeoutMs, AsyncCallback callback, void* context) {
+    void* p;
+    if(!this->enqueue(request_memory, timeoutMs, callback, context, &p)) {
+        callback(p, context);
+    }
+}
+
+/**
+ * Tries to allocate 'request_memory' bytes; if they can't be had, queues a request for them
+ * and returns true. Otherwise returns false, with the memory (or NULL, for a request too big
+ * for the heap to ever meet) in 'immediate', and the callback isn't made.
+ */
+bool AsyncAllocator::enqueue(int request_memory, long long timeoutMs, AsyncCallback callback, void* context, void** immediate) {
+    BuddySystem* heap = this->heap;
+    bool hasDeadline = timeoutMs > 0;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(hasDeadline ? timeoutMs : 0);
+    {
+        BuddySystem::ScopedLock guard(heap);
+        *immediate = heap->allocate(request_memory, NULL);
+
+        int binK = heap->determineBinK((long long)request_memory + NODE_HEADER_SIZE);
+        if(*immediate != NULL || binK < 0 || !this->running || timeoutMs == 0) {
+            this->stats.immediateCount++;
+            return false;
+        }
+
+        AsyncRequest* request = new AsyncRequest();
+        request->size = request_memory;
+        request->binK = binK;
+        request->sequence = this->nextSequence++;
+        request->hasDeadline = hasDeadline;
+        request->deadline = deadline;
+        request->callback = callback;
+        request->context = context;
+        request->result = NULL;
+        request->next = NULL;
+
+        if(this->queueTail[binK] == NULL) {
+            this->queueHead[binK] = request;
+        } else {
+            this->queueTail[binK]->next = request;
+        }
+
+        this->queueTail[binK] = request;
+        heap->waitingOrders |= 1u << binK;
+        this->stats.queuedCount++;
+    }
+
+    // The request may already have been met (and deleted) by now, in which case the timer
+    // just wakes for nothing
+    if(hasDeadline) {
+        std::lock_guard<std::mutex> guard(this->timerLock);
+        if(!this->hasNextDeadline || deadline < this->nextDeadline) {
+            this->nextDeadline = deadline;
+            this->hasNextDeadline = true;
+            this->timerWake.notify_all();
+        }
+    }
+
+    return true;
+}
+
+AsyncStats AsyncAllocator::getStats() {
+    BuddySystem::ScopedLock guard(this->heap);
+    return this->stats;
+}
+
+/**
+ * Meets as many waiting requests as the heap now can, oldest first, taking them out of their
+ * queues. Returns them as a list to be passed to complete once the lock is released. The heap
+ * lock must be held.
+ */
+AsyncRequest* AsyncAllocator::serve() {
+    BuddySystem* heap = this->heap;
+    AsyncRequest* served = NULL;
+    AsyncRequest* servedTail = NULL;
+    long long count = 0;
+    bool released = false;
+
+    while(heap->waitingOrders != 0) {
+        AsyncRequest* oldest = NULL;
+        for(int k = heap->lowerK; k <= heap->upperK; k++) {
+            AsyncRequest* head = this->queueHead[k];
+            if(head != NULL && (oldest == NULL || head->sequence < oldest->sequence) && heap->findFirstBin(k) >= 0) {
+                oldest = head;
+            }
+        }
+
+        if(oldest == NULL) {
+            // Blocks held back in the reserves are given up before anybody is left waiting
+            if(!released && heap->reserveStock > 0 && heap->releaseReserves() > 0) {
+                released = true;
+                continue;
+            }
+
+            break;
+        }
+
+        oldest->result = heap->allocate(oldest->size, NULL);
+        if(oldest->result == NULL) {
+            break;
+        }
+
+        int binK = oldest->binK;
+        this->queueHead[binK] = oldest->next;
+        if(this->queueHead[binK] == NULL) {
+            this->queueTail[binK] = NULL;
+            heap->waitingOrders &= ~(1u << binK);
+        }
+
+        oldest->next = NULL;
+        if(servedTail == NULL) {
+            served = oldest;
+        } else {
+            servedTail->next = oldest;
+        }
+
+        servedTail = oldest;
+        count++;
+    }
+
+    if(count > 0) {
+        this->stats.servedCount += count;
+        this->stats.wakeCount++;
+        if(count > this->stats.largestWake) {
+            this->stats.largestWake = count;
+        }
+    }
+
+    return served;
+}
+
+/**
+ * Makes the callbacks for a list of requests (in order), and frees them. Must be called
+ * without the heap lock, as the callbacks may well use the heap.
+ */
+void AsyncAllocator::complete(AsyncRequest* requests) {
+    while(requests != NULL) {
+        AsyncRequest* next = requests->next;
+        requests->callback(requests->result, requests->context);
+        delete requests;
+        requests = next;
+    }
+}
+
+/**
+ * The timer thread: sleeps until the earliest deadline (or until a request with an earlier
+ * one is queued), and expires the requests that have run out of time.
+ */
+void AsyncAllocator::run() {
+    std::unique_lock<std::mutex> guard(this->timerLock);
+    while(this->running) {
+        if(this->hasNextDeadline) {
+            this->timerWake.wait_until(guard, this->nextDeadline);
+        } else {
+            this->timerWake.wait(guard);
+        }
+
+        if(!this->running) {
+            break;
+        }
+
+        // The callbacks are made without timerLock, as they may queue timed requests of their own
+        if(this->hasNextDeadline && std::chrono::steady_clock::now() >= this->nextDeadline) {
+            AsyncRequest* expired = this->expire();
+            guard.unlock();
+            AsyncAllocator::complete(expired);
+            guard.lock();
+        }
+    }
+}
+
+/**
+ * Takes every request whose deadline has passed out of its queue (with a NULL result), and
+ * works out the next deadline. Returns the expired requests as a list to be passed to complete
+ * once timerLock is released. Called by the timer thread holding timerLock, so that a request
+ * queued while this runs either gets looked at here or updates the deadline afterwards.
+ */
+AsyncRequest* AsyncAllocator::expire() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    AsyncRequest* expired = NULL;
+    this->hasNextDeadline = false;
+
+    this->heap->acquireLock();
+    for(int k = 0; k < SIZE_OF_FREE_LIST; k++) {
+        AsyncRequest* previous = NULL;
+        AsyncRequest* request = this->queueHead[k];
+        while(request != NULL) {
+            AsyncRequest* next = request->next;
+            if(request->hasDeadline && request->deadline <= now) {
+                if(previous == NULL) {
+                    this->queueHead[k] = next;
+                } else {
+                    previous->next = next;
+                }
+
+                if(this->queueTail[k] == request) {
+                    this->queueTail[k] = previous;
+                }
+
+                request->result = NULL;
+                request->next = expired;
+                expired = request;
+                this->stats.timeoutCount++;
+            } else {
+                if(request->hasDeadline && (!this->hasNextDeadline || request->deadline < this->nextDeadline)) {
+                    this->nextDeadline = request->deadline;
+                    this->hasNextDeadline = true;
+                }
+
+                previous = request;
+            }
+
+            request = next;
+        }
+
+        if(this->queueHead[k] == NULL) {
+            this->heap->waitingOrders &= ~(1u << k);
+        }
+    }
+    this->heap->releaseLock();
+
+    return expired;
+}
+
+/**
+ * Empties every queue, returning the requests (with NULL results) as one list. The heap lock
+ * must be held.
+ */
+AsyncRequest* AsyncAllocator::takeAll() {
+    AsyncRequest* all = NULL;
+    for(int k = 0; k < SIZE_OF_FREE_LIST; k++) {
+        while(this->queueHead[k] != NULL) {
+            AsyncRequest* request = this->queueHead[k];
+            this->queueHead[k] = request->next;
+            request->result = NULL;
+            request->next = all;
+            all = request;
+        }
+
+        this->queueTail[k] = NULL;
+    }
+
+    return all;
+}
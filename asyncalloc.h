@@ -0,0 +1,164 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Async Allocator
+//
+//   Description:  Allocation requests that wait for memory to be freed rather
+//                 than failing straight away, for pipelines where a stage can
+//                 afford to stall until a later stage gives memory back. Both
+//                 a callback form and (under C++20) a co_await form are given.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __ASYNCALLOC_H__
+#define __ASYNCALLOC_H__
+
+// Standard headers go first, as auxiliary.h defines macros (e.g. 'ms') that
+// would otherwise clash with names used inside them.
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+    #include <coroutine>
+    #define ASYNC_ALLOC_COROUTINES
+#endif
+
+#include "buddysys.h"
+
+// Called once a request completes, with the memory (NULL if the request timed
+// out, can never be met, or the allocator was stopped) and the context given
+// with the request. No lock is held while it runs, so it may use the heap and
+// the allocator again (including timed requests), but a timeout's callback, or
+// a coroutine resumed by one, can't stop the allocator.
+typedef void (*AsyncCallback)(void* p, void* context);
+
+// A request waiting in the queue for its order
+typedef struct AsyncRequest {
+    int size;
+    int binK;
+
+    // Requests are served oldest first, across every order that can be met
+    unsigned long long sequence;
+
+    bool hasDeadline;
+    std::chrono::steady_clock::time_point deadline;
+
+    AsyncCallback callback;
+    void* context;
+    void* result;
+
+    AsyncRequest* next;
+} AsyncRequest;
+
+typedef struct AsyncStats {
+    // Requests met straight away, and requests that had to wait
+    long long immediateCount;
+    long long queuedCount;
+
+    // Waiting requests met by a free, and those that gave up
+    long long servedCount;
+    long long timeoutCount;
+
+    // Frees that woke waiters, and the most woken by one of them
+    long long wakeCount;
+    long long largestWake;
+} AsyncStats;
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class AsyncAllocator {
+    BuddySystem* heap;
+
+    // FIFO queue of waiting requests for each order, guarded by the heap lock
+    AsyncRequest* queueHead[SIZE_OF_FREE_LIST];
+    AsyncRequest* queueTail[SIZE_OF_FREE_LIST];
+    unsigned long long nextSequence;
+    AsyncStats stats;
+
+    // The thread expiring requests, which sleeps until the earliest deadline
+    std::thread timer;
+    std::mutex timerLock;
+    std::condition_variable timerWake;
+    std::chrono::steady_clock::time_point nextDeadline;
+    bool hasNextDeadline;
+    std::atomic<bool> running;
+
+    friend class BuddySystem;
+public:
+    AsyncAllocator();
+    ~AsyncAllocator();
+
+    void start(BuddySystem* heap);
+    void stop();
+
+    void mallocAsync(int request_memory, long long timeoutMs, AsyncCallback callback, void* context);
+    bool enqueue(int request_memory, long long timeoutMs, AsyncCallback callback, void* context, void** immediate);
+
+    AsyncStats getStats();
+protected:
+    AsyncRequest* serve();
+    static void complete(AsyncRequest* requests);
+
+    void run();
+    AsyncRequest* expire();
+    AsyncRequest* takeAll();
+};
+
+#ifdef ASYNC_ALLOC_COROUTINES
+
+// co_await AsyncMalloc(&allocator, size, timeoutMs) gives the memory (or NULL, as
+// with the callback form) once it is available. The coroutine is resumed on the
+// thread whose free met the request (or the timer thread, on a timeout).
+class AsyncMalloc {
+    AsyncAllocator* allocator;
+    int size;
+    long long timeoutMs;
+    void* result;
+    std::coroutine_handle<> waiting;
+
+    static void resume(void* p, void* context) {
+        AsyncMalloc* awaiter = (AsyncMalloc*)context;
+        awaiter->result = p;
+        awaiter->waiting.resume();
+    }
+public:
+    AsyncMalloc(AsyncAllocator* allocator, int request_memory, long long timeoutMs = -1) {
+        this->allocator = allocator;
+        this->size = request_memory;
+        this->timeoutMs = timeoutMs;
+        this->result = NULL;
+    }
+
+    bool await_ready() {
+        return false;
+    }
+
+    // Doesn't suspend at all if the memory is there already
+    bool await_suspend(std::coroutine_handle<> handle) {
+        this->waiting = handle;
+        return this->allocator->enqueue(this->size, this->timeoutMs, AsyncMalloc::resume, this, &this->result);
+    }
+
+    void* await_resume() {
+        return this->result;
+    }
+};
+
+// The simplest coroutine type to co_await an AsyncMalloc from: it starts straight
+// away, and cleans up after itself when it finishes.
+struct AsyncTask {
+    struct promise_type {
+        AsyncTask get_return_object() { return AsyncTask(); }
+        std::suspend_never initial_suspend() { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { throw; }
+    };
+};
+
+#endif
+
+#endif
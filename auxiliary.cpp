@@ -25,9 +25,18 @@
 
 #include "auxiliary.h"
 
+#ifndef _WIN32
+    #include <string.h>
+    #include <sys/mman.h>
+    #include <sys/resource.h>
+    #include <unistd.h>
+#endif
+
 
 ////////////////////////////////////////////////////////////////////////////////////
 
+#ifdef _WIN32
+
 //To determine the size of a page and the allocation granularity on the host computer
 void getSystemInfo(){
     SYSTEM_INFO sSysInfo;         // Useful information about the system
@@ -108,6 +117,69 @@ int freepages(void *p) { // free previously allocated pages.
                        //MEM_RELEASE - Decommit the pages and release the entire region of reserved and committed pages. constant is equivalent to 32768
 }
 
+#else
+// POSIX (Linux) versions of the functions above, doing the same with the nearest calls
+
+//To determine the size of a page on the host computer
+void getSystemInfo(){
+    cout << "This computer has page size: " << sysconf(_SC_PAGESIZE) << endl;
+}
+
+//---
+double cputime(void) { // return cpu time used by current process
+    timespec t;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t) == 0)
+      return t.tv_sec + t.tv_nsec * 1e-9;
+
+    return 0;
+}
+//---
+
+DWORDLONG  memory(void) { // return memory available to current process
+   // As with ullAvailVirtual: the address space this process may still use, which is the
+   // RLIMIT_AS limit (or a 47 bit user space, if there is none) less the size of its mappings
+   DWORDLONG limit = 1ULL << 47;
+   rlimit r;
+   if (getrlimit(RLIMIT_AS, &r) == 0 && r.rlim_cur != RLIM_INFINITY)
+      limit = r.rlim_cur;
+
+   DWORDLONG used = 0;
+   FILE* status = fopen("/proc/self/status", "r");
+   if (status != NULL) {
+      char line[256];
+      while (fgets(line, sizeof(line), status) != NULL) {
+         if (strncmp(line, "VmSize:", 7) == 0) {
+            used = strtoull(line + 7, NULL, 10) * 1024; // given in kB
+            break;
+         }
+      }
+      fclose(status);
+   }
+
+   return used < limit ? limit - used : 0;
+}
+
+// munmap needs the size that VirtualFree doesn't, so it is kept in a page of its own in
+// front of the pages handed out
+void  *allocpages(int n) { // allocate n pages and return start address
+   void* p = mmap(NULL, (size_t)(n + 1) * PAGESIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (p == MAP_FAILED)
+      return NULL;
+
+   *(size_t*)p = (size_t)(n + 1) * PAGESIZE;
+   return (char*)p + PAGESIZE;
+}
+//---
+int freepages(void *p) { // free previously allocated pages.
+  if (p == NULL)
+     return 0;
+
+  void* start = (char*)p - PAGESIZE;
+  return munmap(start, *(size_t*)start) == 0;
+}
+
+#endif
+
 //---
 void *mymalloc(int n) { // very simple memory allocation
    void *p;
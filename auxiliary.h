@@ -27,7 +27,13 @@
 #ifndef __AUXILIARY_H__
 #define __AUXILIARY_H__
 
-#include <windows.h>
+#ifdef _WIN32
+    #include <windows.h>
+    #include <tchar.h>
+#else
+    // The Win32 type memory() returns, for the other platforms
+    typedef unsigned long long DWORDLONG;
+#endif
 #include <stdio.h>
 #include <time.h>
 #include <cstdlib>
@@ -35,7 +41,6 @@
 #include <cmath>
 #include <cstdint>  //https://stackoverflow.com/questions/1845482/what-is-uintptr-t-data-type/1846648#1846648
                     //https://stackoverflow.com/questions/1845482/what-is-uintptr-t-data-type 
-#include <tchar.h>
 #include <iostream>
 
 using namespace std;
@@ -65,8 +70,12 @@ using namespace std;
 
 ////////////////////////////////////////////////////////////////
 //---------------------------------
+// Only memory() on Windows uses it; elsewhere it would clash with the ms
+// literals the C++20 standard headers use (e.g. in <atomic>)
+#ifdef _WIN32
 //#define ms MEMORYSTATUS
 #define ms MEMORYSTATUSEX
+#endif
 
 
 // the following is fixed by the OS
@@ -89,7 +98,9 @@ extern unsigned seed;
 
 //To determine the size of a page and the allocation granularity on the host computer
 void getSystemInfo();
+#ifdef _WIN32
 double MakeTime(FILETIME const& kernel_time, FILETIME const& user_time);
+#endif
 double cputime(void);
 
 DWORDLONG memory(void);
@@ -0,0 +1,1167 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Thread Benchmarks
+//
+//   Description:  Multi-threaded stress tests and scaling benchmarks for the
+//                 allocators, alongside the single threaded simulation in
+//                 main.cpp.
+//
+// Notes:
+// * Block sizes (and, for the churn and mixed patterns, the slots freed) come
+//   from the workload given to runThreadBenchmarks (see workload.h), with a
+//   Workload and a seed per thread, as the shared 'seed' used by myrand can't
+//   be used from several threads at once.
+// * As in main.cpp, the first and last byte of every block are written when it
+//   is allocated and checked when it is freed. Blocks that are freed by a
+//   different thread (producer/consumer) are checked by that thread.
+// * Each thread does BENCH_OPS_PER_THREAD operations, so with perfect scaling
+//   the operations per second grow with the number of threads.
+// * The buddy allocators are given their own heaps, so the benchmarks can be
+//   run whichever strategy main.cpp is set up for.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <vector>
+
+#include "benchmark.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+// A bounded queue of blocks, from one producer to one consumer
+typedef struct BenchQueue {
+    std::mutex lock;
+    unsigned char* blocks[BENCH_QUEUE_SIZE];
+    int sizes[BENCH_QUEUE_SIZE];
+    int head;
+    int count;
+
+    // Set by the producer once it has queued everything it is going to
+    bool finished;
+} BenchQueue;
+
+static BuddySystem benchHeap;
+static NumaBuddySystem benchNumaHeap;
+
+static void* buddyMalloc(int size) { return benchHeap.malloc(size); }
+static void buddyFree(void* p) { benchHeap.free(p); }
+static void* numaMalloc(int size) { return benchNumaHeap.malloc(size); }
+static void numaFree(void* p) { benchNumaHeap.free(p); }
+static void* systemMalloc(int size) { return ::malloc(size); }
+static void systemFree(void* p) { ::free(p); }
+
+/**
+ * Writes 'tag' in to the first and last byte of a block, as main.cpp does
+ */
+static void tagBlock(unsigned char* p, int size, unsigned char tag) {
+    p[0] = tag;
+    if(size > 1) {
+        p[size - 1] = tag;
+    }
+}
+
+/**
+ * Returns true if the first and last bytes of the block still hold 'tag'
+ */
+static bool checkBlock(unsigned char* p, int size, unsigned char tag) {
+    return p[0] == tag && (size <= 1 || p[size - 1] == tag);
+}
+
+/**
+ * Frees and reallocates random slots of this thread's own, as the simulation in main.cpp does
+ */
+static void churnWorker(BenchAllocator* allocator, WorkloadConfig workload, BenchResult* result) {
+    Workload random;
+    random.init(workload);
+    int slots = workload.livePointers;
+    std::vector<unsigned char*> blocks(slots, (unsigned char*)NULL);
+    std::vector<int> sizes(slots, 0);
+
+    for(int i = 0; i < BENCH_OPS_PER_THREAD; i++) {
+        int k = random.nextSlot();
+        if(blocks[k] != NULL) {
+            if(!checkBlock(blocks[k], sizes[k], (unsigned char)k)) {
+                result->corruptions++;
+            }
+
+            allocator->free(blocks[k]);
+        }
+
+        sizes[k] = random.nextSize(k);
+        blocks[k] = (unsigned char*)allocator->malloc(sizes[k]);
+        if(blocks[k] == NULL) {
+            result->failures++;
+        } else {
+            tagBlock(blocks[k], sizes[k], (unsigned char)k);
+        }
+
+        result->operations++;
+    }
+
+    for(int k = 0; k < slots; k++) {
+        if(blocks[k] != NULL) {
+            if(!checkBlock(blocks[k], sizes[k], (unsigned char)k)) {
+                result->corruptions++;
+            }
+
+            allocator->free(blocks[k]);
+        }
+    }
+}
+
+/**
+ * Allocates blocks and queues them for the consumer
+ */
+static void producerWorker(BenchAllocator* allocator, BenchQueue* queue, WorkloadConfig workload, BenchResult* result) {
+    Workload random;
+    random.init(workload);
+    for(int i = 0; i < BENCH_OPS_PER_THREAD; i++) {
+        int size = random.nextSize();
+        unsigned char* p = (unsigned char*)allocator->malloc(size);
+        result->operations++;
+        if(p == NULL) {
+            result->failures++;
+            continue;
+        }
+
+        tagBlock(p, size, (unsigned char)size);
+        while(true) {
+            {
+                std::lock_guard<std::mutex> guard(queue->lock);
+                if(queue->count < BENCH_QUEUE_SIZE) {
+                    int tail = (queue->head + queue->count) % BENCH_QUEUE_SIZE;
+                    queue->blocks[tail] = p;
+                    queue->sizes[tail] = size;
+                    queue->count++;
+                    break;
+                }
+            }
+
+            std::this_thread::yield();
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(queue->lock);
+    queue->finished = true;
+}
+
+/**
+ * Checks and frees the blocks queued by the producer, until it is finished
+ */
+static void consumerWorker(BenchAllocator* allocator, BenchQueue* queue, BenchResult* result) {
+    while(true) {
+        unsigned char* p = NULL;
+        int size = 0;
+        bool finished;
+        {
+            std::lock_guard<std::mutex> guard(queue->lock);
+            finished = queue->finished;
+            if(queue->count > 0) {
+                p = queue->blocks[queue->head];
+                size = queue->sizes[queue->head];
+                queue->head = (queue->head + 1) % BENCH_QUEUE_SIZE;
+                queue->count--;
+            }
+        }
+
+        if(p == NULL) {
+            if(finished) {
+                return;
+            }
+
+            std::this_thread::yield();
+            continue;
+        }
+
+        if(!checkBlock(p, size, (unsigned char)size)) {
+            result->corruptions++;
+        }
+
+        allocator->free(p);
+    }
+}
+
+/**
+ * The producer/consumer pattern for a thread without a partner: it produces a queue's worth
+ * of blocks and then consumes them itself
+ */
+static void selfProducerWorker(BenchAllocator* allocator, WorkloadConfig workload, BenchResult* result) {
+    Workload random;
+    random.init(workload);
+    unsigned char* blocks[BENCH_QUEUE_SIZE];
+    int sizes[BENCH_QUEUE_SIZE];
+
+    for(int done = 0; done < BENCH_OPS_PER_THREAD; done += BENCH_QUEUE_SIZE) {
+        int count = 0;
+        for(int i = 0; i < BENCH_QUEUE_SIZE; i++) {
+            int size = random.nextSize();
+            unsigned char* p = (unsigned char*)allocator->malloc(size);
+            result->operations++;
+            if(p == NULL) {
+                result->failures++;
+                continue;
+            }
+
+            tagBlock(p, size, (unsigned char)size);
+            blocks[count] = p;
+            sizes[count++] = size;
+        }
+
+        for(int i = 0; i < count; i++) {
+            if(!checkBlock(blocks[i], sizes[i], (unsigned char)sizes[i])) {
+                result->corruptions++;
+            }
+
+            allocator->free(blocks[i]);
+        }
+    }
+}
+
+/**
+ * Allocates BENCH_BURST_SIZE blocks, then frees them all, over and over
+ */
+static void burstyWorker(BenchAllocator* allocator, WorkloadConfig workload, BenchResult* result) {
+    Workload random;
+    random.init(workload);
+    unsigned char* blocks[BENCH_BURST_SIZE];
+    int sizes[BENCH_BURST_SIZE];
+
+    for(int done = 0; done < BENCH_OPS_PER_THREAD; done += BENCH_BURST_SIZE) {
+        for(int i = 0; i < BENCH_BURST_SIZE; i++) {
+            sizes[i] = random.nextSize();
+            blocks[i] = (unsigned char*)allocator->malloc(sizes[i]);
+            result->operations++;
+            if(blocks[i] == NULL) {
+                result->failures++;
+            } else {
+                tagBlock(blocks[i], sizes[i], (unsigned char)i);
+            }
+        }
+
+        for(int i = 0; i < BENCH_BURST_SIZE; i++) {
+            if(blocks[i] != NULL) {
+                if(!checkBlock(blocks[i], sizes[i], (unsigned char)i)) {
+                    result->corruptions++;
+                }
+
+                allocator->free(blocks[i]);
+            }
+        }
+    }
+}
+
+/**
+ * Keeps 'slots' long lived blocks, one of which is replaced every 64 operations, while every
+ * other operation is a short lived block that is freed 8 operations later
+ */
+static void mixedWorker(BenchAllocator* allocator, WorkloadConfig workload, BenchResult* result) {
+    const int window = 8;
+    Workload random;
+    random.init(workload);
+    int slots = workload.livePointers;
+    std::vector<unsigned char*> longLived(slots, (unsigned char*)NULL);
+    std::vector<int> longSizes(slots, 0);
+    unsigned char* shortLived[window] = { NULL };
+    int shortSizes[window] = { 0 };
+
+    for(int i = 0; i < BENCH_OPS_PER_THREAD; i++) {
+        unsigned char** block;
+        int* size;
+        unsigned char tag;
+        int slot = -1;
+        if(i % 64 == 0) {
+            slot = random.nextSlot();
+            block = &longLived[slot];
+            size = &longSizes[slot];
+            tag = (unsigned char)slot;
+        } else {
+            block = &shortLived[i % window];
+            size = &shortSizes[i % window];
+            tag = (unsigned char)(i % window + 128);
+        }
+
+        if(*block != NULL) {
+            if(!checkBlock(*block, *size, tag)) {
+                result->corruptions++;
+            }
+
+            allocator->free(*block);
+        }
+
+        *size = random.nextSize(slot);
+        *block = (unsigned char*)allocator->malloc(*size);
+        result->operations++;
+        if(*block == NULL) {
+            result->failures++;
+        } else {
+            tagBlock(*block, *size, tag);
+        }
+    }
+
+    for(int k = 0; k < slots; k++) {
+        if(longLived[k] != NULL) {
+            allocator->free(longLived[k]);
+        }
+    }
+
+    for(int k = 0; k < window; k++) {
+        if(shortLived[k] != NULL) {
+            allocator->free(shortLived[k]);
+        }
+    }
+}
+
+/**
+ * Runs one pattern against one allocator with 'threads' threads, returning the totals
+ * across every thread.
+ */
+BenchResult runBenchmark(BenchAllocator* allocator, BenchPattern pattern, int threads, WorkloadConfig workload) {
+    std::vector<BenchResult> results(threads, BenchResult());
+    std::vector<BenchQueue> queues(threads / 2);
+    std::vector<std::thread> workers;
+
+    // The live pointers are shared out between the threads, so the amount of live memory
+    // doesn't grow with the thread count
+    workload.livePointers = workload.livePointers / threads > 0 ? workload.livePointers / threads : 1;
+    auto start = std::chrono::steady_clock::now();
+    for(int t = 0; t < threads; t++) {
+        // Every thread gets its own sequence of sizes
+        WorkloadConfig config = workload;
+        config.seed = workload.seed + t * 7919;
+        BenchResult* result = &results[t];
+
+        switch(pattern) {
+            case BENCH_CHURN:
+                workers.push_back(std::thread(churnWorker, allocator, config, result));
+                break;
+            case BENCH_PRODUCER_CONSUMER:
+                if(t == threads - 1 && threads % 2 == 1) {
+                    workers.push_back(std::thread(selfProducerWorker, allocator, config, result));
+                } else if(t % 2 == 0) {
+                    BenchQueue* queue = &queues[t / 2];
+                    queue->head = 0;
+                    queue->count = 0;
+                    queue->finished = false;
+                    workers.push_back(std::thread(producerWorker, allocator, queue, config, result));
+                } else {
+                    workers.push_back(std::thread(consumerWorker, allocator, &queues[t / 2], result));
+                }
+                break;
+            case BENCH_BURSTY:
+                workers.push_back(std::thread(burstyWorker, allocator, config, result));
+                break;
+            case BENCH_MIXED:
+                workers.push_back(std::thread(mixedWorker, allocator, config, result));
+                break;
+        }
+    }
+
+    for(size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    BenchResult total = BenchResult();
+    total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for(int t = 0; t < threads; t++) {
+        total.operations += results[t].operations;
+        total.failures += results[t].failures;
+        total.corruptions += results[t].corruptions;
+    }
+
+    return total;
+}
+
+void runThreadBenchmarks(int maxThreads, WorkloadConfig workload) {
+    const char* patternNames[] = { "thread private churn", "producer/consumer", "bursty allocate/free all", "long and short lived mix" };
+    BenchAllocator allocators[] = {
+        { "Buddy System", buddyMalloc, buddyFree },
+        { "NUMA Buddy System", numaMalloc, numaFree },
+        { "malloc", systemMalloc, systemFree }
+    };
+
+    // Each buddy heap gets its own memory, locked so it can be shared between the threads
+    benchHeap.init((Node*)platformAllocPages(BENCH_HEAP_SIZE), BENCH_HEAP_SIZE, true);
+    benchHeap.setThreadSafe(true);
+    benchNumaHeap.init(BENCH_HEAP_SIZE);
+
+    Workload named;
+    named.init(workload);
+    const char* workloadName = named.getName();
+
+    for(int pattern = BENCH_CHURN; pattern <= BENCH_MIXED; pattern++) {
+        printf("\n==== %s, %s workload, %d operations per thread ====\n", patternNames[pattern], workloadName, BENCH_OPS_PER_THREAD);
+        printf("%-20s %8s %12s %9s %10s %12s\n", "allocator", "threads", "Mops/sec", "scaling", "failed", "corrupted");
+
+        for(int a = 0; a < (int)(sizeof(allocators) / sizeof(allocators[0])); a++) {
+            double single = 0;
+            for(int threads = 1; threads <= maxThreads; threads = threads * 2 > maxThreads && threads < maxThreads ? maxThreads : threads * 2) {
+                BenchResult result = runBenchmark(&allocators[a], (BenchPattern)pattern, threads, workload);
+                double rate = result.operations / result.seconds;
+                if(threads == 1) {
+                    single = rate;
+                }
+
+                printf("%-20s %8d %12.3f %8.2fx %10lld %12lld\n", allocators[a].name, threads, rate / 1e6, rate / single, result.failures, result.corruptions);
+            }
+        }
+    }
+}
+
+// A node of the lists walked by the locality benchmark; 64 bytes with its header
+typedef struct LocalityNode {
+    LocalityNode* next;
+    long long value;
+    char payload[40];
+} LocalityNode;
+
+/**
+ * Builds the locality benchmark's lists in a new heap, with mallocNear if 'near' is set, walks
+ * them, and prints a row of results. Every run makes the same requests in the same order.
+ */
+static void localityRun(bool near, WorkloadConfig workload) {
+    void* memory = platformAllocPages(BENCH_HEAP_SIZE);
+    if(memory == NULL) {
+        printf("Failed to map %lld bytes for the locality benchmark\n", (long long)BENCH_HEAP_SIZE);
+        return;
+    }
+
+    BuddySystem heap;
+    heap.init((Node*)memory, BENCH_HEAP_SIZE, true);
+
+    Workload random;
+    random.init(workload);
+    int slots = workload.livePointers;
+    std::vector<void*> background(slots, (void*)NULL);
+    for(int s = 0; s < slots; s++) {
+        background[s] = heap.malloc(random.nextSize(s));
+    }
+
+    std::vector<LocalityNode*> heads(LOCALITY_LISTS, (LocalityNode*)NULL);
+    std::vector<LocalityNode*> tails(LOCALITY_LISTS, (LocalityNode*)NULL);
+    long long built = 0;
+    for(int round = 0; round < LOCALITY_NODES; round++) {
+        for(int l = 0; l < LOCALITY_LISTS; l++) {
+            LocalityNode* node;
+            if(near && tails[l] != NULL) {
+                node = (LocalityNode*)heap.mallocNear(tails[l], sizeof(LocalityNode));
+            } else {
+                node = (LocalityNode*)heap.malloc(sizeof(LocalityNode));
+            }
+
+            if(node == NULL) {
+                continue;
+            }
+
+            node->next = NULL;
+            node->value = round;
+            if(tails[l] == NULL) {
+                heads[l] = node;
+            } else {
+                tails[l]->next = node;
+            }
+
+            tails[l] = node;
+            built++;
+        }
+
+        for(int c = 0; c < LOCALITY_CHURN; c++) {
+            int s = random.nextSlot();
+            heap.free(background[s]);
+            background[s] = heap.malloc(random.nextSize(s));
+        }
+    }
+
+    // Where the hops land is worked out from the addresses: a hop to another page needs
+    // another TLB entry (and the line it lands on is less likely to be cached)
+    long long hops = 0;
+    long long pageHops = 0;
+    long long hugePageHops = 0;
+    for(int l = 0; l < LOCALITY_LISTS; l++) {
+        for(LocalityNode* node = heads[l]; node != NULL && node->next != NULL; node = node->next) {
+            uintptr_t from = (uintptr_t)node;
+            uintptr_t to = (uintptr_t)node->next;
+            hops++;
+            pageHops += from / PAGESIZE != to / PAGESIZE;
+            hugePageHops += from >> NEAR_HUGE_PAGE_ORDER != to >> NEAR_HUGE_PAGE_ORDER;
+        }
+    }
+
+    long long sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int w = 0; w < LOCALITY_WALKS; w++) {
+        for(int l = 0; l < LOCALITY_LISTS; l++) {
+            for(LocalityNode* node = heads[l]; node != NULL; node = node->next) {
+                sum += node->value;
+            }
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    BuddyStats stats = heap.getStats();
+    printf("%-12s %8lld %10.2f %11.2f%% %11.2f%% %9lld %9lld %9lld %9lld   (checksum %lld)\n",
+           near ? "mallocNear" : "malloc", built, seconds * 1e9 / (built * (double)LOCALITY_WALKS),
+           100.0 * pageHops / (hops > 0 ? hops : 1), 100.0 * hugePageHops / (hops > 0 ? hops : 1),
+           stats.nearPageCount, stats.nearHugePageCount, stats.nearHeapCount, stats.nearFallbackCount, sum);
+
+    platformFreeRegion(memory, BENCH_HEAP_SIZE);
+}
+
+void runLocalityBenchmark(WorkloadConfig workload) {
+    Workload named;
+    named.init(workload);
+
+    printf("\n==== pointer chasing, %d lists of %d nodes among %d %s workload blocks ====\n", LOCALITY_LISTS, LOCALITY_NODES, workload.livePointers, named.getName());
+    printf("%-12s %8s %10s %12s %12s %9s %9s %9s %9s\n", "allocator", "nodes", "ns/hop", "page hops", "2MB hops", "in page", "in 2MB", "in half", "fallback");
+    localityRun(false, workload);
+    localityRun(true, workload);
+}
+
+/**
+ * Allocates the colouring benchmark's objects in a new heap, coloured from order 'colourOrder'
+ * (0 for none), walks their first cache lines, and prints a row of results.
+ */
+static void colouringRun(int colourOrder) {
+    void* memory = platformAllocPages(BENCH_HEAP_SIZE);
+    if(memory == NULL) {
+        printf("Failed to map %lld bytes for the colouring benchmark\n", (long long)BENCH_HEAP_SIZE);
+        return;
+    }
+
+    BuddySystem heap;
+    heap.init((Node*)memory, BENCH_HEAP_SIZE, true);
+    heap.setColouring(colourOrder);
+
+    std::vector<long long*> objects;
+    for(int i = 0; i < COLOUR_OBJECTS; i++) {
+        long long* object = (long long*)heap.malloc(COLOUR_OBJECT_SIZE);
+        if(object == NULL) {
+            break;
+        }
+
+        for(int w = 0; w < COLOUR_OBJECT_SIZE / (int)sizeof(long long); w++) {
+            object[w] = i + w;
+        }
+        objects.push_back(object);
+    }
+
+    // The L1 set (of 64, for a 32KB 8 way cache) each object's first cache line falls in
+    bool setUsed[COLOUR_LINES] = { false };
+    int setsUsed = 0;
+    for(size_t i = 0; i < objects.size(); i++) {
+        int set = (int)(((uintptr_t)objects[i] / CACHE_LINE_SIZE) % COLOUR_LINES);
+        setsUsed += !setUsed[set];
+        setUsed[set] = true;
+    }
+
+    // The first word of each object points to the next, so a walk is a chain of dependent
+    // loads (as a linked structure would be), and each miss costs its full latency
+    for(size_t i = 0; i < objects.size(); i++) {
+        objects[i][0] = (long long)(uintptr_t)objects[(i + 1) % objects.size()];
+    }
+
+    PerfCounters counters;
+    counters.open();
+    counters.start();
+    long long sum = 0;
+    long long* object = objects.empty() ? NULL : objects[0];
+    for(long long r = 0; object != NULL && r < (long long)objects.size() * COLOUR_WALKS; r++) {
+        sum += object[1];
+        object = (long long*)(uintptr_t)object[0];
+    }
+    counters.stop();
+
+    PerfReading reading = counters.getReading();
+    long long reads = (long long)objects.size() * COLOUR_WALKS;
+    printf("%-16s %8d %10d %10.2f", colourOrder > 0 ? "coloured" : "not coloured", (int)objects.size(), setsUsed, reading.seconds * 1e9 / (reads > 0 ? reads : 1));
+    for(int c = PERF_CACHE_MISSES; c <= PERF_DTLB_MISSES; c++) {
+        if(reading.source[c] == PERF_SOURCE_EVENT) {
+            printf(" %14.4f", (double)reading.value[c] / (reads > 0 ? reads : 1));
+        } else {
+            printf(" %14s", "n/a");
+        }
+    }
+    printf("   (checksum %lld)\n", sum);
+
+    platformFreeRegion(memory, BENCH_HEAP_SIZE);
+}
+
+void runColouringBenchmark() {
+    printf("\n==== cache colouring, %d objects of %d bytes, first cache line walked %d times ====\n", COLOUR_OBJECTS, COLOUR_OBJECT_SIZE, COLOUR_WALKS);
+    printf("%-16s %8s %10s %10s %14s %14s\n", "heap", "objects", "L1 sets", "ns/object", "misses/object", "dTLB/object");
+    colouringRun(0);
+    colouringRun(12);
+}
+
+/**
+ * Mallocs PREFAULT_PASS_BYTES of blocks from 'heap', writing a byte to each page of each one,
+ * then frees them. Prints the time the pass took, the worst malloc (and writes), and the page
+ * faults taken.
+ */
+static void prefaultPass(BuddySystem* heap) {
+    std::vector<void*> blocks;
+    long long pageFaults, contextSwitches, faultsBefore;
+    platformProcessCounts(&faultsBefore, &contextSwitches);
+
+    long long worst = 0;
+    long long start = platformNanoseconds();
+    for(long long used = 0; used < PREFAULT_PASS_BYTES; used += PREFAULT_BLOCK_SIZE) {
+        long long before = platformNanoseconds();
+        unsigned char* p = (unsigned char*)heap->malloc(PREFAULT_BLOCK_SIZE);
+        if(p == NULL) {
+            break;
+        }
+
+        for(int b = 0; b < PREFAULT_BLOCK_SIZE; b += PAGESIZE) {
+            p[b] = 1;
+        }
+
+        long long took = platformNanoseconds() - before;
+        worst = took > worst ? took : worst;
+        blocks.push_back(p);
+    }
+
+    long long elapsed = platformNanoseconds() - start;
+    platformProcessCounts(&pageFaults, &contextSwitches);
+    printf(" | %10.1f %10.2f %10.1f %12lld", elapsed * 1e-6, elapsed * 1e-3 / (blocks.empty() ? 1 : blocks.size()), worst * 1e-3, pageFaults - faultsBefore);
+
+    for(size_t i = 0; i < blocks.size(); i++) {
+        heap->free(blocks[i]);
+    }
+}
+
+/**
+ * Starts a PREFAULT_HEAP_ORDER heap, faulting in 'bytes' of it (-1 for all of it, 0 for none)
+ * on 'threads' threads, then runs two passes over it and prints a row of results.
+ */
+static void prefaultRun(const char* name, long long bytes, int threads) {
+    long long heapSize = 1LL << PREFAULT_HEAP_ORDER;
+    long long start = platformNanoseconds();
+    void* memory = platformAllocPages(heapSize);
+    if(memory == NULL) {
+        printf("Failed to map %lld bytes for the pre-faulting benchmark\n", heapSize);
+        return;
+    }
+
+    BuddySystem heap;
+    heap.init((Node*)memory, heapSize, true);
+    if(bytes != 0) {
+        heap.prefault(bytes, threads);
+    }
+
+    printf("%-22s %10.1f", name, (platformNanoseconds() - start) * 1e-6);
+    prefaultPass(&heap);
+    prefaultPass(&heap);
+    printf("\n");
+
+    platformFreeRegion(memory, heapSize);
+}
+
+void runPrefaultBenchmark() {
+    printf("\n==== pre-faulting a %lld MB heap, then %lld MB of %d byte mallocs, twice ====\n", (1LL << PREFAULT_HEAP_ORDER) >> 20, PREFAULT_PASS_BYTES >> 20, PREFAULT_BLOCK_SIZE);
+    printf("%-22s %10s | %10s %10s %10s %12s | %10s %10s %10s %12s\n", "start", "start ms", "pass 1 ms", "us/malloc", "worst us", "page faults", "pass 2 ms", "us/malloc", "worst us", "page faults");
+
+    char name[64];
+    prefaultRun("none", 0, 1);
+    snprintf(name, sizeof(name), "first %lld MB", PREFAULT_LAZY_BYTES >> 20);
+    prefaultRun(name, PREFAULT_LAZY_BYTES, 1);
+    prefaultRun("all, 1 thread", -1, 1);
+    snprintf(name, sizeof(name), "all, %d threads", PREFAULT_BENCH_THREADS);
+    prefaultRun(name, -1, PREFAULT_BENCH_THREADS);
+}
+
+// The nodes of the reference benchmark's lists
+struct PointerListNode {
+    PointerListNode* next;
+    int key;
+};
+
+struct RefListNode {
+    BuddyRef next;
+    int key;
+};
+
+/**
+ * Builds the reference benchmark's list (linked by BuddyRefs if 'refs' is true, and by
+ * pointers otherwise) in a new heap, walks it, and prints a row of results. The nodes are
+ * malloc'd one after the other, so the list runs through the heap in address order.
+ */
+static void refRun(bool refs) {
+    long long heapSize = 1LL << REF_HEAP_ORDER;
+    void* memory = platformAllocPages(heapSize);
+    if(memory == NULL) {
+        printf("Failed to map %lld bytes for the reference benchmark\n", heapSize);
+        return;
+    }
+
+    BuddySystem heap;
+    heap.init((Node*)memory, heapSize, true);
+
+    long long sum = 0;
+    long long start;
+    long long elapsed;
+    int nodes = 0;
+    if(refs) {
+        BuddyRef head = BUDDY_NULL_REF;
+        RefListNode* last = NULL;
+        for(; nodes < REF_NODES; nodes++) {
+            BuddyRef ref = heap.mallocRef(sizeof(RefListNode));
+            if(ref == BUDDY_NULL_REF) {
+                break;
+            }
+
+            RefListNode* node = (RefListNode*)heap.fromRef(ref);
+            node->next = BUDDY_NULL_REF;
+            node->key = nodes;
+            if(last == NULL) {
+                head = ref;
+            } else {
+                last->next = ref;
+            }
+            last = node;
+        }
+
+        start = platformNanoseconds();
+        for(int w = 0; w < REF_WALKS; w++) {
+            for(BuddyRef ref = head; ref != BUDDY_NULL_REF; ) {
+                RefListNode* node = (RefListNode*)heap.fromRef(ref);
+                sum += node->key;
+                ref = node->next;
+            }
+        }
+        elapsed = platformNanoseconds() - start;
+    } else {
+        PointerListNode* head = NULL;
+        PointerListNode* last = NULL;
+        for(; nodes < REF_NODES; nodes++) {
+            PointerListNode* node = (PointerListNode*)heap.malloc(sizeof(PointerListNode));
+            if(node == NULL) {
+                break;
+            }
+
+            node->next = NULL;
+            node->key = nodes;
+            if(last == NULL) {
+                head = node;
+            } else {
+                last->next = node;
+            }
+            last = node;
+        }
+
+        start = platformNanoseconds();
+        for(int w = 0; w < REF_WALKS; w++) {
+            for(PointerListNode* node = head; node != NULL; node = node->next) {
+                sum += node->key;
+            }
+        }
+        elapsed = platformNanoseconds() - start;
+    }
+
+    BuddyStats stats = heap.getStats();
+    long long blockSize = nodes > 0 ? stats.bytesAllocated / nodes : 0;
+    printf("%-10s %10d %10d %12lld %10lld %10lld %10.2f   (checksum %lld)\n", refs ? "BuddyRef" : "pointer", nodes, refs ? (int)sizeof(RefListNode) : (int)sizeof(PointerListNode),
+           stats.bytesAllocated, blockSize, blockSize > 0 ? CACHE_LINE_SIZE / blockSize : 0, elapsed / ((double)nodes * REF_WALKS + 1), sum);
+
+    platformFreeRegion(memory, heapSize);
+}
+
+void runRefBenchmark() {
+    printf("\n==== a list of %d nodes linked by pointers and by 32 bit references, walked %d times ====\n", REF_NODES, REF_WALKS);
+    printf("%-10s %10s %10s %12s %10s %10s %10s\n", "links", "nodes", "node size", "heap bytes", "block", "per line", "ns/node");
+    refRun(false);
+    refRun(true);
+}
+
+// A growable buffer of the append benchmark
+struct AppendBuffer {
+    unsigned char* data;
+    long long size;
+    long long capacity;
+};
+
+/**
+ * Runs the append benchmark, growing the capacity of a full buffer to 'growth' percent of
+ * what it was, with mallocAtLeast (so that it takes the whole of its block as its capacity)
+ * if 'feedback' is true, and with malloc otherwise. Prints a row of results.
+ */
+static void appendRun(bool feedback, int growth) {
+    void* memory = platformAllocPages(BENCH_HEAP_SIZE);
+    if(memory == NULL) {
+        printf("Failed to map %lld bytes for the append benchmark\n", (long long)BENCH_HEAP_SIZE);
+        return;
+    }
+
+    BuddySystem heap;
+    heap.init((Node*)memory, BENCH_HEAP_SIZE, true);
+
+    std::vector<AppendBuffer> buffers(APPEND_BUFFERS);
+    unsigned char piece[APPEND_PIECE];
+    memset(piece, 'x', sizeof(piece));
+
+    long long grows = 0;
+    long long copied = 0;
+    long long failed = 0;
+    unsigned int random = 12345;
+    long long start = platformNanoseconds();
+    for(int round = 0; round < APPEND_ROUNDS; round++) {
+        for(int b = 0; b < APPEND_BUFFERS; b++) {
+            buffers[b].data = NULL;
+            buffers[b].size = 0;
+            buffers[b].capacity = 0;
+        }
+
+        // Every buffer gets a piece in turn, so their growth is interleaved as it would be
+        // for a set of strings being built up together
+        for(int full = 0; full < APPEND_BUFFERS; ) {
+            full = 0;
+            for(int b = 0; b < APPEND_BUFFERS; b++) {
+                AppendBuffer* buffer = &buffers[b];
+                if(buffer->size >= APPEND_BYTES) {
+                    full++;
+                    continue;
+                }
+
+                random = random * 1103515245 + 12345;
+                int length = 1 + (int)((random >> 16) % APPEND_PIECE);
+                if(buffer->size + length > buffer->capacity) {
+                    long long wanted = buffer->capacity * growth / 100;
+                    wanted = wanted > buffer->size + length ? wanted : buffer->size + length;
+                    wanted = wanted > 16 ? wanted : 16;
+
+                    long long capacity = wanted;
+                    unsigned char* grown = (unsigned char*)(feedback ? heap.mallocAtLeast((int)wanted, &capacity) : heap.malloc((int)wanted));
+                    if(grown == NULL) {
+                        failed++;
+                        buffer->size = APPEND_BYTES;
+                        continue;
+                    }
+
+                    if(buffer->data != NULL) {
+                        memcpy(grown, buffer->data, buffer->size);
+                        heap.free(buffer->data);
+                    }
+
+                    copied += buffer->size;
+                    grows++;
+                    buffer->data = grown;
+                    buffer->capacity = capacity;
+                }
+
+                memcpy(buffer->data + buffer->size, piece, length);
+                buffer->size += length;
+            }
+        }
+
+        for(int b = 0; b < APPEND_BUFFERS; b++) {
+            if(buffers[b].data != NULL) {
+                heap.free(buffers[b].data);
+            }
+        }
+    }
+
+    long long elapsed = platformNanoseconds() - start;
+    long long buffersBuilt = (long long)APPEND_BUFFERS * APPEND_ROUNDS;
+    printf("%-16s %6d%% %10.2f %12.1f %10.3f %10lld\n", feedback ? "mallocAtLeast" : "malloc", growth, (double)grows / buffersBuilt, (double)copied / buffersBuilt, elapsed * 1e-6, failed);
+
+    platformFreeRegion(memory, BENCH_HEAP_SIZE);
+}
+
+void runAppendBenchmark() {
+    printf("\n==== %d buffers grown side by side to %d bytes, %d times ====\n", APPEND_BUFFERS, APPEND_BYTES, APPEND_ROUNDS);
+    printf("%-16s %7s %10s %12s %10s %10s\n", "growth by", "growth", "grows", "bytes copied", "ms", "failed");
+    appendRun(false, 200);
+    appendRun(true, 200);
+    appendRun(false, 150);
+    appendRun(true, 150);
+}
+
+/**
+ * Runs the workload's churn in a new heap of 2^heapOrder bytes, with mallocVectored if
+ * 'vectored' is set and malloc otherwise, and prints a row of results. The first and last
+ * byte of each request are written and checked, as main.cpp does.
+ */
+static void vectoredRun(int heapOrder, bool vectored, WorkloadConfig workload) {
+    long long heapSize = 1LL << heapOrder;
+    void* memory = platformAllocPages(heapSize);
+    if(memory == NULL) {
+        printf("Failed to map %lld bytes for the vectored benchmark\n", heapSize);
+        return;
+    }
+
+    BuddySystem heap;
+    heap.init((Node*)memory, heapSize, true);
+
+    Workload random;
+    random.init(workload);
+    int slots = workload.livePointers;
+    std::vector<BuddyIoVec> pieces((size_t)slots * VECTORED_SEGMENTS);
+    std::vector<int> counts(slots, 0);
+
+    long long failed = 0;
+    long long split = 0;
+    long long splitPieces = 0;
+    long long corruptions = 0;
+    long long start = platformNanoseconds();
+    for(long long i = 0; i < workload.iterations; i++) {
+        int k = random.nextSlot();
+        BuddyIoVec* iov = &pieces[(size_t)k * VECTORED_SEGMENTS];
+        if(counts[k] > 0) {
+            BuddyIoVec* last = &iov[counts[k] - 1];
+            if(((unsigned char*)iov[0].base)[0] != (unsigned char)k || ((unsigned char*)last->base)[last->length - 1] != (unsigned char)k) {
+                corruptions++;
+            }
+
+            heap.freeVectored(iov, counts[k]);
+            counts[k] = 0;
+        }
+
+        int size = random.nextSize(k);
+        if(vectored) {
+            counts[k] = heap.mallocVectored(size, VECTORED_SEGMENTS, iov);
+        } else {
+            iov[0].base = heap.malloc(size);
+            iov[0].length = size;
+            counts[k] = iov[0].base != NULL ? 1 : 0;
+        }
+
+        if(counts[k] == 0) {
+            failed++;
+            continue;
+        }
+
+        if(counts[k] > 1) {
+            split++;
+            splitPieces += counts[k];
+        }
+
+        BuddyIoVec* last = &iov[counts[k] - 1];
+        ((unsigned char*)iov[0].base)[0] = (unsigned char)k;
+        ((unsigned char*)last->base)[last->length - 1] = (unsigned char)k;
+    }
+    long long elapsed = platformNanoseconds() - start;
+
+    for(int k = 0; k < slots; k++) {
+        heap.freeVectored(&pieces[(size_t)k * VECTORED_SEGMENTS], counts[k]);
+    }
+
+    printf("%6lldMB %-16s %10lld %8lld %8.3f%% %9lld %11.2f %10.3f %6lld\n", heapSize >> 20, vectored ? "mallocVectored" : "malloc",
+           (long long)workload.iterations, failed, 100.0 * failed / (workload.iterations > 0 ? workload.iterations : 1),
+           split, split > 0 ? (double)splitPieces / split : 0.0, elapsed * 1e-6, corruptions);
+
+    platformFreeRegion(memory, heapSize);
+}
+
+void runVectoredBenchmark(WorkloadConfig workload) {
+    Workload named;
+    named.init(workload);
+
+    int orders[] = VECTORED_HEAP_ORDERS;
+    printf("\n==== %s workload, %d live pointers, in heaps near capacity, up to %d pieces ====\n", named.getName(), workload.livePointers, VECTORED_SEGMENTS);
+    printf("%8s %-16s %10s %8s %9s %9s %11s %10s %6s\n", "heap", "allocator", "requests", "failed", "", "split", "pieces", "ms", "bad");
+    for(int o = 0; o < (int)(sizeof(orders) / sizeof(orders[0])); o++) {
+        vectoredRun(orders[o], false, workload);
+        vectoredRun(orders[o], true, workload);
+    }
+}
+
+#ifdef ASYNC_ALLOC_COROUTINES
+
+// What one awaited malloc of the async exercise got, set when its coroutine finishes
+typedef struct AsyncOutcome {
+    void* p;
+    std::atomic<bool> done;
+} AsyncOutcome;
+
+/**
+ * A coroutine awaiting 'size' bytes for up to 'timeoutMs' milliseconds (-1 for as long as it
+ * takes). It runs up to the co_await in the caller, and finishes on whichever thread meets
+ * (or expires) the request.
+ */
+static AsyncTask awaitMalloc(AsyncAllocator* allocator, int size, long long timeoutMs, AsyncOutcome* outcome) {
+    void* p = co_await AsyncMalloc(allocator, size, timeoutMs);
+    outcome->p = p;
+    outcome->done.store(true);
+}
+
+void runAsyncExercise() {
+    long long heapSize = 1LL << ASYNC_EXERCISE_HEAP_ORDER;
+    void* memory = platformAllocPages(heapSize);
+    if(memory == NULL) {
+        printf("Failed to map %lld bytes for the async exercise\n", heapSize);
+        return;
+    }
+
+    BuddySystem heap;
+    heap.init((Node*)memory, heapSize, true);
+    AsyncAllocator allocator;
+    allocator.start(&heap);
+
+    printf("\n==== co_await AsyncMalloc of %d bytes from a full %lldKB heap ====\n", ASYNC_EXERCISE_SIZE, heapSize >> 10);
+
+    // The whole heap in one block, so both requests have to wait
+    void* filler = heap.malloc((int)(heapSize - NODE_HEADER_SIZE));
+
+    AsyncOutcome queued;
+    queued.p = NULL;
+    queued.done.store(false);
+    AsyncOutcome timed;
+    timed.p = NULL;
+    timed.done.store(false);
+
+    awaitMalloc(&allocator, ASYNC_EXERCISE_SIZE, -1, &queued);
+    awaitMalloc(&allocator, ASYNC_EXERCISE_SIZE, ASYNC_EXERCISE_TIMEOUT_MS, &timed);
+    printf("%-28s %s\n", "after the co_awaits:", queued.done || timed.done ? "finished early (the heap wasn't full)" : "both waiting");
+
+    // The timer thread resumes the request with a deadline once it has passed
+    std::this_thread::sleep_for(std::chrono::milliseconds(ASYNC_EXERCISE_TIMEOUT_MS * 4));
+    printf("%-28s %s, with %s\n", "timed out request:", timed.done ? "finished" : "still waiting", timed.p == NULL ? "NULL" : "memory");
+    printf("%-28s %s\n", "queued request:", queued.done ? "finished" : "still waiting");
+
+    // The free meets the queued request, which is resumed on this thread before free returns
+    heap.free(filler);
+    printf("%-28s %s, with %s\n", "queued request after free:", queued.done ? "finished" : "still waiting", queued.p == NULL ? "NULL" : "memory");
+
+    AsyncStats stats = allocator.getStats();
+    printf("queued %lld, served %lld, timed out %lld, immediate %lld\n", stats.queuedCount, stats.servedCount, stats.timeoutCount, stats.immediateCount);
+
+    allocator.stop();
+    if(queued.p != NULL) {
+        heap.free(queued.p);
+    }
+
+    platformFreeRegion(memory, heapSize);
+}
+
+#else
+
+void runAsyncExercise() {
+    printf("\nThe async exercise co_awaits its requests, which needs a C++20 build: make cpp20\n");
+}
+
+#endif
+
+// The handle table is too large to keep on the stack
+static HandleHeap compactionHandles;
+
+/**
+ * Runs the workload's churn through handles in a new heap of 2^heapOrder bytes, running a
+ * slice of 'sliceBlocks' blocks of the compactor after every request, and (if 'retry' is set)
+ * compacting before retrying a request that failed, then prints a row of results. With
+ * 'pinSome', every COMPACTION_PINNED_EVERY'th request keeps its handle pinned while it is live.
+ */
+static void compactionRun(int heapOrder, int sliceBlocks, bool retry, bool pinSome, WorkloadConfig workload) {
+    long long heapSize = 1LL << heapOrder;
+    void* memory = platformAllocPages(heapSize);
+    if(memory == NULL) {
+        printf("Failed to map %lld bytes for the compaction benchmark\n", heapSize);
+        return;
+    }
+
+    BuddySystem heap;
+    heap.init((Node*)memory, heapSize, true);
+    compactionHandles.init(&heap);
+
+    Workload random;
+    random.init(workload);
+    int slots = workload.livePointers;
+    std::vector<BuddyHandle> handles(slots, 0);
+    std::vector<int> sizes(slots, 0);
+    std::vector<bool> pinned(slots, false);
+
+    long long failed = 0;
+    long long large = 0;
+    long long largeFailed = 0;
+    long long corruptions = 0;
+    long long start = platformNanoseconds();
+    for(long long i = 0; i < workload.iterations; i++) {
+        int k = random.nextSlot();
+        if(handles[k] != 0) {
+            if(!checkBlock((unsigned char*)compactionHandles.pin(handles[k]), sizes[k], (unsigned char)k)) {
+                corruptions++;
+            }
+
+            compactionHandles.unpin(handles[k]);
+            if(pinned[k]) {
+                compactionHandles.unpin(handles[k]);
+            }
+
+            compactionHandles.freeHandle(handles[k]);
+        }
+
+        int size = random.nextSize(k);
+        handles[k] = compactionHandles.allocHandle(size);
+        if(handles[k] == 0 && retry) {
+            compactionHandles.compact(COMPACTION_RETRY_BLOCKS);
+            handles[k] = compactionHandles.allocHandle(size);
+        }
+
+        if(size >= COMPACTION_LARGE_REQUEST) {
+            large++;
+        }
+
+        if(handles[k] == 0) {
+            failed++;
+            largeFailed += size >= COMPACTION_LARGE_REQUEST ? 1 : 0;
+        } else {
+            sizes[k] = size;
+            pinned[k] = pinSome && i % COMPACTION_PINNED_EVERY == 0;
+            tagBlock((unsigned char*)compactionHandles.pin(handles[k]), size, (unsigned char)k);
+            if(!pinned[k]) {
+                compactionHandles.unpin(handles[k]);
+            }
+        }
+
+        if(sliceBlocks > 0) {
+            compactionHandles.compact(sliceBlocks);
+        }
+    }
+    long long elapsed = platformNanoseconds() - start;
+
+    for(int k = 0; k < slots; k++) {
+        if(handles[k] != 0) {
+            if(pinned[k]) {
+                compactionHandles.unpin(handles[k]);
+            }
+
+            compactionHandles.freeHandle(handles[k]);
+        }
+    }
+
+    char label[32];
+    if(sliceBlocks > 0) {
+        snprintf(label, sizeof(label), "compact(%d)%s", sliceBlocks, pinSome ? " pinned" : "");
+    } else if(retry) {
+        snprintf(label, sizeof(label), "on failure(%d)", COMPACTION_RETRY_BLOCKS);
+    } else {
+        snprintf(label, sizeof(label), "none");
+    }
+
+    CompactStats stats = compactionHandles.getStats();
+    printf("%6lldMB %-18s %10lld %8lld %8lld %8lld %8.3f%% %9lld %9lld %10.3f %6lld\n", heapSize >> 20, label,
+           (long long)workload.iterations, failed, large, largeFailed, 100.0 * largeFailed / (large > 0 ? large : 1),
+           stats.blocksMoved, stats.pinnedSkips, elapsed * 1e-6, corruptions);
+
+    platformFreeRegion(memory, heapSize);
+}
+
+void runCompactionBenchmark(WorkloadConfig workload) {
+    Workload named;
+    named.init(workload);
+    if(workload.livePointers > HANDLE_TABLE_SIZE) {
+        printf("\nThe compaction benchmark needs a handle for each of the %d live pointers, and the table has %d\n", workload.livePointers, HANDLE_TABLE_SIZE);
+        return;
+    }
+
+    int orders[] = COMPACTION_HEAP_ORDERS;
+    printf("\n==== %s workload, %d live pointers, through handles, large requests from %d bytes ====\n", named.getName(), workload.livePointers, COMPACTION_LARGE_REQUEST);
+    printf("%8s %-18s %10s %8s %8s %8s %9s %9s %9s %10s %6s\n", "heap", "compaction", "requests", "failed", "large", "failed", "", "moved", "pinned", "ms", "bad");
+    for(int o = 0; o < (int)(sizeof(orders) / sizeof(orders[0])); o++) {
+        compactionRun(orders[o], 0, false, false, workload);
+        compactionRun(orders[o], 4, false, false, workload);
+        compactionRun(orders[o], 16, false, false, workload);
+        compactionRun(orders[o], 16, false, true, workload);
+        compactionRun(orders[o], 0, true, false, workload);
+    }
+}
@@ -0,0 +1,188 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Thread Benchmarks
+//
+//   Description:  Multi-threaded stress tests and scaling benchmarks for the
+//                 allocators, alongside the single threaded simulation in
+//                 main.cpp.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+// Standard headers go first, as auxiliary.h defines macros (e.g. 'ms') that
+// would otherwise clash with names used inside them.
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "asyncalloc.h"
+#include "handles.h"
+#include "numabuddy.h"
+#include "perfcounters.h"
+#include "workload.h"
+
+// Operations (a malloc and its matching free) done by each thread in a run
+#define BENCH_OPS_PER_THREAD 100000
+
+// Blocks allocated (and then all freed) by each burst
+#define BENCH_BURST_SIZE 64
+
+// Capacity of the queue between each producer and its consumer. Blocks average
+// around 40KB under Simulation 2, so this keeps each queue to a couple of MB
+#define BENCH_QUEUE_SIZE 32
+
+// The heap given to the buddy allocators
+#define BENCH_HEAP_SIZE (1LL << 25)
+
+// The locality benchmark builds this many linked lists side by side (a node
+// for each in turn), each this many nodes long, and walks them all this many
+// times. The nodes come to 8MB, too much to stay in most caches.
+#define LOCALITY_LISTS 32
+#define LOCALITY_NODES 4096
+#define LOCALITY_WALKS 20
+
+// Background blocks freed and reallocated (from the workload) between rounds
+// of list nodes, so the lists are built in a heap full of holes
+#define LOCALITY_CHURN 4
+
+// The colouring benchmark allocates this many objects of this size (each in a
+// 4KB block, leaving room for 31 colours), and walks the first cache line of
+// every one of them (as a linked list) this many times. 256 first lines fit in 32 sets of an 8 way
+// L1 cache, but not in the one set they share without colouring.
+#define COLOUR_OBJECTS 256
+#define COLOUR_OBJECT_SIZE 2100
+#define COLOUR_WALKS 20000
+
+// The pre-faulting benchmark starts a 2GiB heap (the largest there can be) each
+// way, then mallocs blocks of PREFAULT_BLOCK_SIZE and writes to each of their
+// pages, until PREFAULT_PASS_BYTES are in use. The lazy start faults in the
+// first PREFAULT_LAZY_BYTES only.
+#define PREFAULT_HEAP_ORDER 31
+#define PREFAULT_PASS_BYTES (1LL << 30)
+#define PREFAULT_LAZY_BYTES (1LL << 28)
+#define PREFAULT_BLOCK_SIZE 65000
+#define PREFAULT_BENCH_THREADS 4
+
+// The reference benchmark builds a list of REF_NODES nodes, each a key and a
+// link to the next, once linked by pointers (24 bytes with the Node header, so
+// in 32 byte blocks) and once by BuddyRefs (16 bytes, so 16 byte blocks), and
+// walks each one REF_WALKS times.
+#define REF_HEAP_ORDER 27
+#define REF_NODES (1 << 21)
+#define REF_WALKS 10
+
+// The append benchmark grows APPEND_BUFFERS buffers side by side, a piece of
+// 1 to APPEND_PIECE bytes at a time, until each holds APPEND_BYTES, then frees
+// them; APPEND_ROUNDS times. A full buffer doubles its capacity, or grows it by
+// half, as some vector and string implementations do.
+#define APPEND_BUFFERS 256
+#define APPEND_BYTES 16384
+#define APPEND_PIECE 48
+#define APPEND_ROUNDS 20
+
+// The vectored benchmark runs the workload's churn (as main.cpp does) in heaps
+// of each of these orders, small enough for Simulation 2 to be near capacity,
+// with malloc and with mallocVectored taking up to VECTORED_SEGMENTS pieces
+#define VECTORED_HEAP_ORDERS { 24, 23, 22 }
+#define VECTORED_SEGMENTS 8
+
+// The async exercise fills a heap of 2^ASYNC_EXERCISE_HEAP_ORDER bytes, then
+// awaits two mallocs of ASYNC_EXERCISE_SIZE bytes: one that waits for as long
+// as it takes, and one that gives up after ASYNC_EXERCISE_TIMEOUT_MS
+#define ASYNC_EXERCISE_HEAP_ORDER 20
+#define ASYNC_EXERCISE_SIZE 1000
+#define ASYNC_EXERCISE_TIMEOUT_MS 50
+
+// The compaction benchmark runs the workload's churn (as main.cpp does) through
+// handles in heaps of each of these orders, with and without the compactor, and
+// counts the requests of at least COMPACTION_LARGE_REQUEST bytes that failed.
+// One run compacts COMPACTION_RETRY_BLOCKS blocks only when a request fails,
+// then retries it; one leaves every COMPACTION_PINNED_EVERY'th handle pinned.
+#define COMPACTION_HEAP_ORDERS { 24, 23 }
+#define COMPACTION_LARGE_REQUEST 65536
+#define COMPACTION_RETRY_BLOCKS 512
+#define COMPACTION_PINNED_EVERY 10
+
+// Access pattern a run uses
+enum BenchPattern {
+    // Each thread frees and reallocates random blocks of its own, as main.cpp does
+    BENCH_CHURN,
+
+    // Half of the threads allocate blocks and pass them to the other half to free
+    BENCH_PRODUCER_CONSUMER,
+
+    // Each thread allocates a burst of blocks, then frees all of them
+    BENCH_BURSTY,
+
+    // Each thread keeps some long lived blocks (replaced now and then) while
+    // making lots of short lived allocations
+    BENCH_MIXED
+};
+
+// An allocator under test
+typedef struct BenchAllocator {
+    const char* name;
+    void* (*malloc)(int size);
+    void (*free)(void* p);
+} BenchAllocator;
+
+// The outcome of one run
+typedef struct BenchResult {
+    long long operations;
+    long long failures;
+
+    // Blocks whose first or last byte had changed by the time they were freed
+    long long corruptions;
+    double seconds;
+} BenchResult;
+
+BenchResult runBenchmark(BenchAllocator* allocator, BenchPattern pattern, int threads, WorkloadConfig workload);
+
+// Runs every pattern against every allocator, with 1, 2, 4, ... up to
+// 'maxThreads' threads, and prints the operations per second of each. The
+// workload's live pointers are shared out between the threads.
+void runThreadBenchmarks(int maxThreads, WorkloadConfig workload);
+
+// Builds linked lists with malloc and then with mallocNear (each node near the
+// one before it), among background blocks from the workload, and prints how
+// long a hop along the lists takes and how often a hop leaves its page.
+void runLocalityBenchmark(WorkloadConfig workload);
+
+// Allocates many same sized objects with colouring off and then on, and prints
+// how long a walk over their first cache lines takes, how many cache sets those
+// lines fall in, and (where the machine can count them) the cache misses.
+void runColouringBenchmark();
+
+// Starts a large heap without pre-faulting, pre-faulting its start, and
+// pre-faulting all of it (on one thread and on several), and prints how long
+// each start took, and how long the first pass of mallocs over it then took.
+void runPrefaultBenchmark();
+
+// Builds and walks a list linked by pointers and then one linked by BuddyRefs,
+// and prints the memory each took and how long a walk took.
+void runRefBenchmark();
+
+// Runs the append benchmark with buffers that take the capacity they asked
+// for, and with buffers that take all of their block (from mallocAtLeast), and
+// prints how often each had to grow, and how much they copied.
+void runAppendBenchmark();
+
+// Runs the workload's churn in heaps near capacity with malloc and then with
+// mallocVectored, and prints how many requests failed, and how many pieces the
+// vectored requests that couldn't get one block were split in to.
+void runVectoredBenchmark(WorkloadConfig workload);
+
+// co_awaits a malloc that has to wait for a free, and one that times out, and
+// prints what each got. Needs a C++20 build (make cpp20); other builds say so.
+void runAsyncExercise();
+
+// Runs the workload's churn through allocHandle and pin, without the compactor,
+// with a slice of it after every request, and with it only after a failure,
+// and prints how many large requests failed, and how many blocks were moved.
+void runCompactionBenchmark(WorkloadConfig workload);
+
+#endif
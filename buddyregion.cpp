@@ -0,0 +1,170 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Buddy Region
+//
+//   Description:  A region (or arena) allocator for objects that share a
+//                 lifetime. Memory is bump allocated from blocks taken from a
+//                 BuddySystem, and every object in the region is returned to
+//                 the heap at once.
+//
+// Notes:
+// * Objects in a region have no header of their own; an allocation is just a
+//   pointer bump within the current block, and objects can't be freed one at
+//   a time. release() hands every block back to the heap, which is one
+//   BuddySystem::free per block rather than one per object.
+// * Blocks are requested so that they fill a whole block of the heap exactly
+//   (2^order less the Node header), so no space is lost to rounding.
+// * Each block taken is one order larger than the last (up to
+//   REGION_MAX_CHUNK_ORDER), so a region that grows large needs few blocks.
+//   A request too large for that block gets a block of its own size.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <climits>
+#include <stdexcept>
+
+#include "buddyregion.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * As with BuddySystem, no work can be done until init is called
+ */
+BuddyRegion::BuddyRegion() {
+    this->heap = NULL;
+    this->current = NULL;
+}
+
+/**
+ * init attaches the region to the heap it takes its blocks from. No block is taken
+ * until the first allocation; that block is of order 'firstOrder'.
+ */
+void BuddyRegion::init(BuddySystem* heap, int firstOrder) {
+    this->heap = heap;
+    this->current = NULL;
+    this->top = 0;
+    this->limit = 0;
+    this->firstOrder = firstOrder;
+    this->nextOrder = firstOrder;
+    this->bytesAllocated = 0;
+    this->chunkCount = 0;
+}
+
+/**
+ * Returns 'request_memory' bytes from the region, aligned to 'alignment' bytes (a power
+ * of two). When the current block is full a bigger block is taken from the heap.
+ *
+ * Returns NULL if the heap can't provide a large enough block, or the request is negative.
+ */
+void* BuddyRegion::malloc(int request_memory, int alignment) {
+    if(alignment <= 0 || (alignment & (alignment - 1)) != 0) {
+        throw std::logic_error("BuddyRegion::malloc has failed - the alignment must be a positive power of two!");
+    }
+
+    if(request_memory < 0) {
+        return NULL;
+    }
+
+    uintptr_t start = (this->top + (uintptr_t)alignment - 1) & ~((uintptr_t)alignment - 1);
+    if(this->current == NULL || start + (uintptr_t)request_memory > this->limit) {
+        if(!this->takeChunk((long long)request_memory + alignment)) {
+            return NULL;
+        }
+
+        start = (this->top + (uintptr_t)alignment - 1) & ~((uintptr_t)alignment - 1);
+    }
+
+    this->top = start + (uintptr_t)request_memory;
+    this->bytesAllocated += request_memory;
+
+    return (void*)start;
+}
+
+/**
+ * Empties the region so its memory can be used again. Only the most recent (largest)
+ * block is kept; the rest are returned to the heap. Everything allocated from the region
+ * becomes invalid.
+ */
+void BuddyRegion::reset() {
+    if(this->current == NULL) {
+        return;
+    }
+
+    RegionChunk* chunk = this->current->previous;
+    while(chunk != NULL) {
+        RegionChunk* previous = chunk->previous;
+        this->heap->free(chunk);
+        chunk = previous;
+    }
+
+    this->current->previous = NULL;
+    this->top = (uintptr_t)this->current + sizeof(RegionChunk);
+    this->bytesAllocated = 0;
+    this->chunkCount = 1;
+}
+
+/**
+ * Returns every block of the region to the heap. Everything allocated from the region
+ * becomes invalid; the region itself can be used again, starting over from the first order.
+ */
+void BuddyRegion::release() {
+    RegionChunk* chunk = this->current;
+    while(chunk != NULL) {
+        RegionChunk* previous = chunk->previous;
+        this->heap->free(chunk);
+        chunk = previous;
+    }
+
+    this->init(this->heap, this->firstOrder);
+}
+
+/**
+ * Returns the bytes handed out since the region was last reset or released (alignment
+ * padding and block headers aside)
+ */
+long long BuddyRegion::getBytesAllocated() {
+    return this->bytesAllocated;
+}
+
+int BuddyRegion::getChunkCount() {
+    return this->chunkCount;
+}
+
+/**
+ * Takes a new block from the heap with room for at least 'minimumSize' bytes after its
+ * RegionChunk, and makes it the block allocations are bumped from.
+ *
+ * Returns false if the heap has no block that large.
+ */
+bool BuddyRegion::takeChunk(long long minimumSize) {
+    int order = this->nextOrder;
+    while((1LL << order) - NODE_HEADER_SIZE - (long long)sizeof(RegionChunk) < minimumSize) {
+        order++;
+    }
+
+    long long size = (1LL << order) - NODE_HEADER_SIZE;
+    if(size > INT_MAX) {
+        return false;
+    }
+
+    RegionChunk* chunk = (RegionChunk*)this->heap->malloc((int)size);
+    if(chunk == NULL) {
+        return false;
+    }
+
+    chunk->previous = this->current;
+    chunk->size = size;
+
+    this->current = chunk;
+    this->top = (uintptr_t)chunk + sizeof(RegionChunk);
+    this->limit = (uintptr_t)chunk + (uintptr_t)size;
+    this->chunkCount++;
+
+    if(this->nextOrder < REGION_MAX_CHUNK_ORDER) {
+        this->nextOrder++;
+    }
+
+    return true;
+}
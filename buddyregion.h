@@ -0,0 +1,68 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Buddy Region
+//
+//   Description:  A region (or arena) allocator for objects that share a
+//                 lifetime. Memory is bump allocated from blocks taken from a
+//                 BuddySystem, and every object in the region is returned to
+//                 the heap at once.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __BUDDYREGION_H__
+#define __BUDDYREGION_H__
+
+#include "buddysys.h"
+
+// Order of the first block a region takes from the heap, unless told otherwise
+#define REGION_DEFAULT_FIRST_ORDER 12
+
+// Each block taken is one order bigger than the last, up to this order
+#define REGION_MAX_CHUNK_ORDER 20
+
+// Allocations are aligned to this many bytes unless asked otherwise
+#define REGION_DEFAULT_ALIGNMENT 8
+
+// Sits at the start of the data of every block the region takes from the heap,
+// linking the blocks together so they can all be returned.
+typedef struct RegionChunk {
+    // The block taken before this one, or NULL for the first
+    struct RegionChunk* previous;
+
+    // Bytes of data in the block, this structure included
+    long long size;
+} RegionChunk;
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class BuddyRegion {
+    BuddySystem* heap;
+
+    // The most recently taken block, which allocations are bumped from
+    RegionChunk* current;
+    uintptr_t top;
+    uintptr_t limit;
+
+    int firstOrder;
+    int nextOrder;
+
+    long long bytesAllocated;
+    int chunkCount;
+public:
+    BuddyRegion();
+    void init(BuddySystem* heap, int firstOrder = REGION_DEFAULT_FIRST_ORDER);
+
+    void* malloc(int request_memory, int alignment = REGION_DEFAULT_ALIGNMENT);
+
+    void reset();
+    void release();
+
+    long long getBytesAllocated();
+    int getChunkCount();
+protected:
+    bool takeChunk(long long minimumSize);
+};
+
+
+#endif
@@ -26,12 +26,62 @@
 // * This assignment is going to involve lots of pointer arithmetic. Ensure we're factoring
 //   in that that the address of a node is NOT the address of the data component.
 // * There is a minimum size we can allocate, due to the sizeof(Node).
-// * There is a maximum size we can allocate, dictated by Node* wholememory->size;
+// * There is a maximum size we can allocate, dictated by the order of the wholememory Node.
+// * Only the first NODE_HEADER_SIZE bytes of the Node are kept while a block is allocated;
+//   the free list links share space with the start of the data.
+// * With a reserve stock set, a miss in a hot bin splits a larger block all the way down in
+//   one pass, leaving several ready blocks behind in the bin, and blocks of a hot order freed
+//   while its bin is short aren't merged with their buddies. Either way the bin holds free
+//   buddies that haven't been merged, which is only undone (by releaseReserves) when a
+//   malloc would otherwise fail.
+// * Each free block records how much of it may be dirty (Node::dirtyOrder), so calloc only
+//   clears what it has to. Blocks start clean when the heap is given zeroed memory, a freed
+//   block is wholly dirty, and the purger marks blocks clean again where the system zeroes
+//   purged pages. Splits hand the dirty bytes to the pieces they fall in; a merge stays
+//   clean only if the upper half was clean past its Node.
+// * Block counts for each order and the occupancy map are only kept once snapshots have
+//   been enabled (they are worked out by walking the heap at that point), so a heap that
+//   nobody is watching doesn't pay for them. They are copied (with the stats) in to a
+//   snapshot every SNAPSHOT_PUBLISH_PERIOD mallocs and frees, guarded by a sequence lock,
+//   so that the introspection server can read them without ever taking the heap lock.
+// * A block is normally taken from the lowest address that will do, splitting larger blocks
+//   from the bottom. Blocks malloc'd as long lived are cut from the highest free block of
+//   any order that will do, splitting from the top, so they collect at the far end of the
+//   heap from the short lived churn and don't pin the blocks that churn breaks up and merges
+//   back together. Finding that block walks every free list above the order, so this is
+//   for the (rarer) long lived mallocs only.
+// * mallocNear places a block close to an existing one (e.g. the next node of a list), so
+//   that structures walked together share pages and cache lines. It searches outwards from
+//   the hint's block, one buddy at a time, by walking the headers of the blocks that tile
+//   each buddy - there's no need for an index, as every block (allocated or not) starts
+//   with its Node. The search is capped at NEAR_PROBE_BUDGET headers, after which the block
+//   is placed as malloc would place it.
+// * Every block of an order starts at the same offset modulo 2^order, so the first (and
+//   usually hottest) cache lines of blocks of a page or more all fall in the same cache
+//   sets. With colouring on (see setColouring), malloc moves the data of larger blocks
+//   along by a number of cache lines, taking each order's colours in turn, within the
+//   slack the request leaves at the end of its block - so no larger block is needed. An
+//   8 byte colour tag in front of the moved data leads free back to the block's Node.
+// * The heap profiler's sampling lives in allocate and free, but costs them next to nothing
+//   while nothing is sampled: malloc takes the block's size off sampleCountdown (which stays
+//   near LLONG_MAX while there's no profiler), and free tests NODE_SAMPLED in the header it
+//   has already read. Only a sample calls in to the profiler.
 //
 //
 //////////////////////////////////////////////////////////////////////////////////
 
+// Standard headers go first, as auxiliary.h defines macros (e.g. 'ms') that
+// would otherwise clash with names used inside them.
+#include <chrono>
+#include <climits>
+#include <stdexcept>
+#include <string.h>
+#include <thread>
+#include <vector>
+
 #include "buddysys.h"
+#include "asyncalloc.h"
+#include "heapprofiler.h"
 
 using namespace std;
 
@@ -50,52 +100,850 @@ using namespace std;
  */
 BuddySystem::BuddySystem() {}
 
+/**
+ * Sets the state kept in this instance rather than in the heap header (the options, and
+ * the helpers attached to the heap) back to how a new heap starts. Each of the init
+ * functions calls this before setting up its own kind of heap.
+ */
+void BuddySystem::resetRuntimeState() {
+    this->directMapThreshold = 0;
+    this->purgeOrder = SIZE_OF_FREE_LIST;
+    this->purgeEpoch.store(0);
+    this->reserveStock = 0;
+    this->colourOrder = 0;
+    this->asyncAllocator = NULL;
+    this->waitingOrders = 0;
+    this->profiler = NULL;
+    this->sampleCountdown = LLONG_MAX;
+    this->snapshotsEnabled = false;
+    this->snapshotSequence.store(0);
+    this->snapshotWanted.store(false);
+    this->snapshotCountdown = SNAPSHOT_PUBLISH_PERIOD;
+}
+
 /**
  * init, when provided with a Node* pointing to the 'wholememory' block this buddy system has to work
- * with, will initialise the `freeList` and insert this Node in to it at the appropiatte position in the
- * free list (determineBinK is used here to find the bin).
+ * with (and its size in bytes, which must be a power of two), will initialise the `freeList` and
+ * insert this Node in to it at the appropiatte position in the free list.
+ *
+ * 'zeroed' should be true if the memory is known to be all zero (as it is straight from
+ * VirtualAlloc or mmap), so that calloc doesn't clear it again.
+ *
+ * The heap state is kept inside this instance, so the heap is private to this process.
+ */
+void BuddySystem::init(Node *wholememory, long long memorySize, bool zeroed) {
+    this->header = &this->localHeader;
+    this->header->heapOffset = 0;
+    this->mapping.address = NULL;
+    this->threadSafe = false;
+    this->shared = false;
+    this->persistent = false;
+    this->resetRuntimeState();
+
+    this->format(wholememory, memorySize, zeroed);
+}
+
+/**
+ * initShared places both the heap and its BuddyHeader inside a named shared memory
+ * region, so that several processes can allocate from (and free in to) the same heap.
+ *
+ * The first process to call this with a given name creates and formats the region; any
+ * later callers attach to it instead, and must ask for the same 'heapSize'. Blocks can be
+ * handed between processes using toOffset/fromOffset, as the region will generally be
+ * mapped at a different address in each process.
+ *
+ * heapSize must be a power of two, as with the wholememory block given to 'init'. Access
+ * to the free list is serialised by a spin lock stored in the region.
+ *
+ * The region outlives the processes using it until unlinkShared is called. A process that
+ * dies while holding the heap lock leaves it held, and every other process will spin on it;
+ * as with a creator that dies before the heap is formatted (which is given up on after
+ * SHARED_READY_TIMEOUT_MS), the only way out is to unlink the region and start again.
+ */
+void BuddySystem::initShared(const char* name, long long heapSize) {
+    // Pad the header out to a whole number of pages so the heap stays page aligned
+    long long headerSize = ((sizeof(BuddyHeader) + PAGESIZE - 1) / PAGESIZE) * PAGESIZE;
+    if(!platformMapShared(name, headerSize + heapSize, &this->mapping)) {
+        throw std::runtime_error("BuddySystem::initShared has failed - unable to map the shared memory region");
+    }
+
+    this->header = (BuddyHeader*)this->mapping.address;
+    this->threadSafe = true;
+    this->shared = true;
+    this->persistent = false;
+    this->resetRuntimeState();
+
+    if(this->mapping.created) {
+        Node* wholememory = (Node*)((uintptr_t)this->header + (uintptr_t)headerSize);
+
+        this->header->heapOffset = headerSize;
+
+        // A newly created shared object or file reads as zero
+        this->format(wholememory, heapSize, true);
+        return;
+    }
+
+    // Somebody else created the region; wait for them to finish formatting it
+    std::chrono::steady_clock::time_point giveUp = std::chrono::steady_clock::now() + std::chrono::milliseconds(SHARED_READY_TIMEOUT_MS);
+    while(this->header->ready.load(std::memory_order_acquire) == 0) {
+        if(std::chrono::steady_clock::now() >= giveUp) {
+            platformUnmap(&this->mapping);
+            throw std::runtime_error("BuddySystem::initShared has failed - the shared region was never formatted (its creator may have died); unlink it and try again");
+        }
+
+        std::this_thread::yield();
+    }
+
+    if(this->header->magic != BUDDY_HEADER_MAGIC || this->header->version != BUDDY_HEADER_VERSION) {
+        platformUnmap(&this->mapping);
+        throw std::logic_error("BuddySystem::initShared has failed - the shared region is not a buddy heap, or was made by an incompatible version!");
+    }
+
+    if(this->mapping.size != headerSize + heapSize || this->header->heapOffset != headerSize) {
+        platformUnmap(&this->mapping);
+        throw std::logic_error("BuddySystem::initShared has failed - the shared heap already exists with a different size!");
+    }
+
+    this->attach();
+    printf("[initShared]:: Attached to shared buddy system with upperK/lowerK %d/%d\n", this->upperK, this->lowerK);
+}
+
+/**
+ * initPersistent maps the file at 'path' and uses it as the heap, so that the contents of
+ * the heap (every allocated block included) survive the process exiting.
+ *
+ * A new (or empty) file is sized and formatted as a fresh heap of 'heapSize' bytes, and false
+ * is returned. An existing file is restored instead, and true is returned:
+ * - If it was closed cleanly (see detach) the free list stored in the file is used as is,
+ *   which makes reopening O(1) no matter how big the heap is.
+ * - Otherwise the process died with the heap open, and the free list is rebuilt by walking
+ *   the block boundaries (see recover).
+ *
+ * Everything in the heap is addressed by offset, so the file may be mapped at a different
+ * address each time - data stored in the heap should likewise refer to other blocks by offset
+ * (toOffset/fromOffset). setRoot/getRoot give the application somewhere to start from.
+ */
+bool BuddySystem::initPersistent(const char* path, long long heapSize) {
+    long long headerSize = ((sizeof(BuddyHeader) + PAGESIZE - 1) / PAGESIZE) * PAGESIZE;
+    if(!platformMapFile(path, headerSize + heapSize, &this->mapping)) {
+        throw std::runtime_error("BuddySystem::initPersistent has failed - unable to map the heap file");
+    }
+
+    this->header = (BuddyHeader*)this->mapping.address;
+    this->threadSafe = false;
+    this->shared = false;
+    this->persistent = true;
+    this->resetRuntimeState();
+
+    if(this->mapping.created) {
+        Node* wholememory = (Node*)((uintptr_t)this->header + (uintptr_t)headerSize);
+
+        this->header->heapOffset = headerSize;
+
+        // A newly created shared object or file reads as zero
+        this->format(wholememory, heapSize, true);
+        return false;
+    }
+
+    if(this->header->magic != BUDDY_HEADER_MAGIC || this->header->version != BUDDY_HEADER_VERSION) {
+        platformUnmap(&this->mapping);
+        throw std::logic_error("BuddySystem::initPersistent has failed - the file is not a buddy heap, or was written by an incompatible version!");
+    }
+
+    this->attach();
+
+    // Nobody else can be using the file, so a lock still held here
+    // was held by a process that has since died.
+    this->header->lock.store(0);
+    if(this->header->cleanShutdown == 1) {
+        printf("[initPersistent]:: Restored buddy system with upperK/lowerK %d/%d\n", this->upperK, this->lowerK);
+    } else {
+        printf("[initPersistent]:: Heap was not closed cleanly, recovering free list\n");
+        this->recover();
+    }
+
+    // Until detach is called the file no longer represents a clean shutdown
+    this->header->cleanShutdown = 0;
+    platformFlush(&this->mapping);
+    return true;
+}
+
+/**
+ * detach unmaps a shared or persistent heap from this process. A shared heap lives on
+ * for as long as any other process still has it mapped; a persistent heap is marked as
+ * cleanly shut down and flushed to its file first. Pointers in to the heap held by
+ * this process are no longer valid afterwards.
+ */
+void BuddySystem::detach() {
+    if(this->persistent) {
+        this->header->cleanShutdown = 1;
+        platformFlush(&this->mapping);
+    }
+
+    if(this->mapping.address != NULL) {
+        platformUnmap(&this->mapping);
+    }
+
+    this->header = &this->localHeader;
+    this->threadSafe = false;
+    this->shared = false;
+    this->persistent = false;
+}
+
+/**
+ * Removes the shared heap called 'name', so that the next initShared with that name creates
+ * a fresh heap rather than attaching to this one. Processes still attached keep using it
+ * until they detach.
+ */
+void BuddySystem::unlinkShared(const char* name) {
+    platformUnlinkShared(name);
+}
+
+/**
+ * Picks up the heap described by an existing (already formatted) header.
+ */
+void BuddySystem::attach() {
+    this->baseMemoryAddress = (uintptr_t)this->header + (uintptr_t)this->header->heapOffset;
+    this->upperK = this->header->upperK;
+    this->lowerK = this->header->lowerK;
+}
+
+/**
+ * recover rebuilds the free list of a heap whose free list can't be trusted (i.e. a
+ * persistent heap whose process died part way through a malloc or free).
+ *
+ * The Node headers at the start of each block are always valid, as splitNode writes the
+ * header of the upper half before shrinking the lower half. So starting at the first
+ * Node and stepping forward by each block's size visits every block in the heap. Free
+ * blocks are collected back in to the free list, merging any buddies that were both free
+ * (e.g. if the process died between marking a block free and coalescing it).
+ */
+void BuddySystem::recover() {
+    for(int k = 0; k < SIZE_OF_FREE_LIST; k++) {
+        this->header->freeList[k] = BUDDY_NULL_OFFSET;
+    }
+
+    // Validate every block and forget the links left behind in the free
+    // ones; they may point at blocks that have since been allocated.
+    long long offset = 0;
+    while(offset < this->header->heapSize) {
+        Node* node = (Node*)this->fromOffset(offset);
+        long long size = 1LL << node->order;
+        if(node->order < this->lowerK || node->order > this->upperK || (offset & (size - 1)) != 0) {
+            throw std::logic_error("BuddySystem::recover has failed - found a corrupt block header!");
+        }
+
+        if(node->alloc == 0) {
+            node->next = BUDDY_NULL_OFFSET;
+            node->previous = BUDDY_NULL_OFFSET;
+
+            // The process may have died before a block's dirty order caught up with it
+            node->dirtyOrder = node->order;
+        }
+
+        offset += size;
+    }
+
+    // Rebuild the free list. coalesceFree may merge the block with the buddy before it,
+    // so carry on from the end of whatever block we're left with.
+    long long freeBytes = 0;
+    offset = 0;
+    while(offset < this->header->heapSize) {
+        Node* node = (Node*)this->fromOffset(offset);
+        if(node->alloc == 0) {
+            this->insertToFree(node);
+            for(Node* merged = node; merged != NULL; merged = this->coalesceFree(merged)) {
+                node = merged;
+            }
+        }
+
+        offset = this->toOffset(node) + (1LL << node->order);
+    }
+
+    for(int k = this->lowerK; k <= this->upperK; k++) {
+        for(Node* n = this->nodeAt(this->header->freeList[k]); n != NULL; n = this->nodeAt(n->next)) {
+            freeBytes += 1LL << n->order;
+        }
+    }
+
+    if(this->header->trackCounts) {
+        this->rebuildCounts();
+    }
+
+    printf("[recover]:: Rebuilt free list, %lld of %lld bytes are free\n", freeBytes, this->header->heapSize);
+}
+
+/**
+ * Records 'p' (a block in this heap, or NULL) as the root of a persistent heap. The root is
+ * stored as an offset in the heap header, so it can be found again with getRoot after the
+ * heap is reopened.
+ */
+void BuddySystem::setRoot(void* p) {
+    this->header->root = p == NULL ? BUDDY_NULL_OFFSET : this->toOffset(p);
+}
+
+void* BuddySystem::getRoot() {
+    return this->header->root == BUDDY_NULL_OFFSET ? NULL : this->fromOffset(this->header->root);
+}
+
+/**
+ * Formats the heap starting at 'wholememory', filling in the header (wherever it lives) and
+ * inserting wholememory as the one and only free node. If the memory is 'zeroed', only the
+ * Node itself is marked as dirty.
  */
-void BuddySystem::init(Node *wholememory) {
-    this->freeList[SIZE_OF_FREE_LIST] = { NULL };
+void BuddySystem::format(Node* wholememory, long long memorySize, bool zeroed) {
     this->baseMemoryAddress = (uintptr_t)wholememory;
-    this->upperK = determineBinK(wholememory);
+    this->upperK = std::log2(memorySize);
 
-    // This log operation will find the bin size for exactly 32bytes,
-    // this leaves 0 bytes for data, so only the bin size above this
-    // is usable (this is why we have a +1 on the end of the statement).
-    this->lowerK = std::log2(sizeof(Node)) + 1;
+    // The smallest block has to fit the whole Node structure while it's free. Once allocated
+    // only the header is needed, so unlike the old 32 byte Node this still leaves room for data.
+    this->lowerK = BUDDY_MIN_ORDER;
 
     // Ensure the system is initialised with sane values and insert the first node in to the free list
-    if(this->upperK <= this->lowerK) {
+    if(this->upperK <= this->lowerK || this->upperK >= SIZE_OF_FREE_LIST || (1LL << this->upperK) != memorySize) {
         throw std::logic_error("BuddySystem::init has failed - upperK and lowerK values are illogical!");
     } else {
         printf("[init]:: Successfully initialised buddy system with upperK/lowerK %d/%d\n", this->upperK, this->lowerK);
     }
 
-    wholememory->alloc = 0;
-    this->insertToFree(wholememory);
-}
+    this->header->magic = BUDDY_HEADER_MAGIC;
+    this->header->version = BUDDY_HEADER_VERSION;
+    this->header->cleanShutdown = 0;
+    this->header->root = BUDDY_NULL_OFFSET;
+    this->header->stats = BuddyStats();
+    this->header->lock.store(0);
+    this->header->upperK = this->upperK;
+    this->header->lowerK = this->lowerK;
+    this->header->heapSize = memorySize;
+    for(int k = 0; k < SIZE_OF_FREE_LIST; k++) {
+        this->header->freeList[k] = BUDDY_NULL_OFFSET;
+        this->header->freeBlocks[k] = 0;
+    }
+
+    this->header->trackCounts = 0;
+
+    wholememory->order = this->upperK;
+    wholememory->alloc = 0;
+    wholememory->dirtyOrder = zeroed ? BUDDY_MIN_ORDER : this->upperK;
+    wholememory->flags = 0;
+    wholememory->next = BUDDY_NULL_OFFSET;
+    wholememory->previous = BUDDY_NULL_OFFSET;
+    this->insertToFree(wholememory);
+
+    this->header->ready.store(1, std::memory_order_release);
+}
+
+/**
+ * Converts a pointer in to this heap to an offset from the start of the heap. Unlike the
+ * pointer, the offset means the same thing in every process attached to a shared heap.
+ */
+long long BuddySystem::toOffset(void* p) {
+    return (long long)((uintptr_t)p - this->baseMemoryAddress);
+}
+
+/**
+ * The inverse of toOffset - returns the pointer in this process for an offset in to the heap.
+ */
+void* BuddySystem::fromOffset(long long offset) {
+    return (void*)(this->baseMemoryAddress + (uintptr_t)offset);
+}
+
+/**
+ * Returns true if 'p' points in to the memory managed by this heap.
+ */
+bool BuddySystem::owns(void* p) {
+    uintptr_t address = (uintptr_t)p;
+    return address >= this->baseMemoryAddress && address < this->baseMemoryAddress + (uintptr_t)this->header->heapSize;
+}
+
+/**
+ * Returns a copy of the heap's counters. For a shared or persistent heap these
+ * cover every process (and every run) that has used the heap.
+ */
+BuddyStats BuddySystem::getStats() {
+    ScopedLock guard(this);
+    return this->header->stats;
+}
+
+/**
+ * Returns the size of the largest free block (header included), or 0 if the heap is full.
+ * A malloc of up to this size, less the header, can be met without any memory being freed.
+ */
+long long BuddySystem::largestFreeBlock() {
+    ScopedLock guard(this);
+    for(int k = this->upperK; k >= this->lowerK; k--) {
+        if(this->binHasNode(k)) {
+            return 1LL << k;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Enables (or disables) locking around malloc and free, so that one heap can be used
+ * by several threads at once. Shared heaps are always locked.
+ */
+void BuddySystem::setThreadSafe(bool enabled) {
+    this->threadSafe = enabled || this->shared;
+}
+
+/**
+ * Requests of 'bytes' or more are served by the direct mapper rather than the heap, so that
+ * one huge (and often short lived) buffer doesn't split up the heap's largest blocks. 0
+ * turns this off, which is the default.
+ *
+ * Direct mappings are private to this process and don't live in the heap's file, so this
+ * isn't available for shared or persistent heaps.
+ */
+void BuddySystem::setDirectMapThreshold(long long bytes) {
+    if(bytes > 0 && (this->shared || this->persistent)) {
+        throw std::logic_error("BuddySystem::setDirectMapThreshold has failed - shared and persistent heaps can't use direct mappings!");
+    }
+
+    ScopedLock guard(this);
+    this->directMapThreshold = bytes;
+}
+
+DirectMapStats BuddySystem::getDirectMapStats() {
+    ScopedLock guard(this);
+    return this->directMapper.getStats();
+}
+
+/**
+ * Keeps up to 'blocks' ready blocks (rounded down to a power of two) for each hot order, so
+ * that most mallocs in those orders don't have to split anything. The stock of an order is
+ * shared out by how much of the traffic it gets. 0 turns reserves off, which is the default,
+ * and forgets the order histogram.
+ */
+void BuddySystem::setReserveStock(int blocks) {
+    ScopedLock guard(this);
+    this->reserveStock = blocks > 0 ? blocks : 0;
+    this->orderHitTotal = 0;
+    for(int k = 0; k < SIZE_OF_FREE_LIST; k++) {
+        this->orderHits[k] = 0;
+    }
+}
+
+/**
+ * Colours blocks of at least order 'minOrder', moving each one's data along by up to
+ * COLOUR_LINES - 1 cache lines (as far as the slack at the end of the block allows), so
+ * that the starts of same sized blocks are spread over the cache sets. 0 turns colouring
+ * off, which is the default. Blocks of a page (order 12) and up gain the most, as without
+ * colouring all of them start in the same L1 set.
+ */
+void BuddySystem::setColouring(int minOrder) {
+    ScopedLock guard(this);
+    this->colourOrder = minOrder > 0 ? minOrder : 0;
+    for(int k = 0; k < SIZE_OF_FREE_LIST; k++) {
+        this->colourNext[k] = 0;
+    }
+}
+
+/**
+ * Faults in the 'size' bytes at 'start' for prefault. Where the operating system can't do
+ * that itself, a byte of each page is read and written back, leaving the contents as they
+ * were - but not safely if another thread is writing to the page at the same time.
+ */
+static void prefaultRange(uintptr_t start, long long size) {
+    if(size <= 0 || platformPrefault((void*)start, size)) {
+        return;
+    }
+
+    for(uintptr_t page = start; page < start + (uintptr_t)size; page += PAGESIZE) {
+        volatile unsigned char* p = (volatile unsigned char*)page;
+        *p = *p;
+    }
+}
+
+/**
+ * Faults in the pages of the first 'bytes' of the heap (the whole heap if 'bytes' is
+ * negative), splitting them between 'threads' threads, so that the mallocs using them later
+ * don't take a page fault on each first touch. Returns the number of bytes faulted in.
+ *
+ * Faulting in only the start of the heap (where malloc takes blocks from first) gets most of
+ * the benefit for a fraction of the start up time; the rest faults in as it's used. Must be
+ * called before the heap is in use, e.g. straight after init.
+ */
+long long BuddySystem::prefault(long long bytes, int threads) {
+    long long heapSize = 1LL << this->upperK;
+    bytes = bytes < 0 || bytes > heapSize ? heapSize : (bytes + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+    threads = threads > 1 ? threads : 1;
+
+    // Each thread takes an equal run of whole pages, this one included
+    long long share = (bytes / PAGESIZE + threads - 1) / threads * PAGESIZE;
+    std::vector<std::thread> workers;
+    for(long long from = share; from < bytes; from += share) {
+        workers.push_back(std::thread(prefaultRange, this->baseMemoryAddress + (uintptr_t)from, bytes - from < share ? bytes - from : share));
+    }
+
+    prefaultRange(this->baseMemoryAddress, bytes < share ? bytes : share);
+    for(size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    return bytes;
+}
+
+/**
+ * Starts publishing snapshots of the heap's counters for readSnapshot, one every
+ * SNAPSHOT_PUBLISH_PERIOD mallocs and frees. Off by default, when malloc and free only pay
+ * for a check of the flag.
+ */
+void BuddySystem::enableSnapshots() {
+    ScopedLock guard(this);
+    if(!this->header->trackCounts) {
+        this->rebuildCounts();
+    }
+
+    this->snapshot = BuddySnapshot();
+    this->snapshotsEnabled = true;
+    this->publishSnapshot();
+}
+
+/**
+ * Copies the latest snapshot in to 'out' without taking the heap lock, so it can be called
+ * from any thread however busy (or stuck) the heap is. Returns false if snapshots aren't
+ * enabled.
+ *
+ * The snapshot is at most SNAPSHOT_PUBLISH_PERIOD mallocs and frees old. Calling this also
+ * asks for the next malloc or free to publish a new one, but a heap that has gone quiet
+ * keeps showing its state as of its last publish.
+ */
+bool BuddySystem::readSnapshot(BuddySnapshot* out) {
+    if(!this->snapshotsEnabled) {
+        return false;
+    }
+
+    this->snapshotWanted.store(true, std::memory_order_relaxed);
+    while(true) {
+        unsigned int before = this->snapshotSequence.load(std::memory_order_acquire);
+        if((before & 1) != 0) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        memcpy(out, &this->snapshot, sizeof(BuddySnapshot));
+
+        // Anything written while we copied has moved the sequence on, and the copy is retried
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(this->snapshotSequence.load(std::memory_order_relaxed) == before) {
+            return true;
+        }
+    }
+}
+
+/**
+ * Given a request size, malloc will attempt to find a node that
+ * can satisfy the request. This may require splitting nodes of larger
+ * sizes many times so that the request can be satisfied.
+ * 
+ * The pointer to the usable data section of the node is returned, or NULL
+ * if the request could not be granted for any reason (e.g. insufficient memory space)
+ */
+void* BuddySystem::malloc(int request_memory) {
+    ScopedLock guard(this);
+    return this->allocate(request_memory, NULL);
+}
+
+/**
+ * As malloc, with a hint of how long the block will live: see BuddyLifetime.
+ */
+void* BuddySystem::malloc(int request_memory, BuddyLifetime lifetime) {
+    ScopedLock guard(this);
+    return this->allocate(request_memory, NULL, lifetime);
+}
+
+/**
+ * As malloc, but placing the block as close to 'hint' (memory from this heap's malloc) as can
+ * be found: in the same page if possible, then the same huge page, then the same half of the
+ * heap. If nothing close is free (or 'hint' isn't from this heap) the block is placed as
+ * malloc would place it.
+ */
+void* BuddySystem::mallocNear(void* hint, int request_memory) {
+    ScopedLock guard(this);
+    return this->allocate(request_memory, NULL, BUDDY_LIFETIME_UNKNOWN, hint);
+}
+
+/**
+ * As malloc, but also sets 'usable' to how many bytes can really be used at the returned
+ * memory (see usableSize): at least 'request_memory', and often close to twice as many.
+ * Growable buffers can take all of it as their capacity, and grow less often.
+ */
+void* BuddySystem::mallocAtLeast(int request_memory, long long* usable) {
+    ScopedLock guard(this);
+    void* p = this->allocate(request_memory, NULL);
+    *usable = p == NULL ? 0 : this->usableBytes(p);
+    return p;
+}
+
+/**
+ * Returns how many bytes can be used at 'p' (memory malloc'd from this heap): the rest of
+ * its block, from the header's order, which is generally more than was asked for. A direct
+ * mapping gives its whole size. Returns 0 for a pointer the heap didn't hand out.
+ */
+long long BuddySystem::usableSize(void* p) {
+    ScopedLock guard(this);
+    return p == NULL ? 0 : this->usableBytes(p);
+}
+
+/**
+ * The body of usableSize; the heap lock must be held
+ */
+long long BuddySystem::usableBytes(void* p) {
+    if(!this->owns(p)) {
+        return this->directMapper.sizeOf(p);
+    }
+
+    // Colouring moves the data along its block, leaving less of the block after it
+    Node* node = this->nodeOf(p);
+    return (long long)((uintptr_t)node + (uintptr_t)(1LL << node->order) - (uintptr_t)p);
+}
+
+/**
+ * As malloc, but returns a 32 bit reference to the memory (see BuddyRef) rather than a
+ * pointer, or BUDDY_NULL_REF if the request can't be granted. The memory always comes from
+ * the heap itself, never from a direct mapping, as only the heap can be referred to this way.
+ */
+BuddyRef BuddySystem::mallocRef(int request_memory) {
+    ScopedLock guard(this);
+    return this->toRef(this->allocate(request_memory, NULL, BUDDY_LIFETIME_UNKNOWN, NULL, false));
+}
+
+/**
+ * Frees the memory a reference from mallocRef refers to. Returns 0 for BUDDY_NULL_REF.
+ */
+int BuddySystem::freeRef(BuddyRef ref) {
+    return ref == BUDDY_NULL_REF ? 0 : this->free(this->fromRef(ref));
+}
+
+/**
+ * Allocates 'total' bytes as up to 'maxSegments' pieces, filling in 'iov' with them, for a
+ * caller that can take its memory scattered (e.g. I/O buffers for readv/writev). A heap too
+ * fragmented to hold the request in one block can often still hold it in several.
+ *
+ * The request gets one block if any is large enough. If not, the largest free block is taken
+ * whole, and so on for the rest of the request, so it is spread over as few blocks as it can
+ * be. The last piece is only as long as what is left. Returns the number of pieces, or 0 if
+ * the request can't be granted in 'maxSegments' of them (in which case nothing is kept).
+ * The pieces always come from the heap itself, never from a direct mapping.
+ */
+int BuddySystem::mallocVectored(long long total, int maxSegments, BuddyIoVec* iov) {
+    if(total <= 0 || maxSegments <= 0) {
+        return 0;
+    }
+
+    int segments = 0;
+    long long remaining = total;
+    {
+        ScopedLock guard(this);
+
+        // No number of pieces will do if the heap hasn't that much free in all
+        if(total > (1LL << this->upperK) - this->header->stats.bytesAllocated) {
+            this->header->stats.failedCount++;
+            return 0;
+        }
+
+        while(remaining > 0 && segments < maxSegments) {
+            // Whatever is left is taken in one block if it can be, from the smallest bin that will do
+            void* p = NULL;
+            long long length = 0;
+            int binK = this->determineBinK(remaining + NODE_HEADER_SIZE);
+            if(remaining <= INT_MAX - NODE_HEADER_SIZE && binK >= 0 && this->findFirstBin(binK) >= 0) {
+                p = this->allocate((int)remaining, NULL, BUDDY_LIFETIME_UNKNOWN, NULL, false);
+                length = remaining;
+            } else {
+                int k = this->upperK;
+                while(k >= this->lowerK && !this->binHasNode(k)) {
+                    k--;
+                }
+
+                if(k >= this->lowerK) {
+                    length = (1LL << k) - NODE_HEADER_SIZE;
+                    p = this->allocate((int)length, NULL, BUDDY_LIFETIME_UNKNOWN, NULL, false);
+                }
+            }
+
+            if(p == NULL) {
+                break;
+            }
+
+            iov[segments].base = p;
+            iov[segments].length = length;
+            segments++;
+            remaining -= length;
+        }
+
+        if(remaining > 0) {
+            this->header->stats.failedCount++;
+        }
+    }
+
+    // The pieces of a request that couldn't be granted are handed back once the lock is released
+    if(remaining > 0) {
+        this->freeVectored(iov, segments);
+        return 0;
+    }
+
+    return segments;
+}
+
+/**
+ * Frees the 'segments' pieces of a vectored allocation. Returns the number freed.
+ */
+int BuddySystem::freeVectored(BuddyIoVec* iov, int segments) {
+    int freed = 0;
+    for(int s = 0; s < segments; s++) {
+        freed += this->free(iov[s].base);
+        iov[s].base = NULL;
+        iov[s].length = 0;
+    }
+
+    return freed;
+}
+
+/**
+ * Allocates room for 'count' items of 'size' bytes each, all set to zero. Returns NULL if
+ * the request can't be granted, or count * size doesn't fit in an int.
+ *
+ * Only the part of the block that isn't already known to be zero is cleared (see
+ * Node::dirtyOrder), and that is done after the heap lock is released.
+ */
+void* BuddySystem::calloc(int count, int size) {
+    if(count < 0 || size < 0 || (size > 0 && count > INT_MAX / size)) {
+        return NULL;
+    }
+
+    void* p;
+    long long dirtyBytes;
+    {
+        ScopedLock guard(this);
+        p = this->allocate(count * size, &dirtyBytes);
+        if(p == NULL) {
+            return NULL;
+        }
+
+        this->header->stats.callocCount++;
+        this->header->stats.callocBytes += (long long)count * size;
+        this->header->stats.callocBytesCleared += dirtyBytes;
+    }
+
+    memset(p, 0, dirtyBytes);
+    return p;
+}
+
+/**
+ * The body of malloc and calloc; the heap lock must be held. If 'dirtyBytes' is given, it is
+ * set to the number of bytes at the start of the returned memory (no more than were asked for)
+ * that may not be zero. Unless 'mayMap' is false, huge requests may be given a direct mapping.
+ */
+void* BuddySystem::allocate(int request_memory, long long* dirtyBytes, BuddyLifetime lifetime, void* near, bool mayMap) {
+    if(this->snapshotsEnabled && (--this->snapshotCountdown <= 0 || this->snapshotWanted.load(std::memory_order_relaxed))) {
+        this->publishSnapshot();
+    }
+
+    // Huge requests get a mapping of their own, falling back to the heap if that fails
+    if(mayMap && this->directMapThreshold > 0 && request_memory >= this->directMapThreshold) {
+        bool zeroed;
+        void* mapped = this->directMapper.malloc(request_memory, &zeroed);
+        if(mapped != NULL) {
+            this->debugPrintF("[malloc]:: Request of %d served by a direct mapping\n", request_memory);
+            if(dirtyBytes != NULL) {
+                *dirtyBytes = zeroed ? 0 : request_memory;
+            }
+
+            if((this->sampleCountdown -= request_memory) < 0) {
+                this->sampleAllocation(mapped, request_memory, NULL);
+            }
+
+            return mapped;
+        }
+    }
+
+    // A negative request, or one too large to add the header to, can't be granted
+    if(request_memory < 0 || request_memory > INT_MAX - NODE_HEADER_SIZE) {
+        this->header->stats.failedCount++;
+        return NULL;
+    }
+
+    // Find what bin we need to satisfy this request
+    int binK = this->determineBinK((long long)request_memory + NODE_HEADER_SIZE);
+    this->debugPrintF("[malloc]:: Attempting to malloc %d where NODE_HEADER_SIZE = %d, bin k = %d\n*** Free list before malloc: ***\n", request_memory, NODE_HEADER_SIZE, binK);
+    this->debugNodeStructure();
+
+    Node* binNode = near != NULL ? this->allocateNear(near, binK) : NULL;
+    if(binNode == NULL) {
+        binNode = this->allocateNode(binK, lifetime == BUDDY_LIFETIME_LONG);
+    }
+
+    if(binNode == NULL) {
+        this->header->stats.failedCount++;
+        return NULL;
+    }
+
+    this->header->stats.mallocCount++;
+    this->header->stats.bytesAllocated += 1LL << binNode->order;
+    this->countAllocated(binNode, 1);
+
+    this->debugPrintF("[malloc]:: Success, freeing node (with size of %lld) and returning data pointer\n*** Free list after malloc: ***\n", 1LL << binNode->order);
+    this->debugNodeStructure();
+
+    // The colour is a whole number of cache lines, no more than the slack after the request
+    long long colour = 0;
+    if(this->colourOrder > 0 && binNode->order >= this->colourOrder) {
+        long long lines = ((1LL << binNode->order) - NODE_HEADER_SIZE - request_memory) / CACHE_LINE_SIZE;
+        lines = lines < COLOUR_LINES - 1 ? lines : COLOUR_LINES - 1;
+        colour = (this->colourNext[binNode->order]++ % (lines + 1)) * CACHE_LINE_SIZE;
+    }
+
+    if(colour > 0) {
+        Node* tag = (Node*)((uintptr_t)binNode + (uintptr_t)colour);
+        tag->order = binNode->order;
+        tag->alloc = 1;
+        tag->dirtyOrder = binNode->dirtyOrder;
+        tag->flags = NODE_COLOURED;
+        tag->colourOffset = (unsigned int)colour;
+        this->header->stats.colouredCount++;
+    }
+
+    if(dirtyBytes != NULL) {
+        long long dirty = (1LL << binNode->dirtyOrder) - NODE_HEADER_SIZE - colour;
+        dirty = dirty > 0 ? dirty : 0;
+        *dirtyBytes = dirty < request_memory ? dirty : request_memory;
+    }
+
+    // Return data pointer for use by memory requester
+    void* data = (void *)((uintptr_t)binNode + (uintptr_t)NODE_HEADER_SIZE + (uintptr_t)colour);
+    if((this->sampleCountdown -= 1LL << binNode->order) < 0) {
+        this->sampleAllocation(data, 1LL << binNode->order, binNode);
+    }
+
+    return data;
+} 
 
 /**
- * Given a request size, malloc will attempt to find a node that
- * can satisfy the request. This may require splitting nodes of larger
- * sizes many times so that the request can be satisfied.
- * 
- * The pointer to the usable data section of the node is returned, or NULL
- * if the request could not be granted for any reason (e.g. insufficient memory space)
+ * allocateNode finds a free node in bin 'binK' (splitting a node from a larger bin
+ * if need be), ejects it from the free list and marks it as allocated. The node comes
+ * from the lowest address that will do, or the highest if 'fromTop' is set.
+ *
+ * Returns NULL if no node large enough is free.
  */
-void* BuddySystem::malloc(int request_memory) {
-    // Find what bin we need to satisfy this request
-    int binK = this->determineBinK(request_memory + sizeof(Node));
-    this->debugPrintF("[malloc]:: Attempting to malloc %d where sizeof(Node) = %d, bin k = %d\n*** Free list before malloc: ***\n", request_memory, sizeof(Node), binK);
-    this->debugNodeStructure();
+Node* BuddySystem::allocateNode(int binK, bool fromTop) {
     if(binK > this->upperK || binK < 0) {
         this->debugPrintF("[malloc]:: Failed to determine bin for request\n");
         return NULL;
     }
 
-    // Find the closest bin that we have available to accomodate this request
-    int foundBinK = this->findFirstBin(binK);
+    if(this->reserveStock > 0) {
+        this->recordOrder(binK);
+    }
+
+    // Find the closest bin that we have available to accomodate this request. If there isn't
+    // one, blocks left apart in a reserve may merge in to one
+    int foundBinK = fromTop ? this->findHighestBin(binK) : this->findFirstBin(binK);
+    if(foundBinK < 0 && this->reserveStock > 0 && this->releaseReserves() > 0) {
+        foundBinK = fromTop ? this->findHighestBin(binK) : this->findFirstBin(binK);
+    }
     this->debugPrintF("[malloc]:: Searching for bin size large enough for this request, found to be: %d\n", foundBinK);
     if(foundBinK < 0) {
         // -1 return means we are unable to satisfy this request as we have no free bins available
@@ -107,14 +955,27 @@ void* BuddySystem::malloc(int request_memory) {
     // to make it the right size.
     Node* binNode = NULL;
     if(foundBinK > binK) {
-        this->debugPrintF("[malloc]:: Attempting cascade split %d - %d\n", foundBinK, binK);
-        binNode = this->cascadeSplit(foundBinK, binK);
+        // A hot order stops splitting a little early, and the rest is split in to its reserve
+        int fillK = this->reserveStock > 0 ? this->reserveOrder(binK, foundBinK) : binK;
+        this->debugPrintF("[malloc]:: Attempting cascade split %d - %d\n", foundBinK, fillK);
+        binNode = this->cascadeSplit(foundBinK, fillK, fromTop);
 
         // NULL return here means failure to perform the split.
         if(binNode == NULL) {
             this->debugPrintF("[malloc]:: Error, no bin could be split\n");
             return NULL;
         }
+
+        if(fillK > binK) {
+            binNode = this->fillReserve(binNode, binK);
+
+            // The reserve fills the block from the bottom; the top piece is just as ready
+            if(fromTop) {
+                binNode = (Node*)((uintptr_t)binNode + (uintptr_t)(1LL << fillK) - (uintptr_t)(1LL << binK));
+            }
+        }
+
+        this->header->stats.splitChainCount++;
     } else if(foundBinK < binK) {
         return NULL;
     }
@@ -128,19 +989,116 @@ void* BuddySystem::malloc(int request_memory) {
             return NULL;
         }
 
+        binNode = this->getFromBin(foundBinK, fromTop);
+    }
+
+    // Free the node (marking as allocated too). A purged block is simply in use again
+    ejectFromFree(binNode);
+    binNode->alloc = 1;
+    binNode->flags = 0;
+
+    return binNode;
+}
+
+/**
+ * allocateNear finds a free node of at least order 'binK' close to the block holding 'hint'
+ * (see findNear), splits it down to 'binK' keeping the half nearest the hint each time, and
+ * ejects it from the free list marked as allocated.
+ *
+ * Returns NULL if neither a close node nor a free page was found, for allocateNode to place
+ * the block instead.
+ */
+Node* BuddySystem::allocateNear(void* hint, int binK) {
+    if(binK > this->upperK || binK < 0) {
+        return NULL;
+    }
+
+    // Only the data of a block from this heap has a Node (or colour tag) in front of it
+    Node* origin = NULL;
+    if(this->owns(hint) && this->owns((void*)((uintptr_t)hint - (uintptr_t)NODE_HEADER_SIZE))) {
+        origin = this->nodeOf(hint);
+    }
+
+    int regionK;
+    Node* binNode = NULL;
+    if(origin != NULL && this->owns(origin) && origin->alloc == 1) {
+        binNode = this->findNear(origin, binK, &regionK);
+    }
+
+    // With nothing close, a new neighbourhood is started in a free block of at least a page
+    // (rather than the lowest hole that fits), so the blocks placed near this one find room
+    if(binNode == NULL) {
+        this->header->stats.nearFallbackCount++;
+        regionK = this->upperK;
+        int foundBinK = this->findFirstBin(binK > NEAR_PAGE_ORDER ? binK : NEAR_PAGE_ORDER);
+        if(foundBinK < 0) {
+            return NULL;
+        }
+
         binNode = this->getFromBin(foundBinK);
     }
 
-    // Free the node (marking as allocated too)
+    if(this->reserveStock > 0) {
+        this->recordOrder(binK);
+    }
+
+    if(binNode->order > binK) {
+        while(binNode->order > binK) {
+            uintptr_t middle = (uintptr_t)binNode + (uintptr_t)(1LL << (binNode->order - 1));
+            binNode = this->splitNode(binNode, (uintptr_t)origin >= middle);
+        }
+
+        this->header->stats.splitChainCount++;
+    }
+
+    if(regionK <= NEAR_PAGE_ORDER) {
+        this->header->stats.nearPageCount++;
+    } else if(regionK <= NEAR_HUGE_PAGE_ORDER) {
+        this->header->stats.nearHugePageCount++;
+    } else if(regionK < this->upperK) {
+        this->header->stats.nearHeapCount++;
+    }
+
     ejectFromFree(binNode);
     binNode->alloc = 1;
+    binNode->flags = 0;
 
-    this->debugPrintF("[malloc]:: Success, freeing node (with size of %d) and returning data pointer\n*** Free list after malloc: ***\n", binNode->size);
-    this->debugNodeStructure();
+    return binNode;
+}
 
-    // Return data pointer for use by memory requester
-    return (void *)((uintptr_t)binNode + (uintptr_t)sizeof(Node));
-} 
+/**
+ * Searches outwards from 'origin' (an allocated block) for a free block of at least order
+ * 'binK'. The region searched starts as 'origin' and doubles each time, by adding its buddy,
+ * until it's half of the heap. As the region always holds 'origin', no block is larger than
+ * its buddy, so the buddy is walked block by block from its start, each block's Node giving
+ * the size of the step to the next.
+ *
+ * Returns the first block found, writing the order of the region it was found in to
+ * 'regionK', or NULL if there was none or NEAR_PROBE_BUDGET Nodes were read first.
+ */
+Node* BuddySystem::findNear(Node* origin, int binK, int* regionK) {
+    uintptr_t offset = (uintptr_t)origin - this->baseMemoryAddress;
+    int budget = NEAR_PROBE_BUDGET;
+
+    // Buddies smaller than the request can't hold a large enough block, so aren't looked at
+    for(int k = origin->order > binK ? origin->order : binK; k < this->upperK - 1; k++) {
+        uintptr_t start = this->baseMemoryAddress + (((offset >> k) ^ 1) << k);
+        uintptr_t end = start + (uintptr_t)(1LL << k);
+        for(uintptr_t at = start; at < end; at += (uintptr_t)(1LL << ((Node*)at)->order)) {
+            if(budget-- == 0) {
+                return NULL;
+            }
+
+            Node* node = (Node*)at;
+            if(node->alloc == 0 && node->order >= binK) {
+                *regionK = k + 1;
+                return node;
+            }
+        }
+    }
+
+    return NULL;
+}
 
 /**
  * free accepts a pointer (*p) to a data section previously allocated by this system,
@@ -149,26 +1107,78 @@ void* BuddySystem::malloc(int request_memory) {
  * 
  * If this request succeeds, the system will attempt to consolidate any free-buddy blocks
  * together to allow larger memory requests to be satisfied.
+ *
+ * Pointers outside the heap are handed to the direct mapper; 0 is returned if it doesn't
+ * recognise them either.
  */
 int BuddySystem::free(void *p){
-    Node* nodeToFree = (Node*)((uintptr_t)p - (uintptr_t)sizeof(Node));
+    AsyncRequest* served;
+    {
+        ScopedLock guard(this);
+        if(!this->owns(p)) {
+            this->sampleFree(p);
+            return this->directMapper.free(p);
+        }
+
+        Node* nodeToFree = this->nodeOf(p);
+        if((nodeToFree->flags & NODE_SAMPLED) != 0) {
+            this->sampleFree(p);
+        }
+
+        this->debugPrintF("[free]:: Memory free request node size = %lld\n*** Free list before free: ***\n", 1LL << nodeToFree->order);
+        this->debugNodeStructure();
+        this->header->stats.freeCount++;
+        this->header->stats.bytesAllocated -= 1LL << nodeToFree->order;
+        this->countAllocated(nodeToFree, -1);
+        Node* merged = this->releaseNode(nodeToFree);
+
+        this->debugPrintF("[free]::*** Free list after free: ***\n");
+        this->debugNodeStructure();
+
+        served = this->serveWaiters(merged->order);
+        if(this->snapshotsEnabled && (--this->snapshotCountdown <= 0 || this->snapshotWanted.load(std::memory_order_relaxed))) {
+            this->publishSnapshot();
+        }
+    }
+
+    // Waiters are told once the lock is released, as they may well use the heap themselves
+    this->completeWaiters(served);
+    return 1;
+}
+
+/**
+ * The inverse of allocateNode - marks an allocated node as free and puts it back in to the
+ * free list, coalescing it with its buddy as far as possible. Returns the block it ends up
+ * part of. The heap lock must be held.
+ */
+Node* BuddySystem::releaseNode(Node* node) {
+    // The links were overwritten by the block's data while it was allocated, and none of
+    // the data can be assumed to be zero. The dirty order is set first, so that the block
+    // is never free without it (see recover).
+    node->dirtyOrder = node->order;
+    node->alloc = 0;
+    node->flags = 0;
+    node->next = BUDDY_NULL_OFFSET;
+    node->previous = BUDDY_NULL_OFFSET;
+
+    // A hot order short of its reserve keeps the block as it is, rather than merging it away
+    if(this->reserveStock > 0 && this->reserveBelow(node->order, this->reserveTarget(node->order))) {
+        this->insertToFree(node);
+        return node;
+    }
 
-    this->debugPrintF("[free]:: Memory free request node size = %d\n*** Free list before free: ***\n", nodeToFree->size + sizeof(Node));
-    this->debugNodeStructure();
-    nodeToFree->alloc = 0;
     while(true) {
         // Try to coalesce, if failure, NULL is returned
-        nodeToFree = this->coalesceFree(nodeToFree);
-        if(nodeToFree == NULL) {
+        Node* coalesced = this->coalesceFree(node);
+        if(coalesced == NULL) {
             // Done
             break;
         }
+
+        node = coalesced;
     }
-    
-    this->debugPrintF("[free]::*** Free list after free: ***\n");
-    this->debugNodeStructure();
 
-    return 1;
+    return node;
 }
 
 /**
@@ -176,40 +1186,43 @@ int BuddySystem::free(void *p){
  * the node being split from the freelist, as well as adding the two
  * output nodes back to the free list at the correct bin size
  * 
- * Returns the Node pointer for the same address as the node input
+ * Returns the Node pointer for the same address as the node input, or for the
+ * upper half if 'keepUpper' is set
  */
-Node* BuddySystem::splitNode(Node* node) {
-    this->debugPrintF("[splitNode]:: Attempting to split node with reported size of %d with k=%d\n", node->size, determineBinK(node));
+Node* BuddySystem::splitNode(Node* node, bool keepUpper) {
+    this->debugPrintF("[splitNode]:: Attempting to split node with reported size of %lld with k=%d\n", 1LL << node->order, determineBinK(node));
     if(determineBinK(node) == this->lowerK) {
         throw std::invalid_argument("BuddySystem::splitNode(Node* node) failed to split 'node', doing so will breach the lower bin limit (lowerK)!\nThis node is as small as possible already.");
     }
 
     // Remove the node from the free list
     ejectFromFree(node);
+    this->header->stats.splitCount++;
 
-    // Split the node address in half, this will give us the middle of the data
-    uintptr_t base = (uintptr_t)node;
-    uintptr_t offset = (uintptr_t)(node->size + sizeof(Node));
+    // Split the node address in half, this will give us the middle of the block.
+    // Each half is one order smaller than the node being split.
+    unsigned char newOrder = node->order - 1;
 
     Node* nodeA = (Node*)((uintptr_t)node);
-    Node* nodeB = (Node*)((uintptr_t)node + (offset / (uintptr_t)2));
-
-    // Node size is representative of the data only - add back the size for the node so that
-    // our division calculation is actually acting on the entire block of memory concerning the
-    // nodes.. including the struct data itself.
-    long long int newSize = ((node->size + sizeof(Node))/2)-sizeof(Node);
+    Node* nodeB = (Node*)((uintptr_t)node + ((uintptr_t)1 << newOrder));
 
-    // Fill in the new split node
-    nodeA->size = newSize;
-    nodeA->alloc = 0;
-    nodeB->size = newSize;
+    // Fill in the new split node. nodeB is written first so that the headers
+    // always describe a valid set of blocks, even if we never get to nodeA
+    // (see recover).
+    nodeB->order = newOrder;
     nodeB->alloc = 0;
+    nodeB->flags = 0;
+    nodeB->dirtyOrder = this->pieceDirtyOrder(node, 1LL << newOrder, newOrder);
+    nodeA->dirtyOrder = this->pieceDirtyOrder(node, 0, newOrder);
+    nodeA->order = newOrder;
+    nodeA->alloc = 0;
+    nodeA->flags = 0;
     
     // Insert both nodes in to the free list
     insertToFree(nodeB);
     insertToFree(nodeA);
 
-    return nodeA;
+    return keepUpper ? nodeB : nodeA;
 }
 
 /**
@@ -224,23 +1237,299 @@ Node* BuddySystem::splitNode(Node* node) {
  * - the startingBinK in the free list contains no nodes to split.
  * - the startingBinK exceeds the upperK limit
  * - the desiredBinK exceeds the lowerK limit
+ *
+ * With 'keepUpper' set the highest node of startingBinK is split, keeping the
+ * upper half each time, so the node returned is the top of that node.
  */
-Node* BuddySystem::cascadeSplit(int startingBinK, int desiredBinK) {
+Node* BuddySystem::cascadeSplit(int startingBinK, int desiredBinK, bool keepUpper) {
     if(startingBinK > this->upperK || desiredBinK < this->lowerK || !this->binHasNode(startingBinK)) {
         return NULL;
     }
 
     // For each iteration, take a node from the free list at 'k', split it
     // and then focus on that node for the next iteration
-    Node* focus = this->getFromBin(startingBinK);
+    Node* focus = this->getFromBin(startingBinK, keepUpper);
     for(int k = startingBinK; k > desiredBinK; k--) {
-        this->debugPrintF("[cascadeSplit]:: Splitting node inside binK = %d of size %d\n", k, focus->size);
-        focus = this->splitNode(focus);
+        this->debugPrintF("[cascadeSplit]:: Splitting node inside binK = %d of size %lld\n", k, 1LL << focus->order);
+        focus = this->splitNode(focus, keepUpper);
     }
 
     return focus;
 }
 
+/**
+ * Returns the dirty order of the piece of order 'pieceOrder' starting 'offset' bytes in to
+ * 'block', for when the block is split up: a piece wholly inside the block's dirty bytes is
+ * all dirty, one past them has nothing dirty but the Node about to be written to it.
+ */
+unsigned char BuddySystem::pieceDirtyOrder(Node* block, long long offset, int pieceOrder) {
+    long long dirty = 1LL << block->dirtyOrder;
+    if(offset >= dirty) {
+        return BUDDY_MIN_ORDER;
+    }
+
+    return dirty >= (1LL << pieceOrder) ? pieceOrder : block->dirtyOrder;
+}
+
+/**
+ * Counts a malloc of order 'binK' in the order histogram, halving the whole histogram every
+ * RESERVE_DECAY_PERIOD mallocs so that orders that have gone quiet stop being hot.
+ */
+void BuddySystem::recordOrder(int binK) {
+    this->orderHits[binK]++;
+    if(++this->orderHitTotal < RESERVE_DECAY_PERIOD) {
+        return;
+    }
+
+    this->orderHitTotal = 0;
+    for(int k = 0; k < SIZE_OF_FREE_LIST; k++) {
+        this->orderHits[k] /= 2;
+        this->orderHitTotal += this->orderHits[k];
+    }
+}
+
+/**
+ * Returns the number of ready blocks to keep in bin 'binK': 0 for an order that isn't hot,
+ * otherwise the order's share of the stock, limited to RESERVE_HEAP_SHARE of the heap.
+ */
+int BuddySystem::reserveTarget(int binK) {
+    unsigned int hits = this->orderHits[binK];
+    if(hits == 0 || hits * RESERVE_HOT_SHARE < this->orderHitTotal) {
+        return 0;
+    }
+
+    long long stock = (long long)this->reserveStock * hits / this->orderHitTotal;
+    long long most = (this->header->heapSize / RESERVE_HEAP_SHARE) >> binK;
+    return (int)(stock < most ? stock : most);
+}
+
+/**
+ * Returns the order a miss in bin 'binK' should split 'foundBinK' down to, before the block
+ * is cut up in to the reserve: high enough to hold the largest power of two of blocks within
+ * the bin's target, or 'binK' itself (no reserve) for an order that isn't hot.
+ */
+int BuddySystem::reserveOrder(int binK, int foundBinK) {
+    int target = this->reserveTarget(binK);
+    int fillK = binK;
+    while(fillK < foundBinK && (2LL << (fillK - binK)) <= target) {
+        fillK++;
+    }
+
+    return fillK;
+}
+
+/**
+ * Returns true if bin 'binK' holds fewer than 'target' blocks, walking no more of the
+ * bin than that.
+ */
+bool BuddySystem::reserveBelow(int binK, int target) {
+    int count = 0;
+    for(Node* n = this->nodeAt(this->header->freeList[binK]); n != NULL && count < target; n = this->nodeAt(n->next)) {
+        count++;
+    }
+
+    return count < target;
+}
+
+/**
+ * Splits 'node' (a free block, in the free list) straight in to blocks of order 'binK',
+ * rather than one half at a time, and puts them all in the free list. Returns the first
+ * of them (at the same address as 'node'), still in the free list, for allocateNode.
+ */
+Node* BuddySystem::fillReserve(Node* node, int binK) {
+    this->ejectFromFree(node);
+
+    // As with splitNode, the headers are written from the top down so that the block's own
+    // header (written last) always describes a valid set of blocks
+    long long count = 1LL << (node->order - binK);
+    for(long long i = count - 1; i >= 0; i--) {
+        Node* block = (Node*)((uintptr_t)node + (uintptr_t)(i << binK));
+        block->dirtyOrder = this->pieceDirtyOrder(node, i << binK, binK);
+        block->order = binK;
+        block->alloc = 0;
+        block->flags = 0;
+        this->insertToFree(block);
+    }
+
+    this->header->stats.splitCount += count - 1;
+    this->header->stats.reserveFillCount++;
+    return node;
+}
+
+/**
+ * Merges every pair of free buddies left apart in the free list (the leftovers of reserves),
+ * so that their memory can serve larger requests again. Returns the number of pairs merged.
+ */
+int BuddySystem::releaseReserves() {
+    int released = 0;
+    for(int k = this->lowerK; k < this->upperK; k++) {
+        Node* node = this->nodeAt(this->header->freeList[k]);
+        while(node != NULL) {
+            Node* next = this->nodeAt(node->next);
+            Node* buddy = (Node*)this->findBuddyBlock(node);
+            if(buddy->alloc == 0 && buddy->order == k) {
+                // The pair (and anything they then merge with) leaves this bin
+                if(next == buddy) {
+                    next = this->nodeAt(buddy->next);
+                }
+
+                for(Node* merged = this->coalesceFree(node); merged != NULL; merged = this->coalesceFree(merged)) {}
+                released++;
+            }
+
+            node = next;
+        }
+    }
+
+    this->header->stats.reserveReleaseCount += released;
+    return released;
+}
+
+/**
+ * Returns the order of the chunks the occupancy map splits the heap in to: the heap is cut in
+ * to BUDDY_OCCUPANCY_CHUNKS pieces, or in to pieces of the smallest block for a tiny heap.
+ */
+int BuddySystem::occupancyOrder() {
+    int order = this->upperK - BUDDY_OCCUPANCY_ORDER;
+    return order > this->lowerK ? order : this->lowerK;
+}
+
+/**
+ * Adds 'node' to (change = 1) or takes it from (change = -1) the allocated block counts and
+ * the occupancy map, if they are being kept. The heap lock must be held.
+ */
+void BuddySystem::countAllocated(Node* node, int change) {
+    if(!this->header->trackCounts) {
+        return;
+    }
+
+    this->header->allocatedBlocks[node->order] += change;
+
+    // A block is either inside one chunk, or covers a whole number of them
+    int chunkOrder = this->occupancyOrder();
+    long long offset = this->toOffset(node);
+    if(node->order <= chunkOrder) {
+        this->header->occupancy[offset >> chunkOrder] += change * (1LL << node->order);
+        return;
+    }
+
+    long long end = (offset + (1LL << node->order)) >> chunkOrder;
+    for(long long c = offset >> chunkOrder; c < end; c++) {
+        this->header->occupancy[c] += change * (1LL << chunkOrder);
+    }
+}
+
+/**
+ * Works out the block counts and the occupancy map from scratch, by walking the blocks from
+ * the start of the heap (see recover), and keeps them from then on. Every free block is in
+ * the free list, as the purger marks the blocks it has taken out as allocated. The heap lock
+ * must be held.
+ */
+void BuddySystem::rebuildCounts() {
+    for(int k = 0; k < SIZE_OF_FREE_LIST; k++) {
+        this->header->freeBlocks[k] = 0;
+        this->header->allocatedBlocks[k] = 0;
+    }
+
+    for(int c = 0; c < BUDDY_OCCUPANCY_CHUNKS; c++) {
+        this->header->occupancy[c] = 0;
+    }
+
+    this->header->trackCounts = 1;
+    for(long long offset = 0; offset < this->header->heapSize; ) {
+        Node* node = (Node*)this->fromOffset(offset);
+        if(node->alloc == 1) {
+            this->countAllocated(node, 1);
+        } else {
+            this->header->freeBlocks[node->order]++;
+        }
+
+        offset += 1LL << node->order;
+    }
+}
+
+/**
+ * Copies the heap's counters in to the snapshot for readSnapshot. The heap lock must be held,
+ * so there is only ever one writer.
+ */
+void BuddySystem::publishSnapshot() {
+    unsigned int sequence = this->snapshotSequence.load(std::memory_order_relaxed);
+    this->snapshotSequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    BuddySnapshot* snapshot = &this->snapshot;
+    snapshot->sequence = sequence / 2;
+    snapshot->upperK = this->upperK;
+    snapshot->lowerK = this->lowerK;
+    snapshot->heapSize = this->header->heapSize;
+    snapshot->stats = this->header->stats;
+    memcpy(snapshot->freeBlocks, this->header->freeBlocks, sizeof(snapshot->freeBlocks));
+    memcpy(snapshot->allocatedBlocks, this->header->allocatedBlocks, sizeof(snapshot->allocatedBlocks));
+    snapshot->occupancyOrder = this->occupancyOrder();
+    snapshot->occupancyChunks = (int)(this->header->heapSize >> snapshot->occupancyOrder);
+    memcpy(snapshot->occupancy, this->header->occupancy, sizeof(snapshot->occupancy));
+
+    this->snapshotSequence.store(sequence + 2, std::memory_order_release);
+    this->snapshotCountdown = SNAPSHOT_PUBLISH_PERIOD;
+    this->snapshotWanted.store(false, std::memory_order_relaxed);
+}
+
+/**
+ * Called with the heap lock held once a block of 'order' has gone back in to the free list.
+ * If there are async requests (see asyncalloc.h) that the block might now meet, meets as
+ * many of them as it can and returns them, to be passed to completeWaiters once the lock
+ * is released. Otherwise this is just a check of the waiting orders, and NULL is returned.
+ */
+AsyncRequest* BuddySystem::serveWaiters(int order) {
+    // A freed block may have been kept back in a reserve rather than merged, in which case
+    // its order says nothing of what the reserves could make if they were given up
+    if(this->reserveStock > 0) {
+        order = this->upperK;
+    }
+
+    if(this->asyncAllocator == NULL || (this->waitingOrders & ((2u << order) - 1)) == 0) {
+        return NULL;
+    }
+
+    return this->asyncAllocator->serve();
+}
+
+/**
+ * Called with the heap lock held when a malloc has used up sampleCountdown: hands the
+ * allocation (of 'size' bytes, at 'p') to the profiler, marking its Node (NULL for a direct
+ * mapping) so that free knows to tell the profiler too, and starts the next countdown.
+ */
+void BuddySystem::sampleAllocation(void* p, long long size, Node* node) {
+    if(this->profiler == NULL) {
+        this->sampleCountdown = LLONG_MAX;
+        return;
+    }
+
+    if(node != NULL) {
+        node->flags |= NODE_SAMPLED;
+    }
+
+    this->sampleCountdown = this->profiler->record(p, size);
+}
+
+/**
+ * Called with the heap lock held when a sampled block (or any direct mapping) is freed
+ */
+void BuddySystem::sampleFree(void* p) {
+    if(this->profiler != NULL) {
+        this->profiler->release(p);
+    }
+}
+
+/**
+ * Makes the callbacks for requests returned by serveWaiters. Must be called without the lock.
+ */
+void BuddySystem::completeWaiters(AsyncRequest* served) {
+    if(served != NULL) {
+        AsyncAllocator::complete(served);
+    }
+}
+
 /**
  * Given a node, coalesceFree will search for it's buddy block and coalesce them if the buddy
  * block is free.
@@ -248,12 +1537,20 @@ Node* BuddySystem::cascadeSplit(int startingBinK, int desiredBinK) {
  * Returns the new coalesced block, or NULL if the buddy block was already allocated.
  */
 Node* BuddySystem::coalesceFree(Node* node) {
+    // The largest block has no buddy; its 'buddy' address would be past the end of the heap
+    if(this->determineBinK(node) >= this->upperK) {
+        this->ejectFromFree(node);
+        node->alloc = 0;
+        this->insertToFree(node);
+        return NULL;
+    }
+
     Node* buddy = (Node*)this->findBuddyBlock(node);
     this->ejectFromFree(node);
 
-    this->debugPrintF("[coalesceFree]:: Attempting to merge buddy of node with size=%d, alloc=%d\n", node->size, node->alloc);
-    this->debugPrintF("[coalesceFree]:: Buddy block for node has size=%d, alloc=%d\n", buddy->size, buddy->alloc);
-    if(buddy->alloc == 1 || buddy->size != node->size) {
+    this->debugPrintF("[coalesceFree]:: Attempting to merge buddy of node with size=%lld, alloc=%d\n", 1LL << node->order, node->alloc);
+    this->debugPrintF("[coalesceFree]:: Buddy block for node has size=%lld, alloc=%d\n", 1LL << buddy->order, buddy->alloc);
+    if(buddy->alloc == 1 || buddy->order != node->order) {
         this->debugPrintF("[coalesceFree]:: (!!) Buddy block already allocated, or is currently of the wrong size (is split).\n");
         
         node->alloc = 0;
@@ -263,6 +1560,7 @@ Node* BuddySystem::coalesceFree(Node* node) {
     
     // Coalesce the memory blocks. First remove the buddy block from the free list
     this->ejectFromFree(buddy);
+    this->header->stats.coalesceCount++;
 
     // As these blocks form contiguous memory, find the node that exists first so we can
     // form one large node with them.
@@ -270,13 +1568,27 @@ Node* BuddySystem::coalesceFree(Node* node) {
     uintptr_t buddyAddr = (uintptr_t)buddy;
     Node* coalesced = (Node*)(nodeAddr < buddyAddr ? nodeAddr : buddyAddr);
 
-    // The size is the two nodes data size, plus the size of one Node structure. As now
-    // two nodes exist as one, meaning that one of the node structure is not needed anymore...
-    // by adding this to the size, we're effectively reclaiming that memory as available data storage.
-    coalesced->size = node->size + buddy->size + sizeof(Node);
+    // The two blocks together form one block of the next order up. Now that the
+    // two nodes exist as one, the header of the second is simply part of the data.
+    Node* upper = (Node*)(nodeAddr < buddyAddr ? buddyAddr : nodeAddr);
+    unsigned char lowerDirty = coalesced->dirtyOrder;
+    unsigned char upperDirty = upper->dirtyOrder;
+
+    coalesced->order = node->order + 1;
     coalesced->alloc = 0;
-    coalesced->next = NULL;
-    coalesced->previous = NULL;
+    coalesced->flags = 0;
+    coalesced->next = BUDDY_NULL_OFFSET;
+    coalesced->previous = BUDDY_NULL_OFFSET;
+
+    // If nothing but its Node was dirty in the upper half, clearing the Node (which the new
+    // header has taken over from) keeps the merged block as clean as the lower half.
+    // Otherwise the dirty bytes are somewhere in the upper half, so the whole block is dirty.
+    if(upperDirty <= BUDDY_MIN_ORDER) {
+        memset(upper, 0, sizeof(Node));
+        coalesced->dirtyOrder = lowerDirty;
+    } else {
+        coalesced->dirtyOrder = coalesced->order;
+    }
 
     this->insertToFree(coalesced);
     return coalesced;
@@ -289,7 +1601,7 @@ Node* BuddySystem::coalesceFree(Node* node) {
 uintptr_t BuddySystem::findBuddyBlock(Node* node) {
     uintptr_t address = (uintptr_t)node;
     uintptr_t start = this->baseMemoryAddress;
-    uintptr_t size = (uintptr_t)(sizeof(Node)) + (uintptr_t)(node->size);
+    uintptr_t size = (uintptr_t)1 << node->order;
 
     return start + ((address - start) ^ size);
 }
@@ -304,21 +1616,32 @@ void BuddySystem::insertToFree(Node* node) {
         throw std::domain_error("BuddySystem::insertToFree(Node* node) failed to insert 'node' in to free list, bin size (k) determined for this size is out of domain");
     }
     
-    this->debugPrintF("[insertToFree]:: Attempting to insert a free node of size = %d into freelist @ k=%d\n", node->size, k);
-    // Get first node. This may be NULL
-    Node* start = freeList[k];
+    this->debugPrintF("[insertToFree]:: Attempting to insert a free node of size = %lld into freelist @ k=%d\n", 1LL << node->order, k);
+    // Get first node. This may be BUDDY_NULL_OFFSET
+    unsigned int start = this->header->freeList[k];
+    unsigned int offset = this->offsetOf(node);
 
     // Point our next to this node and previous to NULL (as we're the first Node), also set it to free (alloc=0)
     node->next = start;
-    node->previous = NULL;
+    node->previous = BUDDY_NULL_OFFSET;
+
+    // Blocks the purger looks after are timestamped; the memory is in use again so it isn't purged.
+    // A relaxed load is all that's needed, as the stamp is only read under the heap lock.
+    if(k >= this->purgeOrder) {
+        node->flags &= ~NODE_PURGED;
+        node->freedEpoch = this->purgeEpoch.load(std::memory_order_relaxed);
+    }
 
     // If the bin already had a node in it, point it's previous to us now instead of NULL.
-    if(start != NULL) {
-        start->previous = node;
+    if(start != BUDDY_NULL_OFFSET) {
+        this->nodeAt(start)->previous = offset;
     }
 
     // Tell the list to point to us as the beginning of the linked list now
-    freeList[k] = node;
+    this->header->freeList[k] = offset;
+    if(this->header->trackCounts) {
+        this->header->freeBlocks[k]++;
+    }
 }
 
 /**
@@ -331,18 +1654,21 @@ void BuddySystem::ejectFromFree(Node* node) {
         throw std::domain_error("BuddySystem::ejectFromFree(Node* node) failed to eject 'node' from free list, bin size (k) determined for this size is out of domain");
     }
 
-    this->debugPrintF("[ejectFromFree]:: Attempting to eject a free node of size = %d from freelist @ k=%d\n", node->size, k);
+    this->debugPrintF("[ejectFromFree]:: Attempting to eject a free node of size = %lld from freelist @ k=%d\n", 1LL << node->order, k);
     // If current has neither a next or previous, check if it's an orphan in the list
-    if(node->next == NULL && node->previous == NULL) {
-        if(freeList[k] == node) {
-            freeList[k] = NULL;
+    if(node->next == BUDDY_NULL_OFFSET && node->previous == BUDDY_NULL_OFFSET) {
+        if(this->header->freeList[k] == this->offsetOf(node)) {
+            this->header->freeList[k] = BUDDY_NULL_OFFSET;
+            if(this->header->trackCounts) {
+                this->header->freeBlocks[k]--;
+            }
         }
 
         return;
     }
 
-    Node* left = node->previous;
-    Node* right = node->next;
+    Node* left = this->nodeAt(node->previous);
+    Node* right = this->nodeAt(node->next);
     
     // Take care of pointers for the adjacent nodes, including when one or both of these nodes don't exist.
     if(right == NULL) {
@@ -350,24 +1676,27 @@ void BuddySystem::ejectFromFree(Node* node) {
         // In the case there is no left node either, the next if clause will take care of that and
         // tell freelist to point to right (NULL)
         if(left != NULL) {
-            left->next = NULL;
+            left->next = BUDDY_NULL_OFFSET;
         }
     } else {
         // Tell the next node that it's previous node is now the one before the node we're ejecting.
-        right->previous = left;
+        right->previous = node->previous;
     }
 
     if(left == NULL) {
         // The node we found was the first in the list. Point the free list to the node to the right
-        freeList[k] = right;
+        this->header->freeList[k] = node->next;
     } else {
         // Point the left node's next, to the node to the right of the node we're ejecting
-        left->next = right;
+        left->next = node->next;
     }
 
     // Mark node as allocated, and set the linked list paramaters to NULL as it's no longer inside the list.
-    node->next = NULL;
-    node->previous = NULL;
+    node->next = BUDDY_NULL_OFFSET;
+    node->previous = BUDDY_NULL_OFFSET;
+    if(this->header->trackCounts) {
+        this->header->freeBlocks[k]--;
+    }
 }
 
 /**
@@ -375,11 +1704,18 @@ void BuddySystem::ejectFromFree(Node* node) {
  * request belongs to, using the formula found in our lecture slides. The k value
  * associatted with this bin is returned.
  * 
- * 2^(k-1) < request_size < 2^k
+ * 2^(k-1) < request_size <= 2^k
+ *
+ * Requests smaller than the smallest block belong to the smallest bin (lowerK). Returns -1
+ * for a size of 0 or less, or one larger than the heap.
  */
-int BuddySystem::determineBinK(int request_size) {
+int BuddySystem::determineBinK(long long request_size) {
+    if(request_size <= 0) {
+        return -1;
+    }
+
     for(int k = this->lowerK; k <= this->upperK; k++) {
-        if(std::pow(2, k - 1) < request_size && request_size <= std::pow(2, k)) {
+        if(request_size <= (1LL << k)) {
             return k;
         }
     }
@@ -388,14 +1724,11 @@ int BuddySystem::determineBinK(int request_size) {
 }
 
 /**
- * Overloaded version of determineBinK where we provide a Node* instead of an integer size
- * This means we can assume the node is a perfect size for the free list, and can use
- * logarithms to quickly calculate the 'k' value associatted with the node
- * 
- * 2^k = size, so k = log2(size).
+ * Overloaded version of determineBinK where we provide a Node* instead of an integer size.
+ * The node records its own order, which is exactly the bin it belongs in.
  */
 int BuddySystem::determineBinK(Node* node) {
-    return std::log2(node->size + sizeof(Node));
+    return node->order;
 }
 
 /**
@@ -404,30 +1737,51 @@ int BuddySystem::determineBinK(Node* node) {
  * can be found using 2^binSize.
  */
 bool BuddySystem::binHasNode(int binK) {
-    return this->freeList[binK] != NULL;
+    return this->header->freeList[binK] != BUDDY_NULL_OFFSET;
+}
+
+/**
+ * Returns the bin, from 'binK' up, holding the free node with the highest address; as
+ * free nodes never overlap, splitting that node from the top gives the highest placed
+ * node of order 'binK' there is. Returns -1 if every bin from 'binK' up is empty.
+ */
+int BuddySystem::findHighestBin(int binK) {
+    int found = -1;
+    Node* highest = NULL;
+    for(int k = binK; k <= this->upperK; k++) {
+        Node* node = this->getFromBin(k, true);
+        if(node != NULL && node > highest) {
+            highest = node;
+            found = k;
+        }
+    }
+
+    return found;
 }
 
 /**
  * Returns a Node from the bin provided with the smallest address (i.e. the
- * earliest node in the memory block).
+ * earliest node in the memory block), or the largest if 'highest' is set.
  */
-Node* BuddySystem::getFromBin(int binK) {
-    Node* current = this->freeList[binK];
-    if(current == NULL) {
+Node* BuddySystem::getFromBin(int binK, bool highest) {
+    unsigned int current = this->header->freeList[binK];
+    if(current == BUDDY_NULL_OFFSET) {
         return NULL;
     }
 
-    uintptr_t min = (uintptr_t)current;
-    current = current->next;
-    while(current != NULL) {
-        if((uintptr_t)current < min) {
-            min = (uintptr_t)current;
+    // Offsets are relative to the start of the heap, so the smallest
+    // offset is also the smallest address.
+    unsigned int best = current;
+    current = this->nodeAt(current)->next;
+    while(current != BUDDY_NULL_OFFSET) {
+        if(highest ? current > best : current < best) {
+            best = current;
         };
 
-        current = current->next;
+        current = this->nodeAt(current)->next;
     }
 
-    return (Node*)min;
+    return this->nodeAt(best);
 }
 
 /**
@@ -447,6 +1801,77 @@ int BuddySystem::findFirstBin(int binK) {
     return -1;
 }
 
+/**
+ * Returns the Node of the block whose data starts at 'p' (as returned by malloc). The 8 bytes
+ * in front of the data are the Node itself, or for a coloured block, its colour tag.
+ */
+Node* BuddySystem::nodeOf(void* p) {
+    Node* node = (Node*)((uintptr_t)p - (uintptr_t)NODE_HEADER_SIZE);
+    if((node->flags & NODE_COLOURED) != 0) {
+        node = (Node*)((uintptr_t)node - (uintptr_t)node->colourOffset);
+    }
+
+    return node;
+}
+
+/**
+ * Converts an offset stored in the free list (or a Node's next/previous) back in to a
+ * Node pointer for this process. BUDDY_NULL_OFFSET becomes NULL.
+ */
+Node* BuddySystem::nodeAt(unsigned int offset) {
+    if(offset == BUDDY_NULL_OFFSET) {
+        return NULL;
+    }
+
+    return (Node*)(this->baseMemoryAddress + ((uintptr_t)offset << BUDDY_MIN_ORDER));
+}
+
+/**
+ * Returns the offset of the node from the start of the heap (in units of the smallest
+ * block), for storage in the free list.
+ */
+unsigned int BuddySystem::offsetOf(Node* node) {
+    return (unsigned int)(((uintptr_t)node - this->baseMemoryAddress) >> BUDDY_MIN_ORDER);
+}
+
+/**
+ * Spins until the heap lock is available. The lock lives in the BuddyHeader, which for a
+ * shared heap is inside the shared region, so this also excludes other processes.
+ */
+void BuddySystem::acquireLock() {
+    while(this->header->lock.exchange(1, std::memory_order_acquire) != 0) {
+        // Wait for the lock to look free before trying to take it again, so
+        // waiters don't keep bouncing the cache line between cores.
+        while(this->header->lock.load(std::memory_order_relaxed) != 0) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+/**
+ * Takes the heap lock if it is free, without waiting. Returns true if the lock was taken.
+ */
+bool BuddySystem::tryAcquireLock() {
+    return this->header->lock.load(std::memory_order_relaxed) == 0 && this->header->lock.exchange(1, std::memory_order_acquire) == 0;
+}
+
+void BuddySystem::releaseLock() {
+    this->header->lock.store(0, std::memory_order_release);
+}
+
+BuddySystem::ScopedLock::ScopedLock(BuddySystem* owner) {
+    this->owner = owner->threadSafe ? owner : NULL;
+    if(this->owner != NULL) {
+        this->owner->acquireLock();
+    }
+}
+
+BuddySystem::ScopedLock::~ScopedLock() {
+    if(this->owner != NULL) {
+        this->owner->releaseLock();
+    }
+}
+
 /**
  * This debug function will print out the structure of the free list using
  * a graphical representation of each doubly-linked-list in the free list.
@@ -458,10 +1883,10 @@ void BuddySystem::debugNodeStructure() {
     for(int k = this->upperK; k >= this->lowerK; k--) {
         this->debugPrintF("k = %d contains: ", k);
         
-        Node* n = this->freeList[k];
+        Node* n = this->nodeAt(this->header->freeList[k]);
         while(n != NULL) {
-            this->debugPrintF("%d <-> ", n->size + sizeof(Node));
-            n = n->next;
+            this->debugPrintF("%lld <-> ", 1LL << n->order);
+            n = this->nodeAt(n->next);
         }
         this->debugPrintF("NULL;\n");
     }
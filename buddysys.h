@@ -14,16 +14,117 @@
 #define __BUDDYSYS_H__
 
 
+#include <atomic>
+
 #include "auxiliary.h"
+#include "platform.h"
+#include "directmap.h"
+
+class BuddyPurger;
+class AsyncAllocator;
+class HeapProfiler;
+struct AsyncRequest;
 // The size of the free list, which uses 'k' as it's index
 // where 2^k should be the size of the initial free block
 // As we're using stack based arrays, this means the
 // value must be hardcoded - adjust this value to match 
 // the size of the *wholememory Node provided to the
-// constructor.
-#define SIZE_OF_FREE_LIST 26
+// constructor. 32 allows heaps of up to 2GiB (order 31); it can't go higher
+// without widening BuddySystem::waitingOrders, which has a bit for each order.
+#define SIZE_OF_FREE_LIST 32
+
+#ifndef BUDDY_SYS_DEBUG
+    #define BUDDY_SYS_DEBUG 1
+#endif
+
+// Links between nodes are stored as 32-bit offsets from the first Node
+// (baseMemoryAddress) rather than as pointers, so that the same heap can
+// be mapped at different addresses by different processes. Every block
+// starts on a multiple of the smallest block size, so the offsets are
+// stored in units of that (2^BUDDY_MIN_ORDER bytes), letting 32 bits
+// reach 64GiB. This value takes the place of NULL for those offsets.
+#define BUDDY_NULL_OFFSET 0xFFFFFFFFu
+
+// Number of bytes at the start of every block used by the Node header. An
+// allocated block's data starts straight after this; the rest of the Node
+// (the free list links) only exists while the block is free.
+#define NODE_HEADER_SIZE 8
+
+// The order of the smallest block: it must hold a whole Node (header and
+// links) while free, which leaves 8 bytes of data once allocated.
+#define BUDDY_MIN_ORDER 4
+
+// Node::flags - the block belongs to a handle, so it may be moved
+#define NODE_HANDLE 0x01
+
+// A compact reference to memory malloc'd from a BuddySystem (see mallocRef):
+// where its data starts, as an offset from the start of the heap in units of
+// the smallest block. Every block's data starts NODE_HEADER_SIZE bytes past a
+// multiple of that (colouring moves it by whole cache lines), so nothing is
+// lost, and 32 bits reach 64GiB. Like toOffset, a reference means the same in
+// every process attached to a shared heap.
+typedef unsigned int BuddyRef;
+#define BUDDY_NULL_REF 0xFFFFFFFFu
+
+// One piece of a vectored allocation (see mallocVectored), as an iovec: its
+// data, and how many of the bytes asked for it holds
+typedef struct BuddyIoVec {
+    void* base;
+    long long length;
+} BuddyIoVec;
+
+// Node::flags - a free block's pages (all but the first) have been handed
+// back to the operating system by the purger; see purger.h.
+#define NODE_PURGED 0x02
+
+// Node::flags - not a Node at all, but the colour tag in front of the data of
+// a coloured block (see setColouring); its colourOffset leads back to the Node.
+#define NODE_COLOURED 0x04
 
-#define BUDDY_SYS_DEBUG 1
+// Node::flags - the block was sampled by the heap profiler, which must be told
+// when it is freed; see heapprofiler.h.
+#define NODE_SAMPLED 0x08
+
+// Colouring moves a block's data along by whole cache lines, by at most
+// COLOUR_LINES - 1 of them: 64 lines covers every set of a 32KB, 8 way L1 cache,
+// whose sets repeat every 4KB.
+#define CACHE_LINE_SIZE 64
+#define COLOUR_LINES 64
+
+// Hot order reserves (see setReserveStock): the order histogram is halved
+// every RESERVE_DECAY_PERIOD mallocs, so it follows recent traffic, and an
+// order is hot once it takes at least 1 in RESERVE_HOT_SHARE of the requests.
+// A reserve never holds more than 1 / RESERVE_HEAP_SHARE of the heap.
+#define RESERVE_DECAY_PERIOD 1024
+#define RESERVE_HOT_SHARE 8
+#define RESERVE_HEAP_SHARE 64
+
+// The occupancy map splits the heap in to (up to) 2^BUDDY_OCCUPANCY_ORDER equal
+// chunks, and counts the bytes allocated in each.
+#define BUDDY_OCCUPANCY_ORDER 6
+#define BUDDY_OCCUPANCY_CHUNKS (1 << BUDDY_OCCUPANCY_ORDER)
+
+// Once snapshots are enabled, a new one is published every this many mallocs
+// and frees (see enableSnapshots).
+#define SNAPSHOT_PUBLISH_PERIOD 64
+
+// How long initShared waits for the creator of a shared heap to finish
+// formatting it before deciding the creator died part way through
+#define SHARED_READY_TIMEOUT_MS 5000
+
+// mallocNear widens its search through the orders of a page and of a huge page
+// (on x86) before the rest of the hint's half of the heap, and gives up after
+// reading this many block headers.
+#define NEAR_PAGE_ORDER 12
+#define NEAR_HUGE_PAGE_ORDER 21
+#define NEAR_PROBE_BUDGET 256
+
+// Stamped in to the BuddyHeader of a shared region once it has been formatted
+#define BUDDY_HEADER_MAGIC 0x42554459
+
+// Layout version of the BuddyHeader and Node structures. A persistent heap
+// written with a different version is refused rather than misread.
+#define BUDDY_HEADER_VERSION 9
 
 extern long long int MEMORYSIZE;
 
@@ -34,53 +135,350 @@ extern long long int MEMORYSIZE;
 typedef unsigned char byte;
 
 typedef struct Node {
-    //size of the block (ONLY for data, this size does not consider the Node size! (so it is same as s[k])
-    long long int size;
+    // The order (k) of the block - the whole block, this header included,
+    // is 2^k bytes. This takes the place of storing the size.
+    unsigned char order;
 
     // 0 is free, 1 means allocated - We use this variable here so that
     // when searching for buddy-blocks to consolidate in to one we can
     // tell if it's allocated without having to go and check
     // the free list for the buddy blocks node presence
-    int alloc;
+    unsigned char alloc;
+
+    // For a free block, only the first 2^dirtyOrder bytes (the Node among
+    // them) may be non-zero - the rest is known to be zero, so calloc needn't
+    // clear it. Equal to 'order' when nothing is known.
+    unsigned char dirtyOrder;
+
+    // NODE_* flags describing how the block is being used; 0 for blocks from
+    // a plain malloc, and for free blocks that haven't been purged.
+    unsigned char flags;
 
-    // Pointer to the next node; NULL if none
-    struct Node * next;
+    union {
+        // For free blocks of at least BuddySystem::purgeOrder, the purge epoch
+        // at which the block was last put in the free list.
+        unsigned int freedEpoch;
 
-    // Pointer to the next node; NULL if none.
-    struct Node * previous;
+        // For allocated blocks with NODE_HANDLE set, the handle that refers
+        // to the block; see handles.h.
+        unsigned int handle;
+
+        // For a colour tag (NODE_COLOURED), how many bytes in front of it the
+        // block's own Node is.
+        unsigned int colourOffset;
+    };
+
+    // ---- Only valid while the block is free; part of the data otherwise ----
+
+    // Offset of the next node; BUDDY_NULL_OFFSET if none
+    unsigned int next;
+
+    // Offset of the previous node; BUDDY_NULL_OFFSET if none.
+    unsigned int previous;
 } Node;
 
+// How long a block is expected to live, given to malloc as a placement hint.
+// Short lived blocks are placed from the low end of the heap and long lived
+// ones from the high end, so the two don't end up side by side, where a long
+// lived block would stop its short lived neighbours ever merging again.
+enum BuddyLifetime {
+    // Nothing is known; placed as a short lived block, as malloc always has
+    BUDDY_LIFETIME_UNKNOWN,
+    BUDDY_LIFETIME_SHORT,
+    BUDDY_LIFETIME_LONG
+};
+
+// Running totals kept by each heap
+typedef struct BuddyStats {
+    long long mallocCount;
+    long long freeCount;
+    long long failedCount;
+
+    // Bytes of whole blocks (Node included) currently allocated
+    long long bytesAllocated;
+
+    long long splitCount;
+    long long coalesceCount;
+
+    // Mallocs that had to split a larger block (however many times)
+    long long splitChainCount;
+
+    // Splits that filled a hot order's reserve, and free buddies (left in a
+    // reserve) merged back together when memory ran short
+    long long reserveFillCount;
+    long long reserveReleaseCount;
+
+    // Bytes requested through calloc, and how many of them had to be
+    // cleared (the rest were already known to be zero)
+    long long callocCount;
+    long long callocBytes;
+    long long callocBytesCleared;
+
+    // mallocNear calls placed within the hint's page, its huge page, or its
+    // half of the heap, and those that fell back to the usual placement
+    long long nearPageCount;
+    long long nearHugePageCount;
+    long long nearHeapCount;
+    long long nearFallbackCount;
+
+    // Mallocs whose data was moved along their block by colouring
+    long long colouredCount;
+} BuddyStats;
+
+// All of the state a buddy system needs to manage its memory. For a normal
+// (private) heap this lives inside the BuddySystem instance, but for a shared
+// heap it is placed at the start of the shared region itself, so every process
+// mapping the region sees (and updates) the same free list.
+typedef struct BuddyHeader {
+    // BUDDY_HEADER_MAGIC once the region has been formatted
+    unsigned int magic;
+    unsigned int version;
+
+    // For a persistent heap: 1 if the heap was closed cleanly (so the free
+    // list can be trusted), 0 while the heap is open.
+    int cleanShutdown;
+
+    // Set to 1 by the creating process after formatting; attaching processes
+    // wait on this before touching the free list.
+    std::atomic<int> ready;
+
+    // Spin lock guarding the free list. Being a plain atomic inside the region,
+    // it works across processes as well as across threads.
+    std::atomic<int> lock;
+
+    int upperK;
+    int lowerK;
+
+    // Offset from the start of the region to the first Node, and the size of
+    // the memory managed from there on.
+    long long heapOffset;
+    long long heapSize;
+
+    // Offset of an application chosen 'root' block, from which everything
+    // else in a persistent heap can be found again; BUDDY_NULL_OFFSET if unset.
+    long long root;
+
+    BuddyStats stats;
+
+    // Head of each bin, as an offset from the first Node
+    unsigned int freeList[SIZE_OF_FREE_LIST];
+
+    // Number of blocks of each order in the free list and allocated, and bytes
+    // allocated in each chunk of the heap (see occupancyOrder). These are only
+    // kept once trackCounts is set, by the first process to enable snapshots.
+    int trackCounts;
+    unsigned int freeBlocks[SIZE_OF_FREE_LIST];
+    unsigned int allocatedBlocks[SIZE_OF_FREE_LIST];
+    long long occupancy[BUDDY_OCCUPANCY_CHUNKS];
+} BuddyHeader;
+
+// A copy of the heap's counters, published by the heap every so often so that
+// they can be read (by the introspection server, say) without the heap lock.
+typedef struct BuddySnapshot {
+    // Number of snapshots published before this one
+    unsigned long long sequence;
+
+    int upperK;
+    int lowerK;
+    long long heapSize;
+
+    BuddyStats stats;
+    unsigned int freeBlocks[SIZE_OF_FREE_LIST];
+    unsigned int allocatedBlocks[SIZE_OF_FREE_LIST];
+
+    // The heap is split in to occupancyChunks chunks of 2^occupancyOrder bytes
+    int occupancyOrder;
+    int occupancyChunks;
+    long long occupancy[BUDDY_OCCUPANCY_CHUNKS];
+} BuddySnapshot;
+
 // Decalre the wholememory pointer as an extern(ally) defined variable.
 extern Node *wholememory;
 
 ///////////////////////////////////////////////////////////////////////////////////
 
 class BuddySystem {
-    Node* freeList[SIZE_OF_FREE_LIST];
+    // Points at 'localHeader' for a private heap, or in to the mapped region
+    // for a shared heap.
+    BuddyHeader* header;
+    BuddyHeader localHeader;
+    PlatformMapping mapping;
+
     uintptr_t baseMemoryAddress;
     int upperK;
     int lowerK;
+    bool threadSafe;
+    bool shared;
+    bool persistent;
+
+    // Requests of at least this many bytes get their own mapping (0 to disable)
+    DirectMapper directMapper;
+    long long directMapThreshold;
+
+    // Free blocks of at least this order are stamped with purgeEpoch as they go
+    // in to the free list, for the purger (SIZE_OF_FREE_LIST when not purging)
+    int purgeOrder;
+    std::atomic<unsigned int> purgeEpoch;
+
+    // Most ready blocks to keep for a hot order (0 when not reserving), and the
+    // decaying count of mallocs made for each order. Kept per process, even for
+    // a shared heap, as they only steer how blocks are split.
+    int reserveStock;
+    unsigned int orderHits[SIZE_OF_FREE_LIST];
+    unsigned int orderHitTotal;
+
+    // Blocks of at least this order are coloured (0 when not colouring), each
+    // order taking the colours in turn. Kept per process, as reserves are.
+    int colourOrder;
+    unsigned int colourNext[SIZE_OF_FREE_LIST];
+
+    // The allocator whose requests are waiting for memory (NULL if none), and a
+    // bit for each order with a request waiting; see asyncalloc.h.
+    AsyncAllocator* asyncAllocator;
+    unsigned int waitingOrders;
+
+    // The profiler sampling this heap's mallocs (NULL if none), and the bytes
+    // left to allocate before the next sample; see heapprofiler.h.
+    HeapProfiler* profiler;
+    long long sampleCountdown;
+
+    // The published snapshot (once enableSnapshots is called), guarded by a
+    // sequence lock: the sequence is odd while the snapshot is being written. A
+    // reader can ask for a snapshot sooner than the countdown would give one.
+    BuddySnapshot snapshot;
+    bool snapshotsEnabled;
+    std::atomic<unsigned int> snapshotSequence;
+    std::atomic<bool> snapshotWanted;
+    int snapshotCountdown;
+
+    friend class BuddyPurger;
+    friend class HandleHeap;
+    friend class AsyncAllocator;
+    friend class HeapProfiler;
 public:
     BuddySystem();
-    void init(Node* wholememory);
+    void init(Node* wholememory, long long memorySize, bool zeroed = false);
+    void initShared(const char* name, long long heapSize);
+    bool initPersistent(const char* path, long long heapSize);
+    void detach();
+    static void unlinkShared(const char* name);
+
+    void setRoot(void* p);
+    void* getRoot();
+
     void* malloc(int request_memory); 
+    void* malloc(int request_memory, BuddyLifetime lifetime);
+    void* mallocNear(void* hint, int request_memory);
+    void* calloc(int count, int size);
+    void* mallocAtLeast(int request_memory, long long* usable);
     int free(void *p);
+
+    long long usableSize(void* p);
+
+    long long toOffset(void* p);
+    void* fromOffset(long long offset);
+
+    BuddyRef mallocRef(int request_memory);
+    int freeRef(BuddyRef ref);
+
+    int mallocVectored(long long total, int maxSegments, BuddyIoVec* iov);
+    int freeVectored(BuddyIoVec* iov, int segments);
+
+    /**
+     * Returns the memory a reference from mallocRef (or toRef) refers to; NULL for BUDDY_NULL_REF.
+     * Kept inline, as containers built on the heap decode a reference for every link they follow.
+     */
+    void* fromRef(BuddyRef ref) {
+        return ref == BUDDY_NULL_REF ? NULL : (void*)(this->baseMemoryAddress + ((uintptr_t)ref << BUDDY_MIN_ORDER) + NODE_HEADER_SIZE);
+    }
+
+    /**
+     * Returns the reference for memory malloc'd from this heap (not from a direct mapping; see
+     * owns), or BUDDY_NULL_REF for NULL.
+     */
+    BuddyRef toRef(void* p) {
+        return p == NULL ? BUDDY_NULL_REF : (BuddyRef)(((uintptr_t)p - NODE_HEADER_SIZE - this->baseMemoryAddress) >> BUDDY_MIN_ORDER);
+    }
+
+    bool owns(void* p);
+    BuddyStats getStats();
+    long long largestFreeBlock();
+
+    void setThreadSafe(bool enabled);
+
+    void setDirectMapThreshold(long long bytes);
+    DirectMapStats getDirectMapStats();
+
+    void setReserveStock(int blocks);
+    void setColouring(int minOrder);
+    long long prefault(long long bytes, int threads);
+
+    void enableSnapshots();
+    bool readSnapshot(BuddySnapshot* out);
 protected:
-    Node* splitNode(Node* node);
+    // Holds the heap lock for the lifetime of the guard, if the
+    // heap is thread safe (always the case for a shared heap).
+    class ScopedLock {
+        BuddySystem* owner;
+    public:
+        ScopedLock(BuddySystem* owner);
+        ~ScopedLock();
+    };
+
+    void acquireLock();
+    bool tryAcquireLock();
+    void releaseLock();
+
+    void resetRuntimeState();
+    void format(Node* wholememory, long long memorySize, bool zeroed);
+    void attach();
+    void recover();
+
+    Node* nodeAt(unsigned int offset);
+    unsigned int offsetOf(Node* node);
+    Node* nodeOf(void* p);
+    long long usableBytes(void* p);
+
+    void* allocate(int request_memory, long long* dirtyBytes, BuddyLifetime lifetime = BUDDY_LIFETIME_UNKNOWN, void* near = NULL, bool mayMap = true);
+    Node* allocateNode(int binK, bool fromTop = false);
+    Node* allocateNear(void* hint, int binK);
+    Node* findNear(Node* origin, int binK, int* regionK);
+    Node* releaseNode(Node* node);
+    Node* splitNode(Node* node, bool keepUpper = false);
     Node* coalesceFree(Node* node);
-    Node* cascadeSplit(int startingBinSize, int desiredBinSize);
+    Node* cascadeSplit(int startingBinSize, int desiredBinSize, bool keepUpper = false);
+    unsigned char pieceDirtyOrder(Node* block, long long offset, int pieceOrder);
+
+    void recordOrder(int binK);
+    int reserveTarget(int binK);
+    int reserveOrder(int binK, int foundBinK);
+    bool reserveBelow(int binK, int target);
+    Node* fillReserve(Node* node, int binK);
+    int releaseReserves();
+
+    int occupancyOrder();
+    void countAllocated(Node* node, int change);
+    void rebuildCounts();
+    void publishSnapshot();
+
+    AsyncRequest* serveWaiters(int order);
+    void completeWaiters(AsyncRequest* served);
+
+    void sampleAllocation(void* p, long long size, Node* node);
+    void sampleFree(void* p);
 
     uintptr_t findBuddyBlock(Node* node);
 
     void insertToFree(Node* node);
     void ejectFromFree(Node* node);
 
-    int determineBinK(int request_size);
+    int determineBinK(long long request_size);
     int determineBinK(Node* node);
 
     bool binHasNode(int binK);
     int findFirstBin(int binK);
-    Node* getFromBin(int binK);
+    int findHighestBin(int binK);
+    Node* getFromBin(int binK, bool highest = false);
 
     void debugNodeStructure();
     template<typename... Args>
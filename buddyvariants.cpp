@@ -0,0 +1,375 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Buddy System Variants
+//
+//   Description:  Buddy systems whose block sizes aren't restricted to powers of
+//                 two - the Fibonacci buddy system and the weighted buddy system
+//                 (sizes of 2^k and 3*2^k) - behind the same interface as
+//                 BuddySystem.
+//
+// Notes:
+// * Every engine is described by a table: the size of each size class, and the
+//   two classes each one splits in to (left, the larger, at the lower address
+//   and right above it). Everything else is shared between the engines.
+// * Sizes are in units of the smallest block (2^BUDDY_MIN_ORDER bytes), which
+//   is also the unit the free list links are stored in.
+// * A block records which side of which size of block it was split from, so the
+//   buddy is found from that rather than by XOR-ing the address with the size.
+//   See VariantNode::origin and savedOrigin.
+// * The heap doesn't need to be a size in the table; it is carved in to as few
+//   'root' blocks as possible, which are never merged with each other.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <climits>
+#include <stdexcept>
+
+#include "buddyvariants.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+VariantBuddySystem::VariantBuddySystem() {}
+
+/**
+ * init prepares the size classes of the chosen engine and carves 'memory' (of
+ * 'memorySize' bytes) in to free root blocks, largest first.
+ */
+void VariantBuddySystem::init(void* memory, long long memorySize, BuddyEngine engine) {
+    this->engine = engine;
+    this->baseMemoryAddress = (uintptr_t)memory;
+    this->memorySize = memorySize;
+    this->stats = BuddyStats();
+
+    long long units = memorySize >> BUDDY_MIN_ORDER;
+    this->buildSizeClasses(units);
+    for(int c = 0; c < MAX_SIZE_CLASSES; c++) {
+        this->freeList[c] = BUDDY_NULL_OFFSET;
+    }
+
+    // Lay the root blocks out one after another, each the largest class that fits in what's left
+    long long offset = 0;
+    int roots = 0;
+    while(offset < units) {
+        int c = this->classCount - 1;
+        while(this->classSize[c] > units - offset) {
+            c--;
+        }
+
+        VariantNode* root = (VariantNode*)(this->baseMemoryAddress + ((uintptr_t)offset << BUDDY_MIN_ORDER));
+        root->sizeClass = c;
+        root->alloc = 0;
+        root->origin = VARIANT_ORIGIN_ROOT;
+        root->savedOrigin = VARIANT_ORIGIN_ROOT;
+        this->insertToFree(root);
+
+        offset += this->classSize[c];
+        roots++;
+    }
+
+    printf("[VariantBuddySystem::init]:: Initialised %s buddy system with %d size classes and %d root block(s)\n", this->getEngineName(), this->classCount, roots);
+}
+
+/**
+ * Finds the smallest size class that fits the request (plus its header), then the smallest
+ * non-empty bin at or above that class. The block found is split until neither half would
+ * still fit, keeping whichever half is the closer fit.
+ *
+ * Returns NULL if no free block is large enough, or the request is negative or too large to
+ * add the header to.
+ */
+void* VariantBuddySystem::malloc(int request_memory) {
+    if(request_memory < 0 || request_memory > INT_MAX - NODE_HEADER_SIZE) {
+        this->stats.failedCount++;
+        return NULL;
+    }
+
+    long long units = ((long long)request_memory + NODE_HEADER_SIZE + (1 << BUDDY_MIN_ORDER) - 1) >> BUDDY_MIN_ORDER;
+    int wanted = this->findSizeClass(units);
+    if(wanted < 0) {
+        this->stats.failedCount++;
+        return NULL;
+    }
+
+    int found = wanted;
+    while(found < this->classCount && this->freeList[found] == BUDDY_NULL_OFFSET) {
+        found++;
+    }
+
+    if(found == this->classCount) {
+        this->stats.failedCount++;
+        return NULL;
+    }
+
+    VariantNode* node = this->getFromBin(found);
+    this->ejectFromFree(node);
+
+    // The right half is the smaller one, so prefer it whenever it is still big enough
+    while(this->splitLeft[node->sizeClass] >= wanted) {
+        node = this->splitNode(node, this->splitRight[node->sizeClass] >= wanted);
+    }
+
+    node->alloc = 1;
+    this->stats.mallocCount++;
+    this->stats.bytesAllocated += this->classSize[node->sizeClass] << BUDDY_MIN_ORDER;
+
+    return (void*)((uintptr_t)node + NODE_HEADER_SIZE);
+}
+
+/**
+ * Returns the block to the free list, merging it with its buddy for as long as the buddy
+ * is free and whole.
+ */
+int VariantBuddySystem::free(void* p) {
+    VariantNode* node = (VariantNode*)((uintptr_t)p - NODE_HEADER_SIZE);
+
+    this->stats.freeCount++;
+    this->stats.bytesAllocated -= this->classSize[node->sizeClass] << BUDDY_MIN_ORDER;
+
+    node->alloc = 0;
+    node->next = BUDDY_NULL_OFFSET;
+    node->previous = BUDDY_NULL_OFFSET;
+
+    VariantNode* merged;
+    while((merged = this->coalesceFree(node)) != NULL) {
+        node = merged;
+    }
+
+    this->insertToFree(node);
+    return 1;
+}
+
+bool VariantBuddySystem::owns(void* p) {
+    uintptr_t address = (uintptr_t)p;
+    return address >= this->baseMemoryAddress && address < this->baseMemoryAddress + (uintptr_t)this->memorySize;
+}
+
+BuddyStats VariantBuddySystem::getStats() {
+    return this->stats;
+}
+
+const char* VariantBuddySystem::getEngineName() {
+    switch(this->engine) {
+        case BUDDY_ENGINE_FIBONACCI: return "Fibonacci";
+        case BUDDY_ENGINE_WEIGHTED: return "weighted";
+        default: return "binary";
+    }
+}
+
+/**
+ * Fills in the size class table for the engine, with every class no bigger than 'units'.
+ */
+void VariantBuddySystem::buildSizeClasses(long long units) {
+    this->classCount = 0;
+
+    long long a = 1;
+    long long b = 2;
+    while(a <= units && this->classCount < MAX_SIZE_CLASSES) {
+        this->classSize[this->classCount++] = a;
+
+        switch(this->engine) {
+            case BUDDY_ENGINE_FIBONACCI: {
+                // 1, 2, 3, 5, 8, ...
+                long long next = a + b;
+                a = b;
+                b = next;
+                break;
+            }
+            case BUDDY_ENGINE_WEIGHTED:
+                // 1, 2, 3, 4, 6, 8, ... - after a power of two 2^k (k >= 1) comes
+                // 3*2^(k-1), and after that the next power of two
+                a = (a & (a - 1)) == 0 && a >= 2 ? a / 2 * 3 : (a & (a - 1)) == 0 ? a * 2 : a / 3 * 4;
+                break;
+            default:
+                a = a * 2;
+                break;
+        }
+    }
+
+    for(int c = 0; c < this->classCount; c++) {
+        long long size = this->classSize[c];
+        long long left = -1;
+
+        switch(this->engine) {
+            case BUDDY_ENGINE_FIBONACCI:
+                // F(n) = F(n-1) + F(n-2), except 2 which splits in to 1 + 1
+                left = c >= 2 ? this->classSize[c - 1] : size / 2;
+                break;
+            case BUDDY_ENGINE_WEIGHTED:
+                if(size >= 4 && (size & (size - 1)) == 0) {
+                    left = size / 4 * 3;
+                } else if(size % 3 == 0) {
+                    left = size / 3 * 2;
+                } else {
+                    left = size / 2;
+                }
+                break;
+            default:
+                left = size / 2;
+                break;
+        }
+
+        if(size < 2) {
+            this->splitLeft[c] = -1;
+            this->splitRight[c] = -1;
+        } else {
+            this->splitLeft[c] = this->findSizeClass(left);
+            this->splitRight[c] = this->findSizeClass(size - left);
+        }
+    }
+}
+
+/**
+ * Returns the smallest size class of at least 'units', or -1 if there is none
+ */
+int VariantBuddySystem::findSizeClass(long long units) {
+    for(int c = 0; c < this->classCount; c++) {
+        if(this->classSize[c] >= units) {
+            return c;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Splits a block (which must not be in the free list) in to its two halves. One half is
+ * inserted in to the free list and the other - the right half if 'keepRight' - is returned.
+ */
+VariantNode* VariantBuddySystem::splitNode(VariantNode* node, bool keepRight) {
+    int parentClass = node->sizeClass;
+
+    VariantNode* left = node;
+    VariantNode* right = (VariantNode*)((uintptr_t)node + ((uintptr_t)this->classSize[this->splitLeft[parentClass]] << BUDDY_MIN_ORDER));
+
+    // Split the parent's origin between the halves, so a merge can put it back together
+    right->sizeClass = this->splitRight[parentClass];
+    right->alloc = 0;
+    right->origin = VARIANT_ORIGIN_RIGHT | parentClass;
+    right->savedOrigin = node->savedOrigin;
+
+    left->savedOrigin = node->origin;
+    left->sizeClass = this->splitLeft[parentClass];
+    left->alloc = 0;
+    left->origin = parentClass;
+
+    this->stats.splitCount++;
+    if(keepRight) {
+        this->insertToFree(left);
+        return right;
+    }
+
+    this->insertToFree(right);
+    return left;
+}
+
+/**
+ * Given a free block (not in the free list), merges it with its buddy if the buddy is
+ * free and hasn't been split. The merged block is returned (also not in the free list),
+ * or NULL if no merge was possible.
+ */
+VariantNode* VariantBuddySystem::coalesceFree(VariantNode* node) {
+    VariantNode* buddy = this->findBuddyBlock(node);
+    if(buddy == NULL || buddy->alloc == 1) {
+        return NULL;
+    }
+
+    int parentClass = node->origin & ~VARIANT_ORIGIN_RIGHT;
+    bool isRight = (node->origin & VARIANT_ORIGIN_RIGHT) != 0;
+
+    // If the buddy has been split, the header at its address belongs to a smaller block
+    int buddyClass = isRight ? this->splitLeft[parentClass] : this->splitRight[parentClass];
+    if(buddy->sizeClass != buddyClass) {
+        return NULL;
+    }
+
+    this->ejectFromFree(buddy);
+
+    VariantNode* left = isRight ? buddy : node;
+    VariantNode* right = isRight ? node : buddy;
+
+    left->sizeClass = parentClass;
+    left->origin = left->savedOrigin;
+    left->savedOrigin = right->savedOrigin;
+    left->alloc = 0;
+    left->next = BUDDY_NULL_OFFSET;
+    left->previous = BUDDY_NULL_OFFSET;
+
+    this->stats.coalesceCount++;
+    return left;
+}
+
+/**
+ * Returns the block the given block was split from, using its origin: a left half's buddy
+ * starts straight after it, and a right half's buddy is the left half of the same parent,
+ * which starts at the parent's address. Root blocks have no buddy (NULL).
+ */
+VariantNode* VariantBuddySystem::findBuddyBlock(VariantNode* node) {
+    if(node->origin == VARIANT_ORIGIN_ROOT) {
+        return NULL;
+    }
+
+    int parentClass = node->origin & ~VARIANT_ORIGIN_RIGHT;
+    if(node->origin & VARIANT_ORIGIN_RIGHT) {
+        return (VariantNode*)((uintptr_t)node - ((uintptr_t)this->classSize[this->splitLeft[parentClass]] << BUDDY_MIN_ORDER));
+    }
+
+    return (VariantNode*)((uintptr_t)node + ((uintptr_t)this->classSize[node->sizeClass] << BUDDY_MIN_ORDER));
+}
+
+void VariantBuddySystem::insertToFree(VariantNode* node) {
+    unsigned int start = this->freeList[node->sizeClass];
+
+    node->next = start;
+    node->previous = BUDDY_NULL_OFFSET;
+    if(start != BUDDY_NULL_OFFSET) {
+        this->nodeAt(start)->previous = this->offsetOf(node);
+    }
+
+    this->freeList[node->sizeClass] = this->offsetOf(node);
+}
+
+void VariantBuddySystem::ejectFromFree(VariantNode* node) {
+    VariantNode* left = this->nodeAt(node->previous);
+    VariantNode* right = this->nodeAt(node->next);
+
+    if(right != NULL) {
+        right->previous = node->previous;
+    }
+
+    if(left != NULL) {
+        left->next = node->next;
+    } else if(this->freeList[node->sizeClass] == this->offsetOf(node)) {
+        this->freeList[node->sizeClass] = node->next;
+    }
+
+    node->next = BUDDY_NULL_OFFSET;
+    node->previous = BUDDY_NULL_OFFSET;
+}
+
+/**
+ * As with BuddySystem::getFromBin, returns the lowest addressed block in the bin
+ */
+VariantNode* VariantBuddySystem::getFromBin(int sizeClass) {
+    unsigned int min = this->freeList[sizeClass];
+    for(unsigned int current = min; current != BUDDY_NULL_OFFSET; current = this->nodeAt(current)->next) {
+        if(current < min) {
+            min = current;
+        }
+    }
+
+    return this->nodeAt(min);
+}
+
+VariantNode* VariantBuddySystem::nodeAt(unsigned int offset) {
+    if(offset == BUDDY_NULL_OFFSET) {
+        return NULL;
+    }
+
+    return (VariantNode*)(this->baseMemoryAddress + ((uintptr_t)offset << BUDDY_MIN_ORDER));
+}
+
+unsigned int VariantBuddySystem::offsetOf(VariantNode* node) {
+    return (unsigned int)(((uintptr_t)node - this->baseMemoryAddress) >> BUDDY_MIN_ORDER);
+}
@@ -0,0 +1,114 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Buddy System Variants
+//
+//   Description:  Buddy systems whose block sizes aren't restricted to powers of
+//                 two - the Fibonacci buddy system and the weighted buddy system
+//                 (sizes of 2^k and 3*2^k) - behind the same interface as
+//                 BuddySystem.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __BUDDYVARIANTS_H__
+#define __BUDDYVARIANTS_H__
+
+#include "buddysys.h"
+
+// Which sequence of block sizes the VariantBuddySystem uses
+enum BuddyEngine {
+    // 1, 2, 4, 8, ... - the same blocks as BuddySystem, for comparison
+    BUDDY_ENGINE_BINARY,
+
+    // 1, 2, 3, 5, 8, 13, ... - each block splits in to the two sizes before it
+    BUDDY_ENGINE_FIBONACCI,
+
+    // 1, 2, 3, 4, 6, 8, 12, 16, ... - a 2^k block splits in to 3*2^(k-2) and
+    // 2^(k-2), and a 3*2^k block splits in to 2^(k+1) and 2^k
+    BUDDY_ENGINE_WEIGHTED
+};
+
+// Upper bound on the number of block sizes an engine can have
+#define MAX_SIZE_CLASSES 64
+
+// VariantNode::origin of a block that was never split off another block
+#define VARIANT_ORIGIN_ROOT 0xFF
+
+// Set in VariantNode::origin for the right (higher addressed) half of a split;
+// the remaining bits hold the size class of the block that was split.
+#define VARIANT_ORIGIN_RIGHT 0x80
+
+// Header at the start of every block. As with Node, only the first
+// NODE_HEADER_SIZE bytes are kept while the block is allocated.
+typedef struct VariantNode {
+    // Index in to the engine's table of block sizes
+    unsigned char sizeClass;
+
+    // 0 is free, 1 means allocated
+    unsigned char alloc;
+
+    // Which half of which size of block this block was split from (or
+    // VARIANT_ORIGIN_ROOT). Unlike binary blocks, where the XOR of the
+    // address and size finds the buddy, the buddy's address depends on
+    // which side of the split the block is, so it has to be recorded.
+    unsigned char origin;
+
+    // Holds one half of the parent's own origin while the parent is split:
+    // the left half holds the parent's origin, and the right half holds the
+    // parent's savedOrigin. Merging the two halves puts both back.
+    unsigned char savedOrigin;
+
+    unsigned char reserved[4];
+
+    // ---- Only valid while the block is free; part of the data otherwise ----
+
+    // Offsets of the next/previous free block, in units of the smallest block
+    unsigned int next;
+    unsigned int previous;
+} VariantNode;
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class VariantBuddySystem {
+    BuddyEngine engine;
+
+    // Block size (in units of the smallest block) of each size class, in
+    // increasing order, and the classes of the two halves each splits in to
+    // (-1 if the class can't be split).
+    long long classSize[MAX_SIZE_CLASSES];
+    int splitLeft[MAX_SIZE_CLASSES];
+    int splitRight[MAX_SIZE_CLASSES];
+    int classCount;
+
+    unsigned int freeList[MAX_SIZE_CLASSES];
+    uintptr_t baseMemoryAddress;
+    long long memorySize;
+    BuddyStats stats;
+public:
+    VariantBuddySystem();
+    void init(void* memory, long long memorySize, BuddyEngine engine);
+
+    void* malloc(int request_memory);
+    int free(void* p);
+
+    bool owns(void* p);
+    BuddyStats getStats();
+    const char* getEngineName();
+protected:
+    void buildSizeClasses(long long units);
+    int findSizeClass(long long units);
+
+    VariantNode* splitNode(VariantNode* node, bool keepRight);
+    VariantNode* coalesceFree(VariantNode* node);
+    VariantNode* findBuddyBlock(VariantNode* node);
+
+    void insertToFree(VariantNode* node);
+    void ejectFromFree(VariantNode* node);
+    VariantNode* getFromBin(int sizeClass);
+
+    VariantNode* nodeAt(unsigned int offset);
+    unsigned int offsetOf(VariantNode* node);
+};
+
+
+#endif
@@ -0,0 +1,263 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Direct Mapper
+//
+//   Description:  Serves very large requests with their own page mappings,
+//                 rather than splitting the buddy heap's biggest blocks for
+//                 them, and keeps recently freed mappings around for reuse.
+//
+// Notes:
+// * Memory handed out here starts at the start of its mapping, so it is page
+//   aligned and has no header; the size is kept in the table of live mappings
+//   instead. That table is an open addressed hash table keyed on the address,
+//   so telling a mapping apart from anything else (and finding its size) is O(1).
+// * Sizes are rounded up to a bucket size (see findBucket). This wastes at most
+//   a quarter of the mapping - far less than the half a buddy block can - and
+//   means a freed mapping can be handed straight to the next request in the
+//   same bucket, skipping the system call and the page faults of a new mapping.
+// * Not thread safe on its own; BuddySystem calls in to it under its own lock.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include "directmap.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Starts with an empty table and cache
+ */
+DirectMapper::DirectMapper() {
+    for(int i = 0; i < DIRECT_MAP_TABLE_SIZE; i++) {
+        this->table[i].address = 0;
+        this->table[i].size = 0;
+    }
+
+    for(int b = 0; b < DIRECT_MAP_BUCKETS; b++) {
+        this->cacheCount[b] = 0;
+    }
+
+    this->liveCount = 0;
+    this->cacheLimit = DIRECT_MAP_DEFAULT_CACHE_BYTES;
+    this->stats = DirectMapStats();
+}
+
+/**
+ * Returns a mapping of at least 'request_memory' bytes, reusing a cached mapping of
+ * the same bucket if there is one. If 'zeroed' is given it is set to whether the memory
+ * is known to be zero, which is only the case for a new mapping.
+ *
+ * Returns NULL if the mapping couldn't be made, or the table of live mappings is full;
+ * the caller is expected to fall back to its own heap.
+ */
+void* DirectMapper::malloc(long long request_memory, bool* zeroed) {
+    long long size;
+    int bucket = this->findBucket(request_memory, &size);
+    if(bucket < 0 || this->liveCount >= DIRECT_MAP_MAX_LIVE) {
+        return NULL;
+    }
+
+    uintptr_t address;
+    bool fresh = this->cacheCount[bucket] == 0;
+    if(!fresh) {
+        address = this->cache[bucket][--this->cacheCount[bucket]];
+        this->stats.bytesCached -= size;
+        this->stats.cacheHits++;
+    } else {
+        address = (uintptr_t)platformAllocPages(size);
+        if(address == 0) {
+            return NULL;
+        }
+
+        this->stats.mapCount++;
+    }
+
+    if(zeroed != NULL) {
+        *zeroed = fresh;
+    }
+
+    this->insertEntry(address, size);
+    this->stats.mallocCount++;
+    this->stats.bytesMapped += size;
+
+    return (void*)address;
+}
+
+/**
+ * Returns a mapping handed out by malloc. It is kept in the cache if there's room
+ * (see setCacheLimit), and unmapped otherwise.
+ *
+ * Returns 0 if 'p' isn't the start of a live mapping.
+ */
+int DirectMapper::free(void* p) {
+    int slot = this->findSlot((uintptr_t)p);
+    if(slot < 0) {
+        return 0;
+    }
+
+    long long size = this->table[slot].size;
+    this->removeEntry(slot);
+    this->stats.freeCount++;
+    this->stats.bytesMapped -= size;
+
+    long long bucketSize;
+    int bucket = this->findBucket(size, &bucketSize);
+    if(this->cacheCount[bucket] < DIRECT_MAP_CACHE_DEPTH && this->stats.bytesCached + size <= this->cacheLimit) {
+        this->cache[bucket][this->cacheCount[bucket]++] = (uintptr_t)p;
+        this->stats.bytesCached += size;
+    } else {
+        platformFreeRegion(p, size);
+        this->stats.unmapCount++;
+    }
+
+    return 1;
+}
+
+/**
+ * Returns true if 'p' is the start of a mapping currently handed out by malloc
+ */
+bool DirectMapper::owns(void* p) {
+    return this->findSlot((uintptr_t)p) >= 0;
+}
+
+/**
+ * Returns the size of the mapping starting at 'p', or 0 if there is no such mapping
+ */
+long long DirectMapper::sizeOf(void* p) {
+    int slot = this->findSlot((uintptr_t)p);
+    return slot < 0 ? 0 : this->table[slot].size;
+}
+
+/**
+ * Sets the most bytes of freed mappings to keep for reuse; 0 disables the cache. Lowering
+ * the limit empties the cache.
+ */
+void DirectMapper::setCacheLimit(long long bytes) {
+    if(bytes < this->cacheLimit) {
+        this->trimCache();
+    }
+
+    this->cacheLimit = bytes;
+}
+
+/**
+ * Unmaps every mapping in the cache
+ */
+void DirectMapper::trimCache() {
+    for(int b = 0; b < DIRECT_MAP_BUCKETS; b++) {
+        while(this->cacheCount[b] > 0) {
+            // The bucket's size is recovered from its index: 2^e pages, plus m quarters of that
+            int e = b / 4;
+            int m = b % 4;
+            long long size = ((long long)PAGESIZE << e) + (((long long)PAGESIZE << e) * m / 4);
+
+            platformFreeRegion((void*)this->cache[b][--this->cacheCount[b]], size);
+            this->stats.bytesCached -= size;
+            this->stats.unmapCount++;
+        }
+    }
+}
+
+DirectMapStats DirectMapper::getStats() {
+    return this->stats;
+}
+
+/**
+ * Rounds 'size' up to a whole number of pages, and then up to the nearest bucket size:
+ * 2^e pages, or 1.25, 1.5 or 1.75 times that. The rounded size is written to
+ * 'bucketSize' and the bucket's index (4e + quarter) is returned, or -1 if 'size' is
+ * too large for any bucket.
+ */
+int DirectMapper::findBucket(long long size, long long* bucketSize) {
+    long long pages = (size + PAGESIZE - 1) / PAGESIZE;
+    if(pages < 1) {
+        pages = 1;
+    }
+
+    int e = 0;
+    while((pages >> (e + 1)) != 0) {
+        e++;
+    }
+
+    // Below 4 pages a quarter is less than a page, so every page count is its own bucket
+    long long step = e >= 2 ? 1LL << (e - 2) : 1;
+    long long rounded = ((pages + step - 1) / step) * step;
+    if(rounded == 2LL << e) {
+        e++;
+    }
+
+    int bucket = e * 4 + (int)(((rounded - (1LL << e)) << 2) >> e);
+    if(bucket >= DIRECT_MAP_BUCKETS) {
+        return -1;
+    }
+
+    *bucketSize = rounded * PAGESIZE;
+    return bucket;
+}
+
+/**
+ * Returns the slot an address would occupy in the table if nothing else was there. This
+ * is a Fibonacci hash of the page number, taking the (best mixed) upper bits.
+ */
+int DirectMapper::homeSlot(uintptr_t address) {
+    unsigned long long key = (unsigned long long)(address / PAGESIZE) * 0x9E3779B97F4A7C15ULL;
+    return (int)(key >> 32) & (DIRECT_MAP_TABLE_SIZE - 1);
+}
+
+/**
+ * Returns the slot in the table holding 'address', or -1 if it isn't in the table.
+ */
+int DirectMapper::findSlot(uintptr_t address) {
+    if(address == 0 || (address & (PAGESIZE - 1)) != 0) {
+        return -1;
+    }
+
+    int slot = this->homeSlot(address);
+    while(this->table[slot].address != 0) {
+        if(this->table[slot].address == address) {
+            return slot;
+        }
+
+        slot = (slot + 1) & (DIRECT_MAP_TABLE_SIZE - 1);
+    }
+
+    return -1;
+}
+
+/**
+ * Adds a live mapping to the table, at the first empty slot from its home slot onwards
+ */
+void DirectMapper::insertEntry(uintptr_t address, long long size) {
+    int slot = this->homeSlot(address);
+    while(this->table[slot].address != 0) {
+        slot = (slot + 1) & (DIRECT_MAP_TABLE_SIZE - 1);
+    }
+
+    this->table[slot].address = address;
+    this->table[slot].size = size;
+    this->liveCount++;
+}
+
+/**
+ * Empties a slot of the table. Rather than leaving a marker behind, any entries after it
+ * that would no longer be found (as the probe from their home slot would stop at the gap)
+ * are shifted back in to the gap.
+ */
+void DirectMapper::removeEntry(int slot) {
+    int mask = DIRECT_MAP_TABLE_SIZE - 1;
+    int gap = slot;
+    for(int next = (gap + 1) & mask; this->table[next].address != 0; next = (next + 1) & mask) {
+        int home = this->homeSlot(this->table[next].address);
+
+        // Move the entry if the gap lies between its home slot and where it is now
+        if(((next - home) & mask) >= ((next - gap) & mask)) {
+            this->table[gap] = this->table[next];
+            gap = next;
+        }
+    }
+
+    this->table[gap].address = 0;
+    this->table[gap].size = 0;
+    this->liveCount--;
+}
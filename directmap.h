@@ -0,0 +1,91 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Direct Mapper
+//
+//   Description:  Serves very large requests with their own page mappings,
+//                 rather than splitting the buddy heap's biggest blocks for
+//                 them, and keeps recently freed mappings around for reuse.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __DIRECTMAP_H__
+#define __DIRECTMAP_H__
+
+#include "auxiliary.h"
+#include "platform.h"
+
+// Number of slots in the table of live mappings (a power of two). The table
+// is open addressed, so it is kept well under full; see DIRECT_MAP_MAX_LIVE.
+#define DIRECT_MAP_TABLE_SIZE 1024
+#define DIRECT_MAP_MAX_LIVE (DIRECT_MAP_TABLE_SIZE / 2)
+
+// Mapping sizes are rounded up to one of four sizes per power of two pages
+// (1, 1.25, 1.5 and 1.75 times 2^n), so that a cached mapping can be reused by
+// any request that rounds to the same size. 4 buckets for each of 2^0..2^31 pages.
+#define DIRECT_MAP_BUCKETS 128
+
+// Freed mappings kept in each bucket of the cache
+#define DIRECT_MAP_CACHE_DEPTH 4
+
+// Default limit on the bytes held in the cache, across every bucket
+#define DIRECT_MAP_DEFAULT_CACHE_BYTES (64LL * 1024 * 1024)
+
+typedef struct DirectMapStats {
+    // Requests served, and mappings returned
+    long long mallocCount;
+    long long freeCount;
+
+    // Requests served from the cache, rather than by creating a mapping
+    long long cacheHits;
+
+    // Mappings created and destroyed with the operating system
+    long long mapCount;
+    long long unmapCount;
+
+    // Bytes of mappings currently handed out, and currently in the cache
+    long long bytesMapped;
+    long long bytesCached;
+} DirectMapStats;
+
+// A slot in the table of live mappings; 'address' is 0 for an empty slot
+typedef struct DirectMapEntry {
+    uintptr_t address;
+    long long size;
+} DirectMapEntry;
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class DirectMapper {
+    DirectMapEntry table[DIRECT_MAP_TABLE_SIZE];
+    int liveCount;
+
+    // Freed mappings by bucket; cacheCount[b] of them are valid
+    uintptr_t cache[DIRECT_MAP_BUCKETS][DIRECT_MAP_CACHE_DEPTH];
+    int cacheCount[DIRECT_MAP_BUCKETS];
+    long long cacheLimit;
+
+    DirectMapStats stats;
+public:
+    DirectMapper();
+
+    void* malloc(long long request_memory, bool* zeroed = NULL);
+    int free(void* p);
+
+    bool owns(void* p);
+    long long sizeOf(void* p);
+
+    void setCacheLimit(long long bytes);
+    void trimCache();
+    DirectMapStats getStats();
+protected:
+    int findBucket(long long size, long long* bucketSize);
+
+    int homeSlot(uintptr_t address);
+    int findSlot(uintptr_t address);
+    void insertEntry(uintptr_t address, long long size);
+    void removeEntry(int slot);
+};
+
+
+#endif
@@ -0,0 +1,285 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Handle Heap
+//
+//   Description:  Allocations referred to by handle rather than by pointer, so
+//                 that the blocks behind them can be moved. An incremental
+//                 compactor moves unpinned blocks out of the way of their free
+//                 buddies, and packs them towards the low end of the heap, so
+//                 free space coalesces back in to large blocks.
+//
+// Notes:
+// * A handle is an index (plus one) in to a table holding the current address
+//   of its block. The block's Node records the handle in turn (with the
+//   NODE_HANDLE flag), so the compactor can go from a block to its handle.
+// * pin() returns the block's address, which stays valid until the matching
+//   unpin(). Blocks from a plain BuddySystem::malloc are never moved.
+// * compact() does a bounded amount of work per call: it walks the heap by
+//   block boundaries from where the last call stopped. An unpinned handle block
+//   whose buddy is free is moved in to another free block of its order (the
+//   lowest), so the space it leaves merges with the buddy. Every move builds
+//   a larger free block, so the compactor can't undo its own work, and run
+//   between requests it steadily rebuilds the high order blocks.
+// * Everything here is done under the heap's lock, so it is as thread safe as
+//   the heap it is given.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <stdexcept>
+#include <string.h>
+
+#include "handles.h"
+#include "heapprofiler.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * As with BuddySystem, no work can be done until init is called
+ */
+HandleHeap::HandleHeap() {
+    this->heap = NULL;
+}
+
+/**
+ * init attaches the handle heap to the BuddySystem its blocks come from, and empties the
+ * handle table. Plain mallocs can carry on using the same heap alongside the handles.
+ */
+void HandleHeap::init(BuddySystem* heap) {
+    this->heap = heap;
+    for(int i = 0; i < HANDLE_TABLE_SIZE; i++) {
+        this->table[i].address = NULL;
+        this->table[i].size = -1;
+        this->table[i].pinCount = 0;
+        this->table[i].nextFree = i + 1;
+    }
+
+    this->firstFree = 0;
+    this->cursor = 0;
+    this->stats = CompactStats();
+}
+
+/**
+ * Allocates 'request_memory' bytes and returns a handle to them, or 0 if either the heap or
+ * the handle table is full. The memory is unpinned, so it may be moved until pinned.
+ */
+BuddyHandle HandleHeap::allocHandle(int request_memory) {
+    void* p = this->heap->malloc(request_memory);
+    if(p == NULL) {
+        return 0;
+    }
+
+    {
+        BuddySystem::ScopedLock guard(this->heap);
+        if(this->firstFree < HANDLE_TABLE_SIZE) {
+            unsigned int index = this->firstFree;
+            HandleEntry* entry = &this->table[index];
+            this->firstFree = entry->nextFree;
+            entry->address = p;
+            entry->size = request_memory;
+            entry->pinCount = 0;
+
+            // A block served by a direct mapping isn't in the heap, and never needs to move
+            if(this->heap->owns(p)) {
+                Node* node = this->heap->nodeOf(p);
+                node->flags |= NODE_HANDLE;
+                node->handle = index + 1;
+            }
+
+            return index + 1;
+        }
+    }
+
+    // The table is full. free takes the lock itself, so this waits until we've let go of it
+    this->heap->free(p);
+    return 0;
+}
+
+/**
+ * Frees the memory behind 'handle', which must not be pinned. Returns 0 if the handle
+ * isn't live (or is pinned).
+ */
+int HandleHeap::freeHandle(BuddyHandle handle) {
+    void* p;
+    {
+        BuddySystem::ScopedLock guard(this->heap);
+        if(handle == 0 || handle > HANDLE_TABLE_SIZE || this->table[handle - 1].size < 0 || this->table[handle - 1].pinCount > 0) {
+            return 0;
+        }
+
+        HandleEntry* entry = &this->table[handle - 1];
+        p = entry->address;
+
+        // Once the lock is released the compactor must leave the block alone
+        if(this->heap->owns(p)) {
+            this->heap->nodeOf(p)->flags &= ~NODE_HANDLE;
+        }
+
+        entry->address = NULL;
+        entry->size = -1;
+        entry->nextFree = this->firstFree;
+        this->firstFree = handle - 1;
+    }
+
+    return this->heap->free(p);
+}
+
+/**
+ * Returns the current address of the memory behind 'handle', and stops it being moved
+ * until unpin is called (as many times as pin was). Returns NULL for a handle that isn't live.
+ */
+void* HandleHeap::pin(BuddyHandle handle) {
+    BuddySystem::ScopedLock guard(this->heap);
+    if(handle == 0 || handle > HANDLE_TABLE_SIZE || this->table[handle - 1].size < 0) {
+        return NULL;
+    }
+
+    this->table[handle - 1].pinCount++;
+    return this->table[handle - 1].address;
+}
+
+/**
+ * Allows the memory behind 'handle' to be moved again. Pointers from pin should no longer
+ * be used.
+ */
+void HandleHeap::unpin(BuddyHandle handle) {
+    BuddySystem::ScopedLock guard(this->heap);
+    if(handle == 0 || handle > HANDLE_TABLE_SIZE || this->table[handle - 1].pinCount <= 0) {
+        throw std::logic_error("HandleHeap::unpin has failed - the handle isn't pinned!");
+    }
+
+    this->table[handle - 1].pinCount--;
+}
+
+/**
+ * Runs one slice of the compactor, looking at no more than 'maxBlocks' blocks (and moving
+ * any of those that can be moved). Once the end of the heap is reached the next slice starts
+ * again from the beginning. Returns the number of blocks moved.
+ */
+int HandleHeap::compact(int maxBlocks) {
+    BuddySystem* heap = this->heap;
+    AsyncRequest* served;
+    int moved = 0;
+    int largestOrder = 0;
+    {
+        BuddySystem::ScopedLock guard(heap);
+
+        this->stats.sliceCount++;
+        for(int i = 0; i < maxBlocks; i++) {
+            if(this->cursor >= heap->header->heapSize) {
+                this->cursor = 0;
+                this->stats.sweepCount++;
+            }
+
+            Node* node = (Node*)heap->fromOffset(this->cursor);
+            int order = node->order;
+            if(node->alloc == 0 || (node->flags & NODE_HANDLE) == 0) {
+                this->cursor += 1LL << order;
+                continue;
+            }
+
+            if(this->table[node->handle - 1].pinCount > 0) {
+                this->stats.pinnedSkips++;
+                this->cursor += 1LL << order;
+                continue;
+            }
+
+            if(!this->moveNode(node)) {
+                this->cursor += 1LL << order;
+                continue;
+            }
+
+            moved++;
+
+            // The block we left behind may have merged with the blocks around it, so its end is no
+            // longer where the next block starts. The merged block is the largest aligned block
+            // around the cursor whose header gives that order: any larger aligned block around the
+            // cursor starts at a real block (which, not reaching the cursor, is smaller).
+            for(int k = heap->upperK; k >= order; k--) {
+                long long start = this->cursor & ~((1LL << k) - 1);
+                if(((Node*)heap->fromOffset(start))->order == k) {
+                    this->cursor = start + (1LL << k);
+                    largestOrder = k > largestOrder ? k : largestOrder;
+                    break;
+                }
+            }
+        }
+
+        // The merged blocks may be large enough for requests waiting on the heap
+        served = moved > 0 ? heap->serveWaiters(largestOrder) : NULL;
+    }
+
+    heap->completeWaiters(served);
+    return moved;
+}
+
+CompactStats HandleHeap::getStats() {
+    BuddySystem::ScopedLock guard(this->heap);
+    return this->stats;
+}
+
+/**
+ * Moves an allocated (and unpinned) handle block whose buddy is free in to another free block
+ * of the same order, updating its handle, so that the block it leaves behind merges with its
+ * buddy. Free blocks of the same order can't merge with their own buddies (or they would have
+ * done so already), so filling one of them loses nothing.
+ *
+ * Returns false if the block's buddy isn't free, or there's no other free block of its order.
+ * The heap lock must be held.
+ */
+bool HandleHeap::moveNode(Node* node) {
+    BuddySystem* heap = this->heap;
+    int order = node->order;
+    if(order >= heap->upperK) {
+        return false;
+    }
+
+    Node* buddy = (Node*)heap->findBuddyBlock(node);
+    if(buddy->alloc == 1 || buddy->order != order) {
+        return false;
+    }
+
+    Node* target = this->lowestFreeNode(order, buddy);
+    if(target == NULL) {
+        return false;
+    }
+
+    heap->ejectFromFree(target);
+    target->alloc = 1;
+    target->flags = NODE_HANDLE | (node->flags & NODE_SAMPLED);
+    target->handle = node->handle;
+
+    HandleEntry* entry = &this->table[node->handle - 1];
+    void* data = (void*)((uintptr_t)target + (uintptr_t)NODE_HEADER_SIZE);
+    memcpy(data, entry->address, entry->size);
+    if((node->flags & NODE_SAMPLED) != 0 && heap->profiler != NULL) {
+        heap->profiler->moved(entry->address, data);
+    }
+
+    entry->address = data;
+
+    heap->countAllocated(target, 1);
+    heap->countAllocated(node, -1);
+    heap->releaseNode(node);
+
+    this->stats.blocksMoved++;
+    this->stats.bytesMoved += entry->size;
+    return true;
+}
+
+/**
+ * Returns the free node of order 'binK' with the lowest address, other than 'exclude', or
+ * NULL if there is none. Preferring low addresses keeps the live blocks packed towards the
+ * start of the heap.
+ */
+Node* HandleHeap::lowestFreeNode(int binK, Node* exclude) {
+    Node* lowest = NULL;
+    for(Node* n = this->heap->nodeAt(this->heap->header->freeList[binK]); n != NULL; n = this->heap->nodeAt(n->next)) {
+        if(n != exclude && (lowest == NULL || n < lowest)) {
+            lowest = n;
+        }
+    }
+
+    return lowest;
+}
@@ -0,0 +1,77 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Handle Heap
+//
+//   Description:  Allocations referred to by handle rather than by pointer, so
+//                 that the blocks behind them can be moved. An incremental
+//                 compactor moves unpinned blocks out of the way of their free
+//                 buddies, and packs them towards the low end of the heap, so
+//                 free space coalesces back in to large blocks.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __HANDLES_H__
+#define __HANDLES_H__
+
+#include "buddysys.h"
+
+// Most handles that can be live at once
+#define HANDLE_TABLE_SIZE 16384
+
+// Refers to an allocation made with HandleHeap::allocHandle; 0 is no handle
+typedef unsigned int BuddyHandle;
+
+// An entry of the handle table. For a free slot, 'size' is -1 and
+// 'nextFree' links the free slots together.
+typedef struct HandleEntry {
+    void* address;
+    int size;
+
+    // The block can only be moved while this is 0
+    int pinCount;
+    unsigned int nextFree;
+} HandleEntry;
+
+typedef struct CompactStats {
+    // Calls to compact, and complete sweeps of the heap finished
+    long long sliceCount;
+    long long sweepCount;
+
+    long long blocksMoved;
+    long long bytesMoved;
+
+    // Movable blocks that couldn't be moved as they were pinned
+    long long pinnedSkips;
+} CompactStats;
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class HandleHeap {
+    BuddySystem* heap;
+
+    HandleEntry table[HANDLE_TABLE_SIZE];
+    unsigned int firstFree;
+
+    // Offset of the next block the compactor will look at
+    long long cursor;
+    CompactStats stats;
+public:
+    HandleHeap();
+    void init(BuddySystem* heap);
+
+    BuddyHandle allocHandle(int request_memory);
+    int freeHandle(BuddyHandle handle);
+
+    void* pin(BuddyHandle handle);
+    void unpin(BuddyHandle handle);
+
+    int compact(int maxBlocks);
+    CompactStats getStats();
+protected:
+    bool moveNode(Node* node);
+    Node* lowestFreeNode(int binK, Node* exclude);
+};
+
+
+#endif
@@ -0,0 +1,281 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Heap Profiler
+//
+//   Description:  Finds out which call sites own the memory of a buddy heap by
+//                 sampling its mallocs - about one per sampleRate bytes - and
+//                 keeping the backtrace of each sampled block until it is
+//                 freed. Profiles of the live heap and of everything allocated
+//                 so far are written in the heap profile format pprof reads.
+//
+//   References:
+//
+//     https://github.com/google/tcmalloc/blob/master/docs/sampling.md
+//     https://github.com/google/pprof/blob/main/profile/legacy_profile.go
+//
+// Notes:
+// * Sampling is by bytes, not by mallocs: the gaps between samples are drawn from
+//   an exponential distribution with a mean of sampleRate bytes, so every byte is
+//   equally likely to be sampled and a block of n bytes is sampled with the
+//   chance 1 - e^(-n / sampleRate). Large blocks are nearly always sampled, and
+//   small ones seldom, but none of them can hide between samples.
+// * The bytes counted are those of the whole block (header and slack included),
+//   as those are what a call site keeps from the rest of the heap; a direct
+//   mapping counts what was asked for.
+// * The heap keeps the countdown to the next sample, and only calls in here for
+//   a sample. Recording one (backtrace included) is done under the heap lock;
+//   at the default rate that is about one malloc in several thousand.
+// * The profile is the legacy heap_v2 text format (as written by gperftools),
+//   which has a live and a cumulative count on each line - 'pprof -inuse_space'
+//   shows the live heap, and 'pprof -alloc_space' everything allocated. pprof
+//   scales the samples back up itself, and symbolises the backtraces from the
+//   module list at the end, which needs the binary's symbols (the makefile strips
+//   main, with -s, so take that out to profile it).
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <climits>
+#include <math.h>
+#include <stdexcept>
+
+#include "heapprofiler.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+HeapProfiler::HeapProfiler() {
+    this->heap = NULL;
+    this->sampleRate = PROFILE_DEFAULT_RATE;
+    this->random = 0;
+    this->sampledCount = 0;
+}
+
+HeapProfiler::~HeapProfiler() {
+    this->stop();
+}
+
+/**
+ * Starts sampling the mallocs of 'heap', one for about every 'sampleRate' bytes allocated.
+ * Anything sampled before (by an earlier start) is forgotten. Only one HeapProfiler can be
+ * attached to a heap at a time.
+ */
+void HeapProfiler::start(BuddySystem* heap, long long sampleRate) {
+    if(this->heap != NULL) {
+        throw std::logic_error("HeapProfiler::start has failed - the profiler is already running!");
+    }
+
+    if(sampleRate <= 0) {
+        throw std::logic_error("HeapProfiler::start has failed - the sample rate must be positive!");
+    }
+
+    BuddySystem::ScopedLock guard(heap);
+    if(heap->profiler != NULL) {
+        throw std::logic_error("HeapProfiler::start has failed - the heap already has a profiler!");
+    }
+
+    this->sampleRate = sampleRate;
+    this->random = (unsigned long long)platformNanoseconds() ^ (unsigned long long)(uintptr_t)this;
+    this->random = this->random != 0 ? this->random : 1;
+    this->sites.clear();
+    this->siteIndex.clear();
+    this->live.clear();
+    this->sampledCount = 0;
+
+    this->heap = heap;
+    heap->profiler = this;
+    heap->sampleCountdown = this->nextInterval();
+}
+
+/**
+ * Stops sampling. What has been sampled is kept, and can still be dumped; blocks sampled
+ * and freed from now on stay in the live profile.
+ */
+void HeapProfiler::stop() {
+    if(this->heap == NULL) {
+        return;
+    }
+
+    BuddySystem::ScopedLock guard(this->heap);
+    this->heap->profiler = NULL;
+    this->heap->sampleCountdown = LLONG_MAX;
+    this->heap = NULL;
+}
+
+/**
+ * Writes the profile to the file at 'path' (replacing it). Returns false if it couldn't be
+ * written.
+ */
+bool HeapProfiler::dump(const char* path) {
+    FILE* out = fopen(path, "w");
+    if(out == NULL) {
+        return false;
+    }
+
+    bool written = this->dump(out);
+    return fclose(out) == 0 && written;
+}
+
+/**
+ * Writes the profile to 'out': a line of totals, a line for each call site (with its live
+ * and cumulative samples, then its backtrace) and the modules needed to symbolise them.
+ */
+bool HeapProfiler::dump(FILE* out) {
+    std::vector<ProfileSite> sites;
+    long long sampleRate;
+    {
+        // A copy is written, rather than holding the heap lock while writing the file
+        BuddySystem* heap = this->heap;
+        if(heap != NULL) {
+            heap->acquireLock();
+        }
+
+        sites = this->sites;
+        sampleRate = this->sampleRate;
+        if(heap != NULL) {
+            heap->releaseLock();
+        }
+    }
+
+    ProfileSite total = ProfileSite();
+    for(size_t s = 0; s < sites.size(); s++) {
+        total.liveCount += sites[s].liveCount;
+        total.liveBytes += sites[s].liveBytes;
+        total.allocCount += sites[s].allocCount;
+        total.allocBytes += sites[s].allocBytes;
+    }
+
+    fprintf(out, "heap profile: %6lld: %8lld [%6lld: %8lld] @ heap_v2/%lld\n", total.liveCount, total.liveBytes, total.allocCount, total.allocBytes, sampleRate);
+    for(size_t s = 0; s < sites.size(); s++) {
+        ProfileSite* site = &sites[s];
+        fprintf(out, "%6lld: %8lld [%6lld: %8lld] @", site->liveCount, site->liveBytes, site->allocCount, site->allocBytes);
+        for(size_t f = 0; f < site->frames.size(); f++) {
+            fprintf(out, " %p", site->frames[f]);
+        }
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    bool written = platformWriteModules(out);
+    return !ferror(out) && written;
+}
+
+ProfileStats HeapProfiler::getStats() {
+    ProfileStats stats = ProfileStats();
+    BuddySystem* heap = this->heap;
+    if(heap != NULL) {
+        heap->acquireLock();
+    }
+
+    stats.sampleRate = this->sampleRate;
+    stats.sampledCount = this->sampledCount;
+    stats.liveCount = (long long)this->live.size();
+    stats.siteCount = (long long)this->sites.size();
+
+    double estimate = 0.0;
+    for(size_t s = 0; s < this->sites.size(); s++) {
+        stats.liveSampledBytes += this->sites[s].liveBytes;
+        estimate += this->unsampledBytes(this->sites[s].liveCount, this->sites[s].liveBytes);
+    }
+
+    stats.liveEstimatedBytes = (long long)estimate;
+    if(heap != NULL) {
+        heap->releaseLock();
+    }
+
+    return stats;
+}
+
+/**
+ * Called by the heap (with its lock held) for each sampled malloc, of 'size' bytes with its
+ * data at 'p': records it against the call site that made it. Returns the bytes to allocate
+ * before the next sample.
+ */
+long long HeapProfiler::record(void* p, long long size) {
+    std::vector<void*> frames(PROFILE_MAX_FRAMES);
+    frames.resize(platformBacktrace(frames.data(), PROFILE_MAX_FRAMES, 1));
+
+    int index;
+    std::map<std::vector<void*>, int>::iterator found = this->siteIndex.find(frames);
+    if(found != this->siteIndex.end()) {
+        index = found->second;
+    } else {
+        index = (int)this->sites.size();
+        this->sites.push_back(ProfileSite());
+        this->sites.back().frames = frames;
+        this->siteIndex[frames] = index;
+    }
+
+    ProfileSite* site = &this->sites[index];
+    site->liveCount++;
+    site->liveBytes += size;
+    site->allocCount++;
+    site->allocBytes += size;
+    this->sampledCount++;
+
+    ProfileSample sample;
+    sample.site = index;
+    sample.bytes = size;
+    this->live[p] = sample;
+
+    return this->nextInterval();
+}
+
+/**
+ * Called by the heap (with its lock held) when a sampled block, or a direct mapping, is
+ * freed. Pointers that weren't sampled (or were sampled before the profiler started) are
+ * ignored.
+ */
+void HeapProfiler::release(void* p) {
+    std::unordered_map<void*, ProfileSample>::iterator found = this->live.find(p);
+    if(found == this->live.end()) {
+        return;
+    }
+
+    ProfileSite* site = &this->sites[found->second.site];
+    site->liveCount--;
+    site->liveBytes -= found->second.bytes;
+    this->live.erase(found);
+}
+
+/**
+ * Called by the handle compactor (with the heap lock held) when it moves a sampled block
+ */
+void HeapProfiler::moved(void* from, void* to) {
+    std::unordered_map<void*, ProfileSample>::iterator found = this->live.find(from);
+    if(found == this->live.end()) {
+        return;
+    }
+
+    ProfileSample sample = found->second;
+    this->live.erase(found);
+    this->live[to] = sample;
+}
+
+/**
+ * Draws the bytes to the next sample from an exponential distribution with a mean of
+ * sampleRate, using an xorshift generator of its own so as not to disturb rand.
+ */
+long long HeapProfiler::nextInterval() {
+    this->random ^= this->random >> 12;
+    this->random ^= this->random << 25;
+    this->random ^= this->random >> 27;
+    unsigned long long bits = this->random * 2685821657736338717ULL;
+
+    // A uniform number in (0, 1], from the top 53 bits
+    double uniform = ((bits >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return (long long)(-log(uniform) * this->sampleRate) + 1;
+}
+
+/**
+ * Returns the bytes that 'count' samples of 'bytes' in all stand for, as pprof works it
+ * out: a block of the samples' average size is sampled with the chance 1 - e^(-size/rate).
+ */
+double HeapProfiler::unsampledBytes(long long count, long long bytes) {
+    if(count <= 0) {
+        return 0.0;
+    }
+
+    double average = (double)bytes / count;
+    return bytes / (1.0 - exp(-average / this->sampleRate));
+}
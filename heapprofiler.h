@@ -0,0 +1,101 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Heap Profiler
+//
+//   Description:  Finds out which call sites own the memory of a buddy heap by
+//                 sampling its mallocs - about one per sampleRate bytes - and
+//                 keeping the backtrace of each sampled block until it is
+//                 freed. Profiles of the live heap and of everything allocated
+//                 so far are written in the heap profile format pprof reads.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __HEAPPROFILER_H__
+#define __HEAPPROFILER_H__
+
+// Standard headers go first, as auxiliary.h defines macros (e.g. 'ms') that
+// would otherwise clash with names used inside them.
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "buddysys.h"
+
+// Frames kept of each sampled malloc's backtrace
+#define PROFILE_MAX_FRAMES 32
+
+// Mean bytes allocated between samples unless start is told otherwise: the
+// same as tcmalloc's, at which the cost of sampling can't be measured.
+#define PROFILE_DEFAULT_RATE (512 * 1024)
+
+// A call site (one backtrace), and what has been sampled there
+typedef struct ProfileSite {
+    std::vector<void*> frames;
+
+    // Sampled blocks still allocated, and every one sampled so far
+    long long liveCount;
+    long long liveBytes;
+    long long allocCount;
+    long long allocBytes;
+} ProfileSite;
+
+// A sampled block that hasn't been freed
+typedef struct ProfileSample {
+    int site;
+    long long bytes;
+} ProfileSample;
+
+typedef struct ProfileStats {
+    long long sampleRate;
+
+    // Mallocs sampled, and those of them still allocated
+    long long sampledCount;
+    long long liveCount;
+    long long siteCount;
+
+    // Bytes in the live samples, and the bytes they stand for, which is an
+    // estimate of the whole heap's allocated bytes
+    long long liveSampledBytes;
+    long long liveEstimatedBytes;
+} ProfileStats;
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class HeapProfiler {
+    BuddySystem* heap;
+    long long sampleRate;
+
+    // State of the random number generator drawing the sampling intervals
+    unsigned long long random;
+
+    // Each call site seen, and the sites of the blocks sampled and not yet
+    // freed, by data pointer. All guarded by the heap lock.
+    std::vector<ProfileSite> sites;
+    std::map<std::vector<void*>, int> siteIndex;
+    std::unordered_map<void*, ProfileSample> live;
+    long long sampledCount;
+
+    friend class BuddySystem;
+    friend class HandleHeap;
+public:
+    HeapProfiler();
+    ~HeapProfiler();
+
+    void start(BuddySystem* heap, long long sampleRate = PROFILE_DEFAULT_RATE);
+    void stop();
+
+    bool dump(const char* path);
+    bool dump(FILE* out);
+    ProfileStats getStats();
+protected:
+    long long record(void* p, long long size);
+    void release(void* p);
+    void moved(void* from, void* to);
+
+    long long nextInterval();
+    double unsampledBytes(long long count, long long bytes);
+};
+
+
+#endif
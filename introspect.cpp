@@ -0,0 +1,235 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Buddy Introspector
+//
+//   Description:  Serves the state of a running buddy heap over a local (Unix
+//                 domain) socket, in the Prometheus text format, so the heap
+//                 can be looked at without a debugger or a BUDDY_SYS_DEBUG
+//                 build.
+//
+// Notes:
+// * Everything served comes from the heap's published snapshot (see
+//   BuddySystem::readSnapshot), so the server never takes the heap lock, and a
+//   scrape can't slow the heap down or hang on it.
+// * Each connection gets one answer and is closed. An HTTP request (from
+//   Prometheus, or curl --unix-socket) gets an HTTP response; anything else,
+//   or nothing at all within INTROSPECT_REQUEST_MS (e.g. from 'nc -U'), gets
+//   the bare text.
+// * Rates are per second since the previous scrape; Prometheus itself would
+//   rather work them out from the _total counters, which are served as well.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <stdexcept>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "introspect.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Appends printf style text to 'out'
+ */
+static void appendF(std::string* out, const char* fmt, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    out->append(line);
+}
+
+/**
+ * Appends the HELP and TYPE lines that come before a metric's samples
+ */
+static void appendHeader(std::string* out, const char* name, const char* type, const char* help) {
+    appendF(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+BuddyIntrospector::BuddyIntrospector() {
+    this->heap = NULL;
+    this->path[0] = '\0';
+    this->listener = PLATFORM_NO_SOCKET;
+    this->running = false;
+    this->previous = BuddySnapshot();
+    this->hasPrevious = false;
+}
+
+BuddyIntrospector::~BuddyIntrospector() {
+    this->stop();
+}
+
+/**
+ * Starts serving the state of 'heap' on the local socket at 'path', enabling the heap's
+ * snapshots. Returns false if the socket couldn't be set up (e.g. the path is too long, or
+ * its directory doesn't exist).
+ */
+bool BuddyIntrospector::start(BuddySystem* heap, const char* path) {
+    if(this->running) {
+        throw std::logic_error("BuddyIntrospector::start has failed - the server is already running!");
+    }
+
+    if(strlen(path) >= sizeof(this->path)) {
+        return false;
+    }
+
+    this->listener = platformListenLocal(path);
+    if(this->listener == PLATFORM_NO_SOCKET) {
+        return false;
+    }
+
+    strcpy(this->path, path);
+    this->heap = heap;
+    this->hasPrevious = false;
+    heap->enableSnapshots();
+
+    this->running = true;
+    this->thread = std::thread(&BuddyIntrospector::run, this);
+    return true;
+}
+
+/**
+ * Stops the server, once it has finished with any client it is answering, and removes the
+ * socket.
+ */
+void BuddyIntrospector::stop() {
+    if(!this->running.exchange(false)) {
+        return;
+    }
+
+    this->thread.join();
+    platformCloseSocket(this->listener);
+    platformUnlinkLocal(this->path);
+    this->listener = PLATFORM_NO_SOCKET;
+}
+
+/**
+ * Returns the heap's state in the Prometheus text format (called by the server thread):
+ * - the sizes, counters and rates of the heap as a whole
+ * - free and allocated blocks of each order
+ * - the largest free block, and how fragmented the free memory is
+ * - the occupancy map, as the share of each chunk of the heap that is allocated
+ */
+std::string BuddyIntrospector::render() {
+    std::string out;
+    BuddySnapshot snapshot;
+    if(!this->heap->readSnapshot(&snapshot)) {
+        return out;
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    BuddyStats* stats = &snapshot.stats;
+
+    long long freeBytes = 0;
+    long long largestFree = 0;
+    long long subPageFree = 0;
+    for(int k = snapshot.lowerK; k <= snapshot.upperK; k++) {
+        long long bytes = (long long)snapshot.freeBlocks[k] << k;
+        freeBytes += bytes;
+        if(snapshot.freeBlocks[k] > 0) {
+            largestFree = 1LL << k;
+        }
+
+        if((1LL << k) < PAGESIZE) {
+            subPageFree += bytes;
+        }
+    }
+
+    appendHeader(&out, "buddy_heap_bytes", "gauge", "Size of the heap.");
+    appendF(&out, "buddy_heap_bytes %lld\n", snapshot.heapSize);
+    appendHeader(&out, "buddy_allocated_bytes", "gauge", "Bytes of whole blocks (headers included) allocated.");
+    appendF(&out, "buddy_allocated_bytes %lld\n", stats->bytesAllocated);
+    appendHeader(&out, "buddy_free_bytes", "gauge", "Bytes of blocks in the free list.");
+    appendF(&out, "buddy_free_bytes %lld\n", freeBytes);
+    appendHeader(&out, "buddy_largest_free_block_bytes", "gauge", "Size of the largest free block; the largest malloc that can succeed, header included.");
+    appendF(&out, "buddy_largest_free_block_bytes %lld\n", largestFree);
+
+    appendHeader(&out, "buddy_fragmentation_ratio", "gauge", "external: share of free memory outside the largest free block. sub_page: share of free memory in blocks smaller than a page.");
+    appendF(&out, "buddy_fragmentation_ratio{kind=\"external\"} %.6f\n", freeBytes > 0 ? 1.0 - (double)largestFree / freeBytes : 0.0);
+    appendF(&out, "buddy_fragmentation_ratio{kind=\"sub_page\"} %.6f\n", freeBytes > 0 ? (double)subPageFree / freeBytes : 0.0);
+
+    appendHeader(&out, "buddy_free_blocks", "gauge", "Blocks of each order in the free list.");
+    for(int k = snapshot.lowerK; k <= snapshot.upperK; k++) {
+        appendF(&out, "buddy_free_blocks{order=\"%d\",size=\"%lld\"} %u\n", k, 1LL << k, snapshot.freeBlocks[k]);
+    }
+
+    appendHeader(&out, "buddy_allocated_blocks", "gauge", "Blocks of each order allocated.");
+    for(int k = snapshot.lowerK; k <= snapshot.upperK; k++) {
+        appendF(&out, "buddy_allocated_blocks{order=\"%d\",size=\"%lld\"} %u\n", k, 1LL << k, snapshot.allocatedBlocks[k]);
+    }
+
+    struct { const char* name; const char* help; long long value; long long before; } counters[] = {
+        { "buddy_mallocs", "Mallocs served by the heap.", stats->mallocCount, this->previous.stats.mallocCount },
+        { "buddy_frees", "Blocks freed back to the heap.", stats->freeCount, this->previous.stats.freeCount },
+        { "buddy_failed_mallocs", "Mallocs the heap couldn't serve.", stats->failedCount, this->previous.stats.failedCount },
+        { "buddy_splits", "Blocks split in two.", stats->splitCount, this->previous.stats.splitCount },
+        { "buddy_coalesces", "Pairs of free buddies merged.", stats->coalesceCount, this->previous.stats.coalesceCount },
+    };
+
+    double seconds = this->hasPrevious ? std::chrono::duration<double>(now - this->previousTime).count() : 0.0;
+    for(int i = 0; i < (int)(sizeof(counters) / sizeof(counters[0])); i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s_total", counters[i].name);
+        appendHeader(&out, name, "counter", counters[i].help);
+        appendF(&out, "%s %lld\n", name, counters[i].value);
+
+        // The rate is left out of the first scrape, as there is nothing to compare it with
+        if(seconds > 0.0) {
+            snprintf(name, sizeof(name), "%s_per_second", counters[i].name);
+            appendHeader(&out, name, "gauge", "Rate of the counter of the same name since the previous scrape.");
+            appendF(&out, "%s %.3f\n", name, (counters[i].value - counters[i].before) / seconds);
+        }
+    }
+
+    appendHeader(&out, "buddy_occupancy_ratio", "gauge", "Share of each chunk of the heap that is allocated, from the start of the heap.");
+    long long chunkSize = 1LL << snapshot.occupancyOrder;
+    for(int c = 0; c < snapshot.occupancyChunks; c++) {
+        appendF(&out, "buddy_occupancy_ratio{chunk=\"%d\",offset=\"%lld\"} %.4f\n", c, c * chunkSize, (double)snapshot.occupancy[c] / chunkSize);
+    }
+
+    appendHeader(&out, "buddy_snapshot_sequence", "counter", "Snapshots the heap has published; unchanged between scrapes if the heap has been idle.");
+    appendF(&out, "buddy_snapshot_sequence %llu\n", snapshot.sequence);
+
+    this->previous = snapshot;
+    this->previousTime = now;
+    this->hasPrevious = true;
+    return out;
+}
+
+/**
+ * The server thread: answers one client at a time until stopped
+ */
+void BuddyIntrospector::run() {
+    while(this->running) {
+        PlatformSocket client = platformAcceptLocal(this->listener, INTROSPECT_POLL_MS);
+        if(client != PLATFORM_NO_SOCKET) {
+            this->answer(client);
+            platformCloseSocket(client);
+        }
+    }
+}
+
+/**
+ * Reads what the client has to say (if anything), and sends it the metrics
+ */
+void BuddyIntrospector::answer(PlatformSocket client) {
+    char request[1024];
+    int received = platformReceive(client, request, sizeof(request) - 1, INTROSPECT_REQUEST_MS);
+    request[received] = '\0';
+
+    std::string body = this->render();
+    if(strncmp(request, "GET ", 4) == 0 || strncmp(request, "HEAD ", 5) == 0) {
+        char head[256];
+        int length = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lld\r\nConnection: close\r\n\r\n", (long long)body.size());
+        if(!platformSendAll(client, head, length) || request[0] == 'H') {
+            return;
+        }
+    }
+
+    platformSendAll(client, body.data(), body.size());
+}
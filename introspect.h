@@ -0,0 +1,59 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Buddy Introspector
+//
+//   Description:  Serves the state of a running buddy heap over a local (Unix
+//                 domain) socket, in the Prometheus text format, so the heap
+//                 can be looked at without a debugger or a BUDDY_SYS_DEBUG
+//                 build.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __INTROSPECT_H__
+#define __INTROSPECT_H__
+
+// Standard headers go first, as auxiliary.h defines macros (e.g. 'ms') that
+// would otherwise clash with names used inside them.
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "buddysys.h"
+
+// How often (in ms) the server thread checks whether it has been stopped
+#define INTROSPECT_POLL_MS 100
+
+// How long (in ms) a client gets to send its request before it's answered anyway
+#define INTROSPECT_REQUEST_MS 100
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class BuddyIntrospector {
+    BuddySystem* heap;
+    char path[108];
+
+    std::thread thread;
+    PlatformSocket listener;
+    std::atomic<bool> running;
+
+    // The snapshot served last, and when, from which the rates are worked out.
+    // Only touched by the server thread.
+    BuddySnapshot previous;
+    std::chrono::steady_clock::time_point previousTime;
+    bool hasPrevious;
+public:
+    BuddyIntrospector();
+    ~BuddyIntrospector();
+
+    bool start(BuddySystem* heap, const char* path);
+    void stop();
+protected:
+    std::string render();
+    void run();
+    void answer(PlatformSocket client);
+};
+
+
+#endif
@@ -34,6 +34,17 @@
 
 #include "auxiliary.h"
 #include "buddysys.h"
+#include "numabuddy.h"
+#include "buddyvariants.h"
+#include "buddyregion.h"
+#include "purger.h"
+#include "handles.h"
+#include "benchmark.h"
+#include "workload.h"
+#include "introspect.h"
+#include "perfcounters.h"
+#include "heapprofiler.h"
+#include "pagerun.h"
 
 using namespace std;
 
@@ -59,18 +70,57 @@ long long int MEMORYSIZE;
 // WHICH RUNNING TIME ESTIMATOR?
 //-------------------------------------
 // - enable one
-// (1) QUERY_PERFORMANCE_COUNTER 
+// (1) QUERY_PERFORMANCE_COUNTER (clock_gettime on Linux - see platformNanoseconds)
      #define USE_QUERY_PERFORMANCE_COUNTER true
 //
 // (2) GETPROCESSTIMES
        // #define USE_GETPROCESSTIMES true //Google Benchmark codes: //https://github.com/google/benchmark/blob/master/src/timers.cc#L67-L75
                                 //https://docs.microsoft.com/en-nz/windows/win32/sysinfo/acquiring-high-resolution-time-stamps?redirectedfrom=MSDN
+//
+// optionally, also count the cycles, instructions, cache and dTLB misses, page faults and
+// context switches of the simulation loop (perf events on Linux) - see perfcounters.h
+       // #define USE_PERF_COUNTERS
 //--------------------------------------
 ///////////////////////////////////////////////////////////
 
 // #define DEBUG_MODE
 // #define DEBUGGINGPRT
 
+// Run the multi-threaded benchmarks (see benchmark.h), with up to this many
+// threads, instead of the test routine below
+// #define RUN_THREAD_BENCHMARK 8
+
+// Run the pointer chasing benchmark of mallocNear (see benchmark.h) instead of
+// the test routine below
+// #define RUN_LOCALITY_BENCHMARK
+
+// Run the cache colouring benchmark (see benchmark.h) instead of the test
+// routine below
+// #define RUN_COLOURING_BENCHMARK
+
+// Run the pre-faulting benchmark (see benchmark.h) instead of the test routine
+// below; it needs about 3GB of memory
+// #define RUN_PREFAULT_BENCHMARK
+
+// Run the 32 bit reference benchmark (see benchmark.h) instead of the test
+// routine below
+// #define RUN_REF_BENCHMARK
+
+// Run the append benchmark (see benchmark.h) instead of the test routine below
+// #define RUN_APPEND_BENCHMARK
+
+// Run the vectored allocation benchmark (see benchmark.h) instead of the test
+// routine below
+// #define RUN_VECTORED_BENCHMARK
+
+// Run the async allocator exercise (see benchmark.h) instead of the test routine
+// below; it needs a C++20 build (make cpp20)
+// #define RUN_ASYNC_EXERCISE
+
+// Run the compaction benchmark (see benchmark.h) instead of the test routine
+// below
+// #define RUN_COMPACTION_BENCHMARK
+
 ///////////////////////////////////////////////////////////
 //---------------------------------------
 // WHICH MEMORY MANAGEMENT STRATEGY?
@@ -97,6 +147,76 @@ const string strategy = "Buddy System"; //enable this to test the Buddy System
 #define MALLOC buddySystem.malloc //enable this to test the Buddy System
 #define FREE buddySystem.free //enable this to test the Buddy System
 //---------------------------------------
+//(4) optionally, place the Buddy System heap in a named shared memory region
+// so other processes can attach to the same heap (requires USE_BUDDY_SYSTEM)
+// #define USE_SHARED_HEAP "BuddySystemHeap"
+//
+// optionally, keep the Buddy System heap in this file so it outlives the program:
+// a later run picks the same heap up again (recovering it if the last run didn't
+// exit cleanly) and counts itself in a block kept at the heap's root. The blocks
+// of a run that didn't exit cleanly are never freed, as only that run knew of them
+// (requires USE_BUDDY_SYSTEM, and no shared heap)
+// #define USE_PERSISTENT_HEAP "buddysys.heap"
+//
+// optionally, give requests of at least this many bytes a mapping of their own
+// rather than a block of the heap (requires USE_BUDDY_SYSTEM, and no shared heap)
+// #define DIRECT_MAP_THRESHOLD 262144
+//
+// optionally, run a background thread handing the pages of free blocks of order
+// 16 (64KiB) and above back to the system once they've been free this many ms
+// (requires USE_BUDDY_SYSTEM, and no shared heap)
+// #define PURGE_DECAY_MS 1000
+//
+// optionally, keep up to this many ready blocks for each of the most requested
+// orders, so that a miss splits a larger block once rather than every time
+// (requires USE_BUDDY_SYSTEM)
+// #define RESERVE_STOCK 64
+//
+// optionally, serve the heap's state (in the Prometheus text format) on this local
+// socket while the program runs, and for INTROSPECT_LINGER_MS afterwards, e.g.
+//   curl --unix-socket buddysys.sock http://localhost/metrics
+// (requires USE_BUDDY_SYSTEM)
+// #define INTROSPECT_SOCKET "buddysys.sock"
+// #define INTROSPECT_LINGER_MS 30000
+//
+// optionally, tell the heap which blocks the workload expects to live a long time
+// (see Workload::isLongLived), so they're placed away from the short lived ones
+// (requires USE_BUDDY_SYSTEM; only the lifetime workload gives any hints)
+// #define USE_LIFETIME_HINTS
+//
+// optionally, fault in the first PREFAULT_BYTES of the heap (-1 for all of it) on
+// PREFAULT_THREADS threads before the test starts, so the timed loop doesn't take
+// a page fault on each first touch (requires USE_BUDDY_SYSTEM)
+// #define PREFAULT_BYTES -1
+// #define PREFAULT_THREADS 4
+//
+// optionally, sample about one malloc in every HEAP_PROFILE_RATE bytes, and write
+// the call sites that own the heap to HEAP_PROFILE_PATH at the end, e.g.
+//   pprof -inuse_space main buddysys.heap
+// (requires USE_BUDDY_SYSTEM, and a main that hasn't been stripped; see heapprofiler.cpp)
+// #define HEAP_PROFILE_RATE 65536
+// #define HEAP_PROFILE_PATH "buddysys.heap"
+//---------------------------------------
+//(5) use one Buddy System per NUMA node, each with a region of MEMORYSIZE bytes
+// const string strategy = "NUMA Buddy System";
+// #define USE_NUMA_BUDDY_SYSTEM
+// #define MALLOC numaBuddySystem.malloc
+// #define FREE numaBuddySystem.free
+//---------------------------------------
+//(6) use a buddy system with non power of two block sizes; the engine is one of
+// BUDDY_ENGINE_FIBONACCI, BUDDY_ENGINE_WEIGHTED or BUDDY_ENGINE_BINARY
+// const string strategy = "Variant Buddy System";
+// #define USE_VARIANT_BUDDY_SYSTEM BUDDY_ENGINE_FIBONACCI
+// #define MALLOC variantBuddySystem.malloc
+// #define FREE variantBuddySystem.free
+//---------------------------------------
+//(7) use runs of whole pages, as mymalloc does, but cut from a buddy heap of pages
+// and cached when freed, so the system is only called when the heap grows
+// const string strategy = "Page Run Allocator";
+// #define USE_PAGE_RUN_ALLOCATOR
+// #define MALLOC pageRunAllocator.malloc
+// #define FREE pageRunAllocator.free
+//---------------------------------------
 ///////////////////////////////////////////////////////////
 
 /* Globals for the BuddySystem class instance */
@@ -104,16 +224,32 @@ const string strategy = "Buddy System"; //enable this to test the Buddy System
 // namespace with all the additional methods implemented
 // in buddysys.cpp
 BuddySystem buddySystem;
+NumaBuddySystem numaBuddySystem;
+BuddyPurger buddyPurger;
+BuddyIntrospector buddyIntrospector;
+HeapProfiler heapProfiler;
+VariantBuddySystem variantBuddySystem;
+PageRunAllocator pageRunAllocator;
 
 //////////////////////////////////////////////////////////////////////////////////////////////
 // MAIN FUNCTION
 ////////////////////////////////////////////////////////////////////////////////////////////////////
-int main() {
+int main(int argc, char** argv) {
    int i,k;
-   unsigned char *n[NO_OF_POINTERS]; // used to store pointers to allocated memory
    int size;
-      
-   unsigned int s[NO_OF_POINTERS]; // size of memory allocated - for testing
+
+   // The workload defaults to the simulation selected in auxiliary.h; see workload.h for the others
+   WorkloadConfig workloadConfig = defaultWorkloadConfig();
+   if(!parseWorkloadArgs(argc, argv, &workloadConfig)) {
+      printWorkloadUsage(argv[0]);
+      return 1;
+   }
+
+   Workload workload;
+   workload.init(workloadConfig);
+
+   unsigned char **n = new unsigned char*[workloadConfig.livePointers]; // used to store pointers to allocated memory
+   unsigned int *s = new unsigned int[workloadConfig.livePointers]; // size of memory allocated - for testing
 
    double  start_time;
 
@@ -121,9 +257,61 @@ int main() {
 
    seed=7652; //DO NOT CHANGE THIS SEED FOR RANDOM NUMBER GENERATION
 
-   for(i=0;i<NO_OF_POINTERS;i++) {
+   for(i=0;i<workloadConfig.livePointers;i++) {
       n[i]=0;     // initially nothing is allocated
    }
+
+#ifdef USE_BUDDY_SYSTEM
+   // The largest free block, sampled through the run, shows how well the heap stays in one piece
+   long long largestFreeSum = 0;
+   long long largestFreeLowest = -1;
+   int largestFreeSamples = 0;
+#endif
+
+#ifdef RUN_THREAD_BENCHMARK
+   runThreadBenchmarks(RUN_THREAD_BENCHMARK, workloadConfig);
+   return 0;
+#endif
+
+#ifdef RUN_LOCALITY_BENCHMARK
+   runLocalityBenchmark(workloadConfig);
+   return 0;
+#endif
+
+#ifdef RUN_COLOURING_BENCHMARK
+   runColouringBenchmark();
+   return 0;
+#endif
+
+#ifdef RUN_PREFAULT_BENCHMARK
+   runPrefaultBenchmark();
+   return 0;
+#endif
+
+#ifdef RUN_REF_BENCHMARK
+   runRefBenchmark();
+   return 0;
+#endif
+
+#ifdef RUN_APPEND_BENCHMARK
+   runAppendBenchmark();
+   return 0;
+#endif
+
+#ifdef RUN_VECTORED_BENCHMARK
+   runVectoredBenchmark(workloadConfig);
+   return 0;
+#endif
+
+#ifdef RUN_ASYNC_EXERCISE
+   runAsyncExercise();
+   return 0;
+#endif
+
+#ifdef RUN_COMPACTION_BENCHMARK
+   runCompactionBenchmark(workloadConfig);
+   return 0;
+#endif
    
 ///////////////////////////////////////////////////////////
 //---------------------------------------
@@ -138,11 +326,7 @@ int main() {
    cout << "=========================================" << endl;
    cout << "          << RUN COMPLETE TEST >>" << endl;
 
-   #ifdef USE_SIMULATION_2
-   cout << "          << SIMULATION 2 >>" << endl;
-   #else
-   cout << "          << SIMULATION 1 >>" << endl;
-   #endif 
+   cout << "          << WORKLOAD: " << workload.getName() << " >>" << endl;
 
    cout << "=========================================" << endl;
 
@@ -159,11 +343,7 @@ int main() {
 
 #ifdef USE_QUERY_PERFORMANCE_COUNTER   
    //---
-   LARGE_INTEGER StartingTime, EndingTime, ElapsedMicroseconds;
-   LARGE_INTEGER Frequency;
-
-   QueryPerformanceFrequency(&Frequency); 
-   QueryPerformanceCounter(&StartingTime);
+   long long StartingTime = platformNanoseconds();
    //---
    cout << "QueryPerformanceCounter started." << endl;
 #endif
@@ -186,26 +366,94 @@ int main() {
               MEMORYSIZE = 512; //bytes  -  RUN_SIMPLE_TEST  
         #endif
 
+        #ifdef USE_SHARED_HEAP
+         //---
+         // The shared heap maps (or attaches to) its own region, the first Node of which is at offset 0
+         buddySystem.initShared(USE_SHARED_HEAP, MEMORYSIZE);
+         wholememory=(Node*) buddySystem.fromOffset(0);
+         //---
+        #elif defined(USE_PERSISTENT_HEAP)
+         //---
+         // The file keeps the heap (and its counts) from one run to the next, the first Node of which is at offset 0
+         {
+            bool restored = buddySystem.initPersistent(USE_PERSISTENT_HEAP, MEMORYSIZE);
+            wholememory=(Node*) buddySystem.fromOffset(0);
+
+            // The root finds the run count again after a restart
+            long long* runCount = (long long*) buddySystem.getRoot();
+            if(runCount == NULL) {
+               runCount = (long long*) buddySystem.malloc(sizeof(long long));
+               *runCount = 0;
+               buddySystem.setRoot(runCount);
+            }
+            (*runCount)++;
+            printf("Persistent heap %s: %s, run %lld\n", USE_PERSISTENT_HEAP, restored ? "restored" : "created", *runCount);
+         }
+         //---
+        #else
          //---  
-         //VirtualAlloc - Reserves, commits, or changes the state of a region of pages in the virtual address space of the calling process. Memory allocated by this function is automatically initialized to zero.
+         //platformAllocPages - VirtualAlloc (or mmap on Linux) reserves and commits a region of pages in the virtual address space of the calling process. Memory allocated this way is automatically initialized to zero.
          //  the return value is the base address of the allocated region of pages.
-         wholememory=(Node*) VirtualAlloc(NULL, MEMORYSIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE); //works!
+         wholememory=(Node*) platformAllocPages(MEMORYSIZE); //works!
          //---
 
-         wholememory->size=(long long int)(MEMORYSIZE-(long long int)sizeof(Node));//Data size only          
-         wholememory->next=NULL;
-         wholememory->previous=NULL;
+         // Instatiate our memory manager with the initial wholememory node
+         // as it's baseline (init fills in the Node itself). The memory comes
+         // zeroed from the system, which saves calloc clearing it again.
+         buddySystem.init(wholememory, MEMORYSIZE, true);
+        #endif
+        #ifdef DIRECT_MAP_THRESHOLD
+         buddySystem.setDirectMapThreshold(DIRECT_MAP_THRESHOLD);
+        #endif
+        #ifdef RESERVE_STOCK
+         buddySystem.setReserveStock(RESERVE_STOCK);
+        #endif
+        #ifdef PREFAULT_BYTES
+         buddySystem.prefault(PREFAULT_BYTES, PREFAULT_THREADS);
+        #endif
+        #ifdef PURGE_DECAY_MS
+         buddyPurger.start(&buddySystem, 16, PURGE_DECAY_MS, 100);
+        #endif
+        #ifdef INTROSPECT_SOCKET
+         if(!buddyIntrospector.start(&buddySystem, INTROSPECT_SOCKET)) {
+            printf("Unable to serve the heap's state on %s\n", INTROSPECT_SOCKET);
+         }
+        #endif
+        #ifdef HEAP_PROFILE_RATE
+         heapProfiler.start(&buddySystem, HEAP_PROFILE_RATE);
+        #endif
          printf("\n\n\nwhole memory address: %ld, size: %lld bytes or %lld Megabytes.\n", wholememory, MEMORYSIZE, MEMORYSIZE/1000000);
-         printf("The size of the structure for the Nodes is: %d, and single large node size is: %lld bytes or %lld Megabytes.\n",sizeof(Node), wholememory->size, wholememory->size/1000000);
+         printf("The size of the header for the Nodes is: %d, and single large node size is: %lld bytes or %lld Megabytes.\n",NODE_HEADER_SIZE, (1LL << wholememory->order) - NODE_HEADER_SIZE, ((1LL << wholememory->order) - NODE_HEADER_SIZE)/1000000);
          // printf("SIZE_BUDDY_LIST is %d \n",SIZE_BUDDY_LIST);
-
-         // Instatiate our memory manager with the initial wholememory node
-         // as it's baseline
-         buddySystem.init(wholememory);
    }
    printf("Init complete\n");
 
 #endif   
+
+#ifdef USE_NUMA_BUDDY_SYSTEM
+   #ifndef RUN_SIMPLE_TEST
+         MEMORYSIZE = (long long int) ((long long int)NUMBEROFPAGES * (long long int)PAGESIZE);
+   #else
+         MEMORYSIZE = 512; //bytes  -  RUN_SIMPLE_TEST  
+   #endif
+
+   // One region of MEMORYSIZE per node, or a single region on a machine without NUMA
+   numaBuddySystem.init(MEMORYSIZE);
+#endif
+
+#ifdef USE_VARIANT_BUDDY_SYSTEM
+   #ifndef RUN_SIMPLE_TEST
+         MEMORYSIZE = (long long int) ((long long int)NUMBEROFPAGES * (long long int)PAGESIZE);
+   #else
+         MEMORYSIZE = 512; //bytes  -  RUN_SIMPLE_TEST  
+   #endif
+
+   variantBuddySystem.init(platformAllocPages(MEMORYSIZE), MEMORYSIZE, USE_VARIANT_BUDDY_SYSTEM);
+#endif
+
+#ifdef USE_PAGE_RUN_ALLOCATOR
+   pageRunAllocator.init(PAGE_RUN_ARENA_PAGES);
+#endif
 //-------------------------------------------------------------------------------------  
 ////////////////////////////////////////////////////////////////////////////////////////   
 
@@ -215,7 +463,7 @@ int main() {
    cout << "start memory = " << start_mem << " bytes" << ", or " << start_mem/1024 << " KiloBytes, or " <<  start_mem/1048576 << " MegaBytes, or " <<  start_mem/(1073741824) << " GigaBytes" << endl;
 
    /////////////////////////////////////////////////////////////////////////////////////////////////
-   cout << "\n\n<<<<<<<<<<<<<<<<< Simulation starts... " << ", max iterations = " << NO_OF_ITERATIONS << " >>>>>>>>>>>>>>>\n";
+   cout << "\n\n<<<<<<<<<<<<<<<<< Simulation starts... " << ", max iterations = " << workloadConfig.iterations << " >>>>>>>>>>>>>>>\n";
    
 //---------------------------------------
 //Test routine
@@ -258,12 +506,12 @@ long long int totalSizeOfNodes=0;
                     if(n[k] != NULL){
                        s[k]=size; // remember the size
                        totalAllocatedBytes = totalAllocatedBytes + s[k];
-                       totalSizeOfNodes = totalSizeOfNodes + sizeof(Node);
+                       totalSizeOfNodes = totalSizeOfNodes + NODE_HEADER_SIZE;
                        #ifdef DEBUGGINGPRT
                           cout << "\t\t\t\tsuccessfully allocated memory of size: " << size << endl;   
-                          //// printf("\t\tRETALLOC size %d at address %ld (block size %d at Nodeaddress %ld)\n",s[k], (Node*) ((uintptr_t)n[k]-(uintptr_t)wholememory),  s[k]+sizeof(Node), (Node*)( (uintptr_t)n[k]-(uintptr_t)sizeof(Node)-(uintptr_t)wholememory) );
+                          //// printf("\t\tRETALLOC size %d at address %ld (block size %d at Nodeaddress %ld)\n",s[k], (Node*) ((uintptr_t)n[k]-(uintptr_t)wholememory),  s[k]+sizeof(Node), (Node*)( (uintptr_t)n[k]-(uintptr_t)NODE_HEADER_SIZE-(uintptr_t)wholememory) );
                           
-                          printf("\n\t\t\t\t << MALLOC() >>  relative address: %8ld size: %8d  (Node: %8ld Nodesize: %8d)\n", (Node*)((uintptr_t)n[k]-(uintptr_t)wholememory),  s[k], (Node*)((uintptr_t)n[k]-(uintptr_t)sizeof(Node)-(uintptr_t)wholememory) , s[k]+sizeof(Node) );
+                          printf("\n\t\t\t\t << MALLOC() >>  relative address: %8ld size: %8d  (Node: %8ld Nodesize: %8d)\n", (Node*)((uintptr_t)n[k]-(uintptr_t)wholememory),  s[k], (Node*)((uintptr_t)n[k]-(uintptr_t)NODE_HEADER_SIZE-(uintptr_t)wholememory) , s[k]+NODE_HEADER_SIZE );
                        #endif   
                        
 
@@ -290,7 +538,7 @@ long long int totalSizeOfNodes=0;
 
                        #ifdef DEBUGGINGPRT
                          cout << "\n======>REQUEST: FREE(" << hex << n[k] << ") =======\n\n";
-                         printf("\n\t\t\t\t << FREE() >>  relative address: %8ld size: %8d  (Node: %8ld Nodesize: %8d)\n", (Node*)((uintptr_t)n[k]-(uintptr_t)wholememory),  s[k], (Node*)((uintptr_t)n[k]-(uintptr_t)sizeof(Node)-(uintptr_t)wholememory) , sizeof(Node) );
+                         printf("\n\t\t\t\t << FREE() >>  relative address: %8ld size: %8d  (Node: %8ld Nodesize: %8d)\n", (Node*)((uintptr_t)n[k]-(uintptr_t)wholememory),  s[k], (Node*)((uintptr_t)n[k]-(uintptr_t)NODE_HEADER_SIZE-(uintptr_t)wholememory) , NODE_HEADER_SIZE );
                        #endif
                        FREE(n[k]);
                        totalFreeSpace = totalFreeSpace + s[k];      
@@ -310,14 +558,20 @@ long long int totalSizeOfNodes=0;
 ////////////////////////////////////////////////////////
 
 #ifdef RUN_COMPLETE_TEST  
-   cout << "\n\n executing " << NO_OF_ITERATIONS << " rounds of combinations of memory allocation and deallocation..." << endl;
+   cout << "\n\n executing " << workloadConfig.iterations << " rounds of combinations of memory allocation and deallocation..." << endl;
+
+  #ifdef USE_PERF_COUNTERS
+   PerfCounters perfCounters;
+   perfCounters.open();
+   perfCounters.start();
+  #endif
     
-   for(i=0;i<NO_OF_ITERATIONS;i++) {
+   for(i=0;i<workloadConfig.iterations;i++) {
 
     #ifdef DEBUG_MODE
       cout << "iteration: " << i << endl;
     #endif
-      k=myrand() % NO_OF_POINTERS; // pick a pointer
+      k=workload.nextSlot(); // pick a pointer
 
       if(n[k]) { // if it was allocated then free it
          // check that the stuff we wrote has not changed       
@@ -328,12 +582,26 @@ long long int totalSizeOfNodes=0;
 
          FREE(n[k]);         
       }
-      size=randomsize(); // pick a random size
+      size=workload.nextSize(k); // pick a random size
       #ifdef DEBUG_MODE
         cout << "\tPick random size to allocate: " << size << endl;
       #endif
         
+    #ifdef USE_LIFETIME_HINTS
+      n[k]=(unsigned char *)buddySystem.malloc(size, workload.isLongLived(k) ? BUDDY_LIFETIME_LONG : BUDDY_LIFETIME_SHORT);
+    #else
       n[k]=(unsigned char *)MALLOC(size); // do the allocation
+    #endif
+    #ifdef USE_BUDDY_SYSTEM
+      if((i & 1023) == 0) {
+         long long largestFree = buddySystem.largestFreeBlock();
+         largestFreeSum += largestFree;
+         largestFreeSamples++;
+         if(largestFreeLowest < 0 || largestFree < largestFreeLowest) {
+            largestFreeLowest = largestFree;
+         }
+      }
+    #endif
       if(n[k] != NULL){
          #ifdef DEBUG_MODE
             cout << "\tallocated memory of size: " << size << endl;   
@@ -349,6 +617,10 @@ long long int totalSizeOfNodes=0;
       }    
       
    }
+
+  #ifdef USE_PERF_COUNTERS
+   perfCounters.stop();
+  #endif
 #endif
 
    cout << "\n<<<<<<<<<<<<< End of simulation >>>>>>>>>>>>\n\n"; 
@@ -371,30 +643,82 @@ long long int totalSizeOfNodes=0;
 
 #ifdef USE_QUERY_PERFORMANCE_COUNTER
    //---
-   QueryPerformanceCounter(&EndingTime);
-   ElapsedMicroseconds.QuadPart = EndingTime.QuadPart - StartingTime.QuadPart;
-
-   //
-   // We now have the elapsed number of ticks, along with the
-   // number of ticks-per-second. We use these values
-   // to convert to the number of elapsed microseconds.
-   // To guard against loss-of-precision, we convert
-   // to microseconds *before* dividing by ticks-per-second.
-   //
-
-   ElapsedMicroseconds.QuadPart *= 1000000;
-   ElapsedMicroseconds.QuadPart /= Frequency.QuadPart;
-   cout << "Elapsed Time = " << ElapsedMicroseconds.QuadPart << " microsec(s)." << endl;
+   long long ElapsedMicroseconds = (platformNanoseconds() - StartingTime) / 1000;
+   cout << "Elapsed Time = " << ElapsedMicroseconds << " microsec(s)." << endl;
+#endif
+
+#if defined(USE_PERF_COUNTERS) && defined(RUN_COMPLETE_TEST)
+   perfCounters.print(stdout, workloadConfig.iterations, "iteration");
 #endif
    
 #ifdef USE_BUDDY_SYSTEM
    cout << " " << endl;
    cout << "whole memory address: " << wholememory << ", size: " << MEMORYSIZE << " bytes or " << MEMORYSIZE/1000000 << " Megabytes.\n";
-   printf("The size of the structure for the Nodes is: %d, and single large node size is: %lld bytes or %lld Megabytes.\n",sizeof(Node), wholememory->size, wholememory->size/1000000);
+   printf("The size of the header for the Nodes is: %d, and single large node size is: %lld bytes or %lld Megabytes.\n",NODE_HEADER_SIZE, (1LL << wholememory->order) - NODE_HEADER_SIZE, ((1LL << wholememory->order) - NODE_HEADER_SIZE)/1000000);
    // printf("SIZE_BUDDY_LIST is %d \n",SIZE_BUDDY_LIST);
+   {
+      BuddyStats heapStats = buddySystem.getStats();
+      printf("Split chains: %lld in %lld mallocs (%.3f per malloc), %lld reserve fills, %lld reserve pairs released\n",
+             heapStats.splitChainCount, heapStats.mallocCount, (double)heapStats.splitChainCount / (heapStats.mallocCount > 0 ? heapStats.mallocCount : 1),
+             heapStats.reserveFillCount, heapStats.reserveReleaseCount);
+      printf("Failed mallocs: %lld (%.3f%%), largest free block: %lld bytes on average, %lld at the lowest\n",
+             heapStats.failedCount, 100.0 * heapStats.failedCount / (heapStats.mallocCount + heapStats.failedCount > 0 ? heapStats.mallocCount + heapStats.failedCount : 1),
+             largestFreeSamples > 0 ? largestFreeSum / largestFreeSamples : 0LL, largestFreeLowest);
+   }
+   #ifdef DIRECT_MAP_THRESHOLD
+   {
+      DirectMapStats mapStats = buddySystem.getDirectMapStats();
+      printf("Direct mappings: %lld served (%lld from the cache), %lld mapped and %lld unmapped, %lld bytes live, %lld bytes cached\n",
+             mapStats.mallocCount, mapStats.cacheHits, mapStats.mapCount, mapStats.unmapCount, mapStats.bytesMapped, mapStats.bytesCached);
+   }
+   #endif
+   #ifdef PURGE_DECAY_MS
+   {
+      PurgeStats purgeStats = buddyPurger.getStats();
+      printf("Purger: %lld passes (%lld skipped as the heap was busy), %lld blocks purged, %lld bytes returned to the system\n",
+             purgeStats.passCount, purgeStats.busyCount, purgeStats.purgeCount, purgeStats.bytesPurged);
+   }
+   #endif
+   #ifdef HEAP_PROFILE_RATE
+   {
+      ProfileStats profileStats = heapProfiler.getStats();
+      printf("Heap profile: %lld mallocs sampled from %lld call sites, %lld still allocated, standing for %lld bytes (%lld allocated)\n",
+             profileStats.sampledCount, profileStats.siteCount, profileStats.liveCount, profileStats.liveEstimatedBytes, buddySystem.getStats().bytesAllocated);
+      #ifdef HEAP_PROFILE_PATH
+      if(!heapProfiler.dump(HEAP_PROFILE_PATH)) {
+         printf("Unable to write the heap profile to %s\n", HEAP_PROFILE_PATH);
+      }
+      #endif
+   }
+   #endif
+   cout << "-------------------------------------------------------- " << endl;      
+#endif   
+
+#ifdef USE_NUMA_BUDDY_SYSTEM
+   numaBuddySystem.printStats();
    cout << "-------------------------------------------------------- " << endl;      
 #endif   
 
+#ifdef USE_VARIANT_BUDDY_SYSTEM
+   {
+      BuddyStats stats = variantBuddySystem.getStats();
+      printf("%s buddy system: mallocs %lld, frees %lld, failed %lld, splits %lld, coalesces %lld, allocated %lld of %lld bytes\n",
+             variantBuddySystem.getEngineName(), stats.mallocCount, stats.freeCount, stats.failedCount,
+             stats.splitCount, stats.coalesceCount, stats.bytesAllocated, MEMORYSIZE);
+      cout << "-------------------------------------------------------- " << endl;      
+   }
+#endif   
+
+#ifdef USE_PAGE_RUN_ALLOCATOR
+   {
+      PageRunStats runStats = pageRunAllocator.getStats();
+      printf("Page runs: %lld mallocs (%lld from the cache), %lld frees, %lld failed, %lld arenas mapped (%lld bytes), %lld pages allocated, %lld cached\n",
+             runStats.mallocCount, runStats.cacheHits, runStats.freeCount, runStats.failedCount,
+             runStats.arenaCount, runStats.bytesMapped, runStats.pagesAllocated, runStats.pagesCached);
+      cout << "-------------------------------------------------------- " << endl;      
+   }
+#endif   
+
 #ifndef USE_BUDDY_SYSTEM
    cout << "Memory Left: " << memory() << ", or " << memory()/1024 << " KiloBytes, or " <<  memory()/1048576 << " MegaBytes, or " <<   memory()/(1073741824) << " GigaBytes" << endl;
    cout << "Memory Used " << (start_mem - memory()) << " bytes, or " << (start_mem - memory())/1024 << " Kilobytes, or " << (start_mem - memory())/1048576 << " Megabytes" << endl;
@@ -402,6 +726,32 @@ long long int totalSizeOfNodes=0;
    cout << "========================================================" << endl;
 #endif   
 
+#if defined(INTROSPECT_SOCKET) && defined(INTROSPECT_LINGER_MS)
+   printf("Serving the heap's state on %s for another %d ms\n", INTROSPECT_SOCKET, INTROSPECT_LINGER_MS);
+   std::this_thread::sleep_for(std::chrono::milliseconds(INTROSPECT_LINGER_MS));
+#endif
+
+#ifdef USE_SHARED_HEAP
+   // Nothing else uses the heap once the test is over, so the next run starts a fresh one
+   #ifdef INTROSPECT_SOCKET
+   buddyIntrospector.stop();
+   #endif
+   buddySystem.detach();
+   BuddySystem::unlinkShared(USE_SHARED_HEAP);
+#endif
+
+#ifdef USE_PERSISTENT_HEAP
+   // Only the run count is kept for the next run; the test's own blocks would otherwise fill the heap up run by run
+   #ifdef INTROSPECT_SOCKET
+   buddyIntrospector.stop();
+   #endif
+   for(i=0;i<workloadConfig.livePointers;i++) {
+      if(n[i]) {
+         FREE(n[i]);
+      }
+   }
+   buddySystem.detach();
+#endif
 
    return 0;
 }
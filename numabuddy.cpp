@@ -0,0 +1,175 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  NUMA Buddy System
+//
+//   Description:  Runs one buddy system per NUMA node, each with its own region
+//                 of memory bound to that node, so threads allocate from memory
+//                 local to the socket they are running on.
+//
+// Notes:
+// * Each node's heap is an ordinary (thread safe) BuddySystem over a region
+//   from platformAllocOnNode, so a free only ever locks the heap it returns to.
+// * Blocks always go back to the heap of the region they came from, which we
+//   find by address; the regions never overlap.
+// * On a machine without NUMA (or when asked to) this runs with a single node,
+//   which behaves exactly like one BuddySystem. Asking for more nodes than the
+//   machine has creates unbound regions, which is handy for testing the
+//   routing on a single node machine.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <stdexcept>
+
+#include "numabuddy.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * As with BuddySystem, no work can be done until init is called
+ */
+NumaBuddySystem::NumaBuddySystem() {
+    this->nodeCount = 0;
+}
+
+/**
+ * init allocates one region of 'regionSize' bytes (which must be a power of two) for
+ * each NUMA node, and starts a buddy system on each of them.
+ *
+ * 'nodeCount' overrides the number of nodes detected; 0 uses the number of nodes in
+ * the machine.
+ */
+void NumaBuddySystem::init(long long regionSize, int nodeCount) {
+    if(nodeCount <= 0) {
+        nodeCount = platformNumaNodeCount();
+    }
+
+    if(nodeCount > MAX_NUMA_NODES) {
+        nodeCount = MAX_NUMA_NODES;
+    }
+
+    this->regionSize = regionSize;
+    for(int node = 0; node < nodeCount; node++) {
+        Node* region = (Node*)platformAllocOnNode(regionSize, node);
+        if(region == NULL) {
+            throw std::runtime_error("NumaBuddySystem::init has failed - unable to allocate memory for a node");
+        }
+
+        this->regions[node] = region;
+        this->heaps[node].init(region, regionSize, true);
+        this->heaps[node].setThreadSafe(true);
+        this->fallbackCount[node].store(0);
+        this->remoteFreeCount[node].store(0);
+
+        // Only count the node once it is fully set up, so release() is safe if a later node fails
+        this->nodeCount = node + 1;
+    }
+
+    printf("[NumaBuddySystem::init]:: Initialised %d node(s) of %lld bytes each\n", this->nodeCount, regionSize);
+}
+
+/**
+ * Frees every node's region. All memory allocated from this system becomes invalid.
+ */
+void NumaBuddySystem::release() {
+    for(int node = 0; node < this->nodeCount; node++) {
+        platformFreeRegion(this->regions[node], this->regionSize);
+    }
+
+    this->nodeCount = 0;
+}
+
+/**
+ * Allocates from the node the calling thread is currently running on
+ */
+void* NumaBuddySystem::malloc(int request_memory) {
+    return this->malloc(request_memory, platformCurrentNumaNode());
+}
+
+/**
+ * Allocates from 'node' if it can. If that node's region can't satisfy the request,
+ * the remaining nodes are tried in turn (and the fallback is counted against 'node').
+ *
+ * Returns NULL if no node can satisfy the request. A negative 'node' is taken as node 0.
+ */
+void* NumaBuddySystem::malloc(int request_memory, int node) {
+    if(this->nodeCount == 0) {
+        throw std::logic_error("NumaBuddySystem::malloc has failed - init hasn't been called!");
+    }
+
+    // Machines with more nodes than we have regions share the regions out
+    node = node < 0 ? 0 : node % this->nodeCount;
+
+    void* p = this->heaps[node].malloc(request_memory);
+    if(p != NULL) {
+        return p;
+    }
+
+    for(int i = 1; i < this->nodeCount; i++) {
+        p = this->heaps[(node + i) % this->nodeCount].malloc(request_memory);
+        if(p != NULL) {
+            this->fallbackCount[node].fetch_add(1, std::memory_order_relaxed);
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns the block 'p' to the heap of the node it was allocated from, whichever
+ * node the calling thread happens to be on.
+ *
+ * Returns 0 if 'p' did not come from this system.
+ */
+int NumaBuddySystem::free(void* p) {
+    int node = this->nodeOf(p);
+    if(node < 0) {
+        return 0;
+    }
+
+    if(this->nodeCount > 1 && node != platformCurrentNumaNode() % this->nodeCount) {
+        this->remoteFreeCount[node].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return this->heaps[node].free(p);
+}
+
+/**
+ * Returns the node whose region contains 'p', or -1 if none do.
+ */
+int NumaBuddySystem::nodeOf(void* p) {
+    for(int node = 0; node < this->nodeCount; node++) {
+        if(this->heaps[node].owns(p)) {
+            return node;
+        }
+    }
+
+    return -1;
+}
+
+int NumaBuddySystem::getNodeCount() {
+    return this->nodeCount;
+}
+
+NumaNodeStats NumaBuddySystem::getStats(int node) {
+    NumaNodeStats stats;
+    stats.heap = this->heaps[node].getStats();
+    stats.fallbackCount = this->fallbackCount[node].load(std::memory_order_relaxed);
+    stats.remoteFreeCount = this->remoteFreeCount[node].load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+/**
+ * Prints a one line summary of each node's counters
+ */
+void NumaBuddySystem::printStats() {
+    for(int node = 0; node < this->nodeCount; node++) {
+        NumaNodeStats stats = this->getStats(node);
+        printf("node %d: mallocs %lld, frees %lld, failed %lld, fallbacks %lld, remote frees %lld, allocated %lld of %lld bytes\n",
+               node, stats.heap.mallocCount, stats.heap.freeCount, stats.heap.failedCount,
+               stats.fallbackCount, stats.remoteFreeCount, stats.heap.bytesAllocated, this->regionSize);
+    }
+}
@@ -0,0 +1,61 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  NUMA Buddy System
+//
+//   Description:  Runs one buddy system per NUMA node, each with its own region
+//                 of memory bound to that node, so threads allocate from memory
+//                 local to the socket they are running on.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __NUMABUDDY_H__
+#define __NUMABUDDY_H__
+
+#include <atomic>
+
+#include "buddysys.h"
+
+// The most NUMA nodes we will create regions for. Any further nodes in the
+// machine share the regions of the first MAX_NUMA_NODES.
+#define MAX_NUMA_NODES 8
+
+// Per node counters, in addition to the BuddyStats of the node's heap
+typedef struct NumaNodeStats {
+    BuddyStats heap;
+
+    // Allocations that wanted this node but were served by another, as
+    // this node's region could not satisfy them.
+    long long fallbackCount;
+
+    // Blocks from this node freed by a thread running on a different node
+    long long remoteFreeCount;
+} NumaNodeStats;
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class NumaBuddySystem {
+    BuddySystem heaps[MAX_NUMA_NODES];
+    Node* regions[MAX_NUMA_NODES];
+    long long regionSize;
+    int nodeCount;
+
+    std::atomic<long long> fallbackCount[MAX_NUMA_NODES];
+    std::atomic<long long> remoteFreeCount[MAX_NUMA_NODES];
+public:
+    NumaBuddySystem();
+    void init(long long regionSize, int nodeCount = 0);
+    void release();
+
+    void* malloc(int request_memory);
+    void* malloc(int request_memory, int node);
+    int free(void* p);
+
+    int nodeOf(void* p);
+    int getNodeCount();
+    NumaNodeStats getStats(int node);
+    void printStats();
+};
+
+
+#endif
@@ -0,0 +1,237 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Page Run Allocator
+//
+//   Description:  A replacement for mymalloc that hands out runs of whole pages
+//                 without a system call for each one. Runs come from a buddy
+//                 heap of pages, freed runs are cached by size for the next
+//                 malloc of that size, and the system is only asked for more
+//                 memory when the heap has to grow.
+//
+// Notes:
+// * mymalloc makes two system calls for every malloc and free (allocpages maps,
+//   and freepages unmaps, the pages with a page of its own in front), and each
+//   fresh mapping is zeroed and faulted in again page by page. Here a run is
+//   cut from an arena already mapped, and a run freed and malloc'd again is
+//   handed back warm.
+// * The runs have no header, so they stay page aligned. Their bookkeeping is a
+//   BuddySystem of its own (the map heap) where every 16 byte block stands for
+//   a page of the arena: a run of 2^k pages is a map block of 2^k units, and
+//   the BuddyRef of that block (see mallocRef) is the index of its first page.
+//   The map heap does the splitting and merging, and takes 1/256th of the
+//   memory the pages do.
+// * Runs are rounded up to a power of two pages, as with any buddy heap. The
+//   cache is indexed by that order, so any malloc needing a run of the same
+//   order can take a cached one.
+// * Memory is never given back to the system; a freed run goes to the cache,
+//   or back to its arena. Like mymalloc, the allocator isn't thread safe.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <stdexcept>
+
+#include "pagerun.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * As with BuddySystem, no work can be done until init is called
+ */
+PageRunAllocator::PageRunAllocator() {
+    this->arenas = NULL;
+    this->arenaPages = 0;
+    this->cachedPages = 0;
+    for(int k = 0; k <= PAGE_RUN_CACHE_ORDER; k++) {
+        this->cache[k] = NULL;
+    }
+
+    this->stats = PageRunStats();
+}
+
+PageRunAllocator::~PageRunAllocator() {
+    while(this->arenas != NULL) {
+        PageArena* arena = this->arenas;
+        this->arenas = arena->next;
+        platformFreeRegion(arena->memory, arena->memorySize);
+        delete arena;
+    }
+}
+
+/**
+ * Sets the number of pages in each arena taken from the system, which must be a power of two.
+ * No memory is taken until the first malloc.
+ */
+void PageRunAllocator::init(long long arenaPages) {
+    if(arenaPages < 2 || (arenaPages & (arenaPages - 1)) != 0 || arenaPages * PAGE_RUN_MAP_UNIT >= (1LL << (SIZE_OF_FREE_LIST - 1))) {
+        throw std::logic_error("PageRunAllocator::init has failed - the arena size must be a power of two pages!");
+    }
+
+    this->arenaPages = arenaPages;
+}
+
+/**
+ * Returns page aligned memory of at least 'request_memory' bytes, as whole pages. Returns NULL
+ * if the system can't provide the memory.
+ */
+void* PageRunAllocator::malloc(int request_memory) {
+    if(request_memory < 0) {
+        this->stats.failedCount++;
+        return NULL;
+    }
+
+    long long pages = ((long long)request_memory + PAGESIZE - 1) / PAGESIZE;
+    int order = 0;
+    while((1LL << order) < pages) {
+        order++;
+    }
+
+    void* run = NULL;
+    if(order <= PAGE_RUN_CACHE_ORDER && this->cache[order] != NULL) {
+        run = this->cache[order];
+        this->cache[order] = *(void**)run;
+        this->cachedPages -= 1LL << order;
+        this->entryOf(this->findArena(run), run)->state = PAGE_RUN_LIVE;
+        this->stats.cacheHits++;
+    } else {
+        run = this->allocateRun(order);
+        if(run == NULL) {
+            this->stats.failedCount++;
+            return NULL;
+        }
+    }
+
+    this->stats.mallocCount++;
+    this->stats.pagesAllocated += 1LL << order;
+    return run;
+}
+
+/**
+ * Frees a run returned by malloc, caching it if it is small enough and the cache has room.
+ * Returns 1 if the run was freed, and 0 if 'p' isn't a run allocated from here.
+ */
+int PageRunAllocator::free(void* p) {
+    PageArena* arena = this->findArena(p);
+    PageRunEntry* entry = arena == NULL ? NULL : this->entryOf(arena, p);
+    if(entry == NULL || entry->state != PAGE_RUN_LIVE) {
+        return 0;
+    }
+
+    int order = entry->order;
+    this->stats.freeCount++;
+    this->stats.pagesAllocated -= 1LL << order;
+
+    if(order <= PAGE_RUN_CACHE_ORDER && this->cachedPages + (1LL << order) <= PAGE_RUN_CACHE_PAGES) {
+        entry->state = PAGE_RUN_CACHED;
+        *(void**)p = this->cache[order];
+        this->cache[order] = p;
+        this->cachedPages += 1LL << order;
+        return 1;
+    }
+
+    entry->state = 0;
+    return arena->map.free(entry);
+}
+
+PageRunStats PageRunAllocator::getStats() {
+    PageRunStats stats = this->stats;
+    stats.pagesCached = this->cachedPages;
+    return stats;
+}
+
+/**
+ * Cuts a run of 2^order pages from the first arena that has room for it, adding an arena when
+ * none does.
+ */
+void* PageRunAllocator::allocateRun(int order) {
+    if(order >= SIZE_OF_FREE_LIST - BUDDY_MIN_ORDER - 1) {
+        return NULL;
+    }
+
+    int mapRequest = (PAGE_RUN_MAP_UNIT << order) - NODE_HEADER_SIZE;
+    PageArena* arena = this->arenas;
+    BuddyRef ref = BUDDY_NULL_REF;
+    while(arena != NULL) {
+        if((1LL << order) <= arena->pageCount && (ref = arena->map.mallocRef(mapRequest)) != BUDDY_NULL_REF) {
+            break;
+        }
+
+        arena = arena->next;
+    }
+
+    if(arena == NULL) {
+        arena = this->addArena(order);
+        if(arena == NULL) {
+            return NULL;
+        }
+
+        ref = arena->map.mallocRef(mapRequest);
+    }
+
+    PageRunEntry* entry = (PageRunEntry*)arena->map.fromRef(ref);
+    entry->state = PAGE_RUN_LIVE;
+    entry->order = order;
+    return arena->pages + (long long)ref * PAGESIZE;
+}
+
+/**
+ * Takes a new arena from the system, large enough for a run of 2^order pages, and puts it at
+ * the front of the list. Returns NULL if the system can't provide it.
+ */
+PageArena* PageRunAllocator::addArena(int order) {
+    if(this->arenaPages == 0) {
+        throw std::logic_error("PageRunAllocator::malloc has failed - init hasn't been called!");
+    }
+
+    long long pageCount = this->arenaPages > (1LL << order) ? this->arenaPages : (1LL << order);
+
+    // The map heap needs at least two of its smallest blocks
+    pageCount = pageCount < 2 ? 2 : pageCount;
+    long long mapSize = pageCount * PAGE_RUN_MAP_UNIT;
+    long long mapPages = (mapSize + PAGESIZE - 1) / PAGESIZE;
+    long long memorySize = (mapPages + pageCount) * PAGESIZE;
+
+    void* memory = platformAllocPages(memorySize);
+    if(memory == NULL) {
+        return NULL;
+    }
+
+    PageArena* arena = new PageArena;
+    arena->memory = memory;
+    arena->memorySize = memorySize;
+    arena->pages = (unsigned char*)memory + mapPages * PAGESIZE;
+    arena->pageCount = pageCount;
+    arena->map.init((Node*)memory, mapSize, true);
+
+    arena->next = this->arenas;
+    this->arenas = arena;
+    this->stats.arenaCount++;
+    this->stats.bytesMapped += memorySize;
+    return arena;
+}
+
+/**
+ * Returns the arena whose pages hold 'p', or NULL if there is none
+ */
+PageArena* PageRunAllocator::findArena(void* p) {
+    for(PageArena* arena = this->arenas; arena != NULL; arena = arena->next) {
+        if((unsigned char*)p >= arena->pages && (unsigned char*)p < arena->pages + arena->pageCount * PAGESIZE) {
+            return arena;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns the map entry of the run starting at 'p', or NULL if 'p' isn't at the start of a page
+ */
+PageRunEntry* PageRunAllocator::entryOf(PageArena* arena, void* p) {
+    uintptr_t offset = (uintptr_t)p - (uintptr_t)arena->pages;
+    if(offset % PAGESIZE != 0) {
+        return NULL;
+    }
+
+    return (PageRunEntry*)arena->map.fromRef((BuddyRef)(offset / PAGESIZE));
+}
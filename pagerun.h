@@ -0,0 +1,104 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Page Run Allocator
+//
+//   Description:  A replacement for mymalloc that hands out runs of whole pages
+//                 without a system call for each one. Runs come from a buddy
+//                 heap of pages, freed runs are cached by size for the next
+//                 malloc of that size, and the system is only asked for more
+//                 memory when the heap has to grow.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __PAGERUN_H__
+#define __PAGERUN_H__
+
+#include "buddysys.h"
+
+// Pages in each arena taken from the system, unless init is told otherwise
+// (4096 pages is 16MiB). A run larger than this gets an arena of its own size.
+#define PAGE_RUN_ARENA_PAGES 4096
+
+// Freed runs of up to 2^PAGE_RUN_CACHE_ORDER pages are cached, up to
+// PAGE_RUN_CACHE_PAGES pages in all; larger runs, and those that don't fit
+// in the cache, go straight back to the buddy heap to be merged.
+#define PAGE_RUN_CACHE_ORDER 6
+#define PAGE_RUN_CACHE_PAGES 1024
+
+// Bytes of the map heap standing for each page; the smallest block it has
+#define PAGE_RUN_MAP_UNIT (1 << BUDDY_MIN_ORDER)
+
+// Kept in a run's map block, to catch frees of pointers that aren't runs
+#define PAGE_RUN_LIVE 0x4E555250u
+#define PAGE_RUN_CACHED 0x48434350u
+
+// What is kept in the data of the map block of each run
+typedef struct PageRunEntry {
+    unsigned int state;
+
+    // The run is 2^order pages
+    int order;
+} PageRunEntry;
+
+// Memory taken from the system in one call: the map heap's memory, then the
+// pages themselves
+typedef struct PageArena {
+    // Page p of the arena is allocated as the map heap's block at offset
+    // p * PAGE_RUN_MAP_UNIT, so a run's BuddyRef is the index of its first page
+    BuddySystem map;
+
+    unsigned char* pages;
+    long long pageCount;
+
+    void* memory;
+    long long memorySize;
+    PageArena* next;
+} PageArena;
+
+typedef struct PageRunStats {
+    long long mallocCount;
+    long long freeCount;
+    long long failedCount;
+
+    // Mallocs served from the cache, with no work in the buddy heap
+    long long cacheHits;
+
+    // System calls made for memory (one per arena), and the bytes they mapped
+    long long arenaCount;
+    long long bytesMapped;
+
+    // Pages in runs that are allocated, and in runs waiting in the cache
+    long long pagesAllocated;
+    long long pagesCached;
+} PageRunStats;
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class PageRunAllocator {
+    PageArena* arenas;
+    long long arenaPages;
+
+    // Freed runs of each order, linked through their first word
+    void* cache[PAGE_RUN_CACHE_ORDER + 1];
+    long long cachedPages;
+
+    PageRunStats stats;
+public:
+    PageRunAllocator();
+    ~PageRunAllocator();
+    void init(long long arenaPages = PAGE_RUN_ARENA_PAGES);
+
+    void* malloc(int request_memory);
+    int free(void* p);
+
+    PageRunStats getStats();
+protected:
+    void* allocateRun(int order);
+    PageArena* addArena(int order);
+    PageArena* findArena(void* p);
+    PageRunEntry* entryOf(PageArena* arena, void* p);
+};
+
+
+#endif
@@ -0,0 +1,287 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Performance Counters
+//
+//   Description:  Counts what a stretch of code costs the processor - cycles,
+//                 instructions, cache and dTLB misses - using the hardware
+//                 counters (perf_event_open on Linux), along with page faults,
+//                 context switches and resident memory. Counters the machine
+//                 can't provide fall back to software counts where there are
+//                 any, so allocators can be compared on more than wall time.
+//
+//   References:
+//
+//     https://man7.org/linux/man-pages/man2/perf_event_open.2.html
+//
+// Notes:
+// * Each counter is its own perf event rather than one group, so a machine that
+//   can count some events but not others (virtual machines often give cycles
+//   and instructions only) still gets what it can. Events the PMU can't all
+//   count at once are multiplexed by the kernel, and scaled up here by the time
+//   they ran; the coverage is reported with them.
+// * Kernel time is counted if perf_event_paranoid allows it, so the page faults
+//   of touching new memory are part of the cost. Otherwise only user time is.
+// * Cycles fall back to the time stamp counter (which counts at a fixed rate,
+//   and keeps counting while the process is switched out), and page faults and
+//   context switches to the operating system's own counts. Instructions and
+//   misses have no software equivalent, and are reported as not available.
+// * Windows has no equivalent of perf_event_open open to a normal process, so
+//   it always gets the software counts.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+
+#include "perfcounters.h"
+
+#ifdef __linux__
+    #include <errno.h>
+    #include <unistd.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <linux/perf_event.h>
+#endif
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+PerfCounters::PerfCounters() {
+    for(int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        this->events[c] = -1;
+        this->source[c] = PERF_SOURCE_NONE;
+        this->startCount[c] = 0;
+    }
+
+    this->startTime = 0;
+    this->reading = PerfReading();
+    this->running = false;
+}
+
+PerfCounters::~PerfCounters() {
+    this->close();
+}
+
+/**
+ * Sets up every counter the machine can give, as a perf event if possible and as a software
+ * count if not. Counting doesn't begin until start is called.
+ */
+void PerfCounters::open() {
+    this->close();
+    for(int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        this->events[c] = this->openEvent(c);
+        if(this->events[c] >= 0) {
+            this->source[c] = PERF_SOURCE_EVENT;
+        } else if(this->softwareCount(c) >= 0) {
+            this->source[c] = PERF_SOURCE_SOFTWARE;
+        } else {
+            this->source[c] = PERF_SOURCE_NONE;
+        }
+    }
+}
+
+/**
+ * Releases the perf events
+ */
+void PerfCounters::close() {
+    for(int c = 0; c < PERF_COUNTER_COUNT; c++) {
+#ifdef __linux__
+        if(this->events[c] >= 0) {
+            ::close(this->events[c]);
+        }
+#endif
+        this->events[c] = -1;
+        this->source[c] = PERF_SOURCE_NONE;
+    }
+
+    this->running = false;
+}
+
+/**
+ * Starts counting from zero
+ */
+void PerfCounters::start() {
+    for(int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        if(this->source[c] == PERF_SOURCE_SOFTWARE) {
+            this->startCount[c] = this->softwareCount(c);
+        }
+    }
+
+#ifdef __linux__
+    for(int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        if(this->events[c] >= 0) {
+            ioctl(this->events[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(this->events[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+
+    this->startTime = platformNanoseconds();
+    this->running = true;
+}
+
+/**
+ * Stops counting, and takes the reading returned by getReading
+ */
+void PerfCounters::stop() {
+    if(!this->running) {
+        return;
+    }
+
+    long long now = platformNanoseconds();
+    PerfReading* r = &this->reading;
+
+#ifdef __linux__
+    for(int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        if(this->events[c] >= 0) {
+            ioctl(this->events[c], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+#endif
+
+    for(int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        r->source[c] = this->source[c];
+        r->value[c] = -1;
+        r->coverage[c] = 0.0;
+
+        if(this->source[c] == PERF_SOURCE_SOFTWARE) {
+            r->value[c] = this->softwareCount(c) - this->startCount[c];
+            r->coverage[c] = 1.0;
+        }
+
+#ifdef __linux__
+        // With PERF_FORMAT_TOTAL_TIME_ENABLED and _RUNNING, the count is followed by
+        // how long the event was enabled, and how long it was actually counting
+        unsigned long long values[3];
+        if(this->source[c] == PERF_SOURCE_EVENT && ::read(this->events[c], values, sizeof(values)) == (ssize_t)sizeof(values) && values[2] > 0) {
+            r->coverage[c] = (double)values[2] / values[1];
+            r->value[c] = (long long)(values[0] / r->coverage[c]);
+        }
+#endif
+    }
+
+    r->seconds = (now - this->startTime) * 1e-9;
+    if(!platformMemoryUsage(&r->residentBytes, &r->peakResidentBytes)) {
+        r->residentBytes = -1;
+        r->peakResidentBytes = -1;
+    }
+
+    this->running = false;
+}
+
+PerfReading PerfCounters::getReading() {
+    return this->reading;
+}
+
+/**
+ * Prints the reading, with each count divided by the number of 'operations' made while
+ * counting (e.g. iterations of the simulation), which are called 'operationName'
+ */
+void PerfCounters::print(FILE* out, long long operations, const char* operationName) {
+    PerfReading* r = &this->reading;
+    fprintf(out, "Performance counters over %.3f seconds, %lld %ss:\n", r->seconds, operations, operationName);
+    for(int c = 0; c < PERF_COUNTER_COUNT; c++) {
+        if(r->source[c] == PERF_SOURCE_NONE || r->value[c] < 0) {
+            fprintf(out, "  %-18s %16s\n", PerfCounters::counterName(c), "not available");
+            continue;
+        }
+
+        fprintf(out, "  %-18s %16lld %12.3f per %s   (%s", PerfCounters::counterName(c), r->value[c],
+                (double)r->value[c] / (operations > 0 ? operations : 1), operationName,
+                r->source[c] == PERF_SOURCE_EVENT ? "perf event" : (c == PERF_CYCLES ? "time stamp counter" : "software count"));
+        if(r->source[c] == PERF_SOURCE_EVENT && r->coverage[c] < 1.0) {
+            fprintf(out, ", counted %.0f%% of the time", r->coverage[c] * 100.0);
+        }
+        fprintf(out, ")\n");
+    }
+
+    if(r->source[PERF_CYCLES] != PERF_SOURCE_NONE && r->source[PERF_INSTRUCTIONS] == PERF_SOURCE_EVENT && r->value[PERF_CYCLES] > 0) {
+        fprintf(out, "  %-18s %16.3f\n", "instructions/cycle", (double)r->value[PERF_INSTRUCTIONS] / r->value[PERF_CYCLES]);
+    }
+
+    if(r->residentBytes >= 0) {
+        fprintf(out, "  %-18s %16lld bytes (peak %lld bytes)\n", "resident memory", r->residentBytes, r->peakResidentBytes);
+    }
+}
+
+const char* PerfCounters::counterName(int counter) {
+    static const char* names[] = { "cycles", "instructions", "cache misses", "dTLB load misses", "page faults", "context switches" };
+    return counter >= 0 && counter < PERF_COUNTER_COUNT ? names[counter] : "unknown";
+}
+
+/**
+ * Opens a (disabled) perf event for 'counter', counting this process on whichever processor
+ * it runs. Returns the event's file descriptor, or -1 if the event can't be counted here.
+ */
+int PerfCounters::openEvent(int counter) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    switch(counter) {
+        case PERF_CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_CACHE_MISSES:
+            // Generally misses in the last level cache
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case PERF_DTLB_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_PAGE_FAULTS:
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+            break;
+        case PERF_CONTEXT_SWITCHES:
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+            break;
+        default:
+            return -1;
+    }
+
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if(fd < 0 && (errno == EACCES || errno == EPERM)) {
+        // Counting the kernel as well needs perf_event_paranoid below 2 (or CAP_PERFMON)
+        attr.exclude_kernel = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    return fd < 0 ? -1 : fd;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Returns the software count standing in for 'counter' (to be differenced between start and
+ * stop), or -1 if there is none.
+ */
+long long PerfCounters::softwareCount(int counter) {
+    long long pageFaults;
+    long long contextSwitches;
+    switch(counter) {
+        case PERF_CYCLES:
+            return (long long)platformCycles();
+        case PERF_PAGE_FAULTS:
+            platformProcessCounts(&pageFaults, &contextSwitches);
+            return pageFaults;
+        case PERF_CONTEXT_SWITCHES:
+            platformProcessCounts(&pageFaults, &contextSwitches);
+            return contextSwitches;
+        default:
+            return -1;
+    }
+}
@@ -0,0 +1,95 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Performance Counters
+//
+//   Description:  Counts what a stretch of code costs the processor - cycles,
+//                 instructions, cache and dTLB misses - using the hardware
+//                 counters (perf_event_open on Linux), along with page faults,
+//                 context switches and resident memory. Counters the machine
+//                 can't provide fall back to software counts where there are
+//                 any, so allocators can be compared on more than wall time.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __PERFCOUNTERS_H__
+#define __PERFCOUNTERS_H__
+
+#include <stdio.h>
+
+#include "platform.h"
+
+// The counters kept, in the order they are reported
+enum PerfCounter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_PAGE_FAULTS,
+    PERF_CONTEXT_SWITCHES,
+    PERF_COUNTER_COUNT
+};
+
+// Where a counter's value came from
+enum PerfSource {
+    // Not available on this machine (e.g. no PMU in a virtual machine, or
+    // perf_event_paranoid forbids it)
+    PERF_SOURCE_NONE,
+
+    // A perf event, counting only this process (user and, if allowed, kernel)
+    PERF_SOURCE_EVENT,
+
+    // Worked out by the process itself: the time stamp counter for cycles,
+    // and the operating system's counts for page faults and context switches
+    PERF_SOURCE_SOFTWARE
+};
+
+// The counts between a start and a stop
+typedef struct PerfReading {
+    long long value[PERF_COUNTER_COUNT];
+    PerfSource source[PERF_COUNTER_COUNT];
+
+    // Perf events multiplexed on to too few hardware counters are only
+    // counted part of the time, and scaled up; 1.0 means counted throughout
+    double coverage[PERF_COUNTER_COUNT];
+
+    double seconds;
+
+    // Resident memory at the stop, and the peak up to then; -1 if unknown
+    long long residentBytes;
+    long long peakResidentBytes;
+} PerfReading;
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class PerfCounters {
+    // Perf event file descriptors, -1 for counters not counted that way
+    int events[PERF_COUNTER_COUNT];
+    PerfSource source[PERF_COUNTER_COUNT];
+
+    // Software counts (and the time) when start was called, and the reading made by stop
+    long long startCount[PERF_COUNTER_COUNT];
+    long long startTime;
+    PerfReading reading;
+    bool running;
+public:
+    PerfCounters();
+    ~PerfCounters();
+
+    void open();
+    void close();
+
+    void start();
+    void stop();
+
+    PerfReading getReading();
+    void print(FILE* out, long long operations, const char* operationName);
+
+    static const char* counterName(int counter);
+protected:
+    int openEvent(int counter);
+    long long softwareCount(int counter);
+};
+
+
+#endif
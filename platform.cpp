@@ -0,0 +1,679 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Platform Layer
+//
+//   Description:  Win32 and POSIX implementations of the functions declared
+//                 in platform.h
+//
+//   References:
+//
+//     https://docs.microsoft.com/en-us/windows/win32/memory/creating-named-shared-memory
+//     https://man7.org/linux/man-pages/man3/shm_open.3.html
+//     https://man7.org/linux/man-pages/man2/memfd_create.2.html
+//     https://docs.microsoft.com/en-us/windows/win32/memory/creating-a-file-mapping-object
+//     https://docs.microsoft.com/en-us/windows/win32/memory/allocating-memory-from-a-numa-node
+//     https://man7.org/linux/man-pages/man2/mbind.2.html
+//     https://man7.org/linux/man-pages/man2/madvise.2.html
+//     https://man7.org/linux/man-pages/man7/unix.7.html
+//     https://devblogs.microsoft.com/commandline/af_unix-comes-to-windows/
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#ifdef _WIN32
+    // The NUMA and processor number functions need Windows 7 or later
+    #ifndef _WIN32_WINNT
+        #define _WIN32_WINNT 0x0601
+    #endif
+
+    // winsock2.h has to come before windows.h (which platform.h includes)
+    #include <winsock2.h>
+    #include <afunix.h>
+
+    // Version 2 maps GetProcessMemoryInfo to K32GetProcessMemoryInfo, in kernel32,
+    // so there's no psapi library to link
+    #define PSAPI_VERSION 2
+    #include <psapi.h>
+#endif
+
+#include "platform.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <sched.h>
+    #include <unistd.h>
+    #include <dirent.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/syscall.h>
+    #include <linux/mempolicy.h>
+    #include <poll.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <sys/resource.h>
+    #include <time.h>
+    #include <execinfo.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+    #include <intrin.h>
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////
+
+#ifdef _WIN32
+
+bool platformMapShared(const char* name, long long size, PlatformMapping* mapping) {
+    // Passing INVALID_HANDLE_VALUE backs the mapping with the system paging file
+    // rather than a file on disk. A NULL name gives an unnamed (anonymous) object.
+    HANDLE handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                       (DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xFFFFFFFF), name);
+    if(handle == NULL) {
+        return false;
+    }
+
+    // If the object already existed we have simply opened it, and the size
+    // we asked for is ignored by the system
+    bool created = GetLastError() != ERROR_ALREADY_EXISTS;
+    void* address = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if(address == NULL) {
+        CloseHandle(handle);
+        return false;
+    }
+
+    MEMORY_BASIC_INFORMATION info;
+    VirtualQuery(address, &info, sizeof(info));
+
+    mapping->address = address;
+    mapping->size = (long long)info.RegionSize;
+    mapping->created = created;
+    mapping->handle = handle;
+    mapping->file = INVALID_HANDLE_VALUE;
+    return true;
+}
+
+bool platformMapFile(const char* path, long long size, PlatformMapping* mapping) {
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    // An existing but empty file is treated the same as one we just created
+    LARGE_INTEGER existingSize;
+    GetFileSizeEx(file, &existingSize);
+    bool created = existingSize.QuadPart == 0;
+    if(!created) {
+        size = existingSize.QuadPart;
+    }
+
+    // Mapping a larger size than the file grows the file to match
+    HANDLE handle = CreateFileMappingA(file, NULL, PAGE_READWRITE,
+                                       (DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xFFFFFFFF), NULL);
+    if(handle == NULL) {
+        CloseHandle(file);
+        return false;
+    }
+
+    void* address = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if(address == NULL) {
+        CloseHandle(handle);
+        CloseHandle(file);
+        return false;
+    }
+
+    mapping->address = address;
+    mapping->size = size;
+    mapping->created = created;
+    mapping->handle = handle;
+    mapping->file = file;
+    return true;
+}
+
+void platformFlush(PlatformMapping* mapping) {
+    FlushViewOfFile(mapping->address, 0);
+    if(mapping->file != INVALID_HANDLE_VALUE) {
+        FlushFileBuffers(mapping->file);
+    }
+}
+
+void platformUnmap(PlatformMapping* mapping) {
+    if(mapping->address != NULL) {
+        UnmapViewOfFile(mapping->address);
+        CloseHandle(mapping->handle);
+        if(mapping->file != INVALID_HANDLE_VALUE) {
+            CloseHandle(mapping->file);
+        }
+    }
+
+    mapping->address = NULL;
+    mapping->size = 0;
+}
+
+void platformUnlinkShared(const char* name) {
+    // Named mapping objects are reference counted by Windows, and disappear
+    // once the last handle has been closed. Nothing to do here.
+}
+
+int platformNumaNodeCount() {
+    ULONG highest = 0;
+    if(!GetNumaHighestNodeNumber(&highest)) {
+        return 1;
+    }
+
+    return (int)highest + 1;
+}
+
+int platformCurrentNumaNode() {
+    PROCESSOR_NUMBER processor;
+    USHORT node = 0;
+
+    GetCurrentProcessorNumberEx(&processor);
+    if(!GetNumaProcessorNodeEx(&processor, &node)) {
+        return 0;
+    }
+
+    return (int)node;
+}
+
+void* platformAllocOnNode(long long size, int node) {
+    void* address = VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE, node);
+    if(address == NULL) {
+        // Most likely the node doesn't exist; fall back to memory from anywhere
+        address = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    }
+
+    return address;
+}
+
+void* platformAllocPages(long long size) {
+    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+void platformFreeRegion(void* address, long long size) {
+    VirtualFree(address, 0, MEM_RELEASE);
+}
+
+bool platformPurge(void* address, long long size) {
+    // MEM_RESET keeps the pages committed, but lets the system drop them rather than write them to the paging file.
+    // Pages that haven't been dropped yet keep their old contents.
+    VirtualAlloc(address, size, MEM_RESET, PAGE_READWRITE);
+    return false;
+}
+
+bool platformPrefault(void* address, long long size) {
+    // PrefetchVirtualMemory only reads pages in from disk; committed pages that have never
+    // been touched are only made real by touching them
+    return false;
+}
+
+PlatformSocket platformListenLocal(const char* path) {
+    static bool started = false;
+    if(!started) {
+        WSADATA data;
+        if(WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+            return PLATFORM_NO_SOCKET;
+        }
+
+        started = true;
+    }
+
+    struct sockaddr_un address;
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        return PLATFORM_NO_SOCKET;
+    }
+
+    SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener == INVALID_SOCKET) {
+        return PLATFORM_NO_SOCKET;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    DeleteFileA(path);
+    if(bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 8) != 0) {
+        closesocket(listener);
+        return PLATFORM_NO_SOCKET;
+    }
+
+    return (PlatformSocket)listener;
+}
+
+PlatformSocket platformAcceptLocal(PlatformSocket listener, int timeoutMs) {
+    WSAPOLLFD poller = { (SOCKET)listener, POLLRDNORM, 0 };
+    if(WSAPoll(&poller, 1, timeoutMs) <= 0) {
+        return PLATFORM_NO_SOCKET;
+    }
+
+    SOCKET client = accept((SOCKET)listener, NULL, NULL);
+    return client == INVALID_SOCKET ? PLATFORM_NO_SOCKET : (PlatformSocket)client;
+}
+
+int platformReceive(PlatformSocket socket, char* buffer, int size, int timeoutMs) {
+    WSAPOLLFD poller = { (SOCKET)socket, POLLRDNORM, 0 };
+    if(WSAPoll(&poller, 1, timeoutMs) <= 0) {
+        return 0;
+    }
+
+    int received = recv((SOCKET)socket, buffer, size, 0);
+    return received > 0 ? received : 0;
+}
+
+bool platformSendAll(PlatformSocket socket, const char* data, long long size) {
+    while(size > 0) {
+        int sent = send((SOCKET)socket, data, size < INT_MAX ? (int)size : INT_MAX, 0);
+        if(sent <= 0) {
+            return false;
+        }
+
+        data += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+void platformCloseSocket(PlatformSocket socket) {
+    closesocket((SOCKET)socket);
+}
+
+void platformUnlinkLocal(const char* path) {
+    DeleteFileA(path);
+}
+
+long long platformNanoseconds() {
+    static LARGE_INTEGER frequency;
+    if(frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    // Split in to whole seconds and the rest, so the multiplication can't overflow
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart / frequency.QuadPart * 1000000000LL + now.QuadPart % frequency.QuadPart * 1000000000LL / frequency.QuadPart;
+}
+
+bool platformMemoryUsage(long long* resident, long long* peakResident) {
+    PROCESS_MEMORY_COUNTERS counters;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return false;
+    }
+
+    *resident = counters.WorkingSetSize;
+    *peakResident = counters.PeakWorkingSetSize;
+    return true;
+}
+
+void platformProcessCounts(long long* pageFaults, long long* contextSwitches) {
+    // Windows counts soft faults (e.g. first touches of committed pages) as page faults too
+    PROCESS_MEMORY_COUNTERS counters;
+    *pageFaults = GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.PageFaultCount : -1;
+    *contextSwitches = -1;
+}
+
+int platformBacktrace(void** frames, int maxFrames, int skip) {
+    // CaptureStackBackTrace can't take more than 62 frames (and skipped ones count)
+    int wanted = maxFrames + skip + 1 < 62 ? maxFrames : 62 - skip - 1;
+    return wanted > 0 ? CaptureStackBackTrace(skip + 1, wanted, frames, NULL) : 0;
+}
+
+bool platformWriteModules(FILE* out) {
+    HMODULE modules[1024];
+    DWORD needed;
+    HANDLE process = GetCurrentProcess();
+    if(!EnumProcessModules(process, modules, sizeof(modules), &needed)) {
+        return false;
+    }
+
+    int count = needed / sizeof(HMODULE) < 1024 ? needed / sizeof(HMODULE) : 1024;
+    for(int m = 0; m < count; m++) {
+        MODULEINFO info;
+        char path[MAX_PATH];
+        if(!GetModuleInformation(process, modules[m], &info, sizeof(info)) || GetModuleFileNameA(modules[m], path, sizeof(path)) == 0) {
+            continue;
+        }
+
+        unsigned long long start = (unsigned long long)(uintptr_t)info.lpBaseOfDll;
+        fprintf(out, "%llx-%llx r-xp 00000000 00:00 0 %s\n", start, start + info.SizeOfImage, path);
+    }
+
+    return true;
+}
+
+#else
+
+bool platformMapShared(const char* name, long long size, PlatformMapping* mapping) {
+    int fd;
+    bool created = true;
+
+    if(name == NULL) {
+        // Anonymous object, only reachable by this process and its children
+        fd = memfd_create("buddysystem", 0);
+    } else {
+        // POSIX shared memory names must start with a single slash
+        char path[256];
+        snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+
+        // Try to be the creator first; if somebody else beat us to it just open it
+        fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if(fd < 0 && errno == EEXIST) {
+            created = false;
+            fd = shm_open(path, O_RDWR, 0600);
+        }
+    }
+
+    if(fd < 0) {
+        return false;
+    }
+
+    if(created) {
+        if(ftruncate(fd, size) != 0) {
+            close(fd);
+            return false;
+        }
+    } else {
+        // Use the size chosen by the creator of the object. The creator may
+        // not have sized it yet (shm_open and ftruncate are separate calls),
+        // so wait until it has.
+        struct stat st;
+        do {
+            if(fstat(fd, &st) != 0) {
+                close(fd);
+                return false;
+            }
+        } while(st.st_size == 0 && sched_yield() == 0);
+
+        size = st.st_size;
+    }
+
+    void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(address == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    mapping->address = address;
+    mapping->size = size;
+    mapping->created = created;
+    mapping->fd = fd;
+    return true;
+}
+
+bool platformMapFile(const char* path, long long size, PlatformMapping* mapping) {
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(fd < 0) {
+        return false;
+    }
+
+    // An existing but empty file is treated the same as one we just created
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    bool created = st.st_size == 0;
+    if(created) {
+        if(ftruncate(fd, size) != 0) {
+            close(fd);
+            return false;
+        }
+    } else {
+        size = st.st_size;
+    }
+
+    void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(address == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    mapping->address = address;
+    mapping->size = size;
+    mapping->created = created;
+    mapping->fd = fd;
+    return true;
+}
+
+void platformFlush(PlatformMapping* mapping) {
+    msync(mapping->address, mapping->size, MS_SYNC);
+}
+
+void platformUnmap(PlatformMapping* mapping) {
+    if(mapping->address != NULL) {
+        munmap(mapping->address, mapping->size);
+        close(mapping->fd);
+    }
+
+    mapping->address = NULL;
+    mapping->size = 0;
+}
+
+void platformUnlinkShared(const char* name) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    shm_unlink(path);
+}
+
+int platformNumaNodeCount() {
+    // Each online node has a nodeN directory in sysfs; machines (or kernels)
+    // without NUMA support have none, or only node0.
+    DIR* dir = opendir("/sys/devices/system/node");
+    if(dir == NULL) {
+        return 1;
+    }
+
+    int count = 0;
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            count++;
+        }
+    }
+
+    closedir(dir);
+    return count > 0 ? count : 1;
+}
+
+int platformCurrentNumaNode() {
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return 0;
+    }
+
+    return (int)node;
+}
+
+void* platformAllocOnNode(long long size, int node) {
+    void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(address == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Bind the (not yet faulted in) pages to the node. This is called directly
+    // via syscall so we don't need to link against libnuma. Failure just means
+    // the pages get the default policy instead.
+    unsigned long nodeMask[4] = { 0 };
+    if(node >= 0 && node < (int)(sizeof(nodeMask) * 8)) {
+        nodeMask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+        syscall(SYS_mbind, address, (unsigned long)size, MPOL_BIND, nodeMask, sizeof(nodeMask) * 8, 0);
+    }
+
+    return address;
+}
+
+void* platformAllocPages(long long size) {
+    void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return address == MAP_FAILED ? NULL : address;
+}
+
+void platformFreeRegion(void* address, long long size) {
+    munmap(address, size);
+}
+
+bool platformPurge(void* address, long long size) {
+    // Private anonymous pages come back zero filled after MADV_DONTNEED
+    return madvise(address, size, MADV_DONTNEED) == 0;
+}
+
+bool platformPrefault(void* address, long long size) {
+    // Older kernels (and headers) don't know MADV_POPULATE_WRITE, and fail it with EINVAL
+    #ifndef MADV_POPULATE_WRITE
+        #define MADV_POPULATE_WRITE 23
+    #endif
+    return madvise(address, size, MADV_POPULATE_WRITE) == 0;
+}
+
+PlatformSocket platformListenLocal(const char* path) {
+    struct sockaddr_un address;
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        return PLATFORM_NO_SOCKET;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listener < 0) {
+        return PLATFORM_NO_SOCKET;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if(bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 8) != 0) {
+        close(listener);
+        return PLATFORM_NO_SOCKET;
+    }
+
+    return listener;
+}
+
+PlatformSocket platformAcceptLocal(PlatformSocket listener, int timeoutMs) {
+    struct pollfd poller = { (int)listener, POLLIN, 0 };
+    if(poll(&poller, 1, timeoutMs) <= 0) {
+        return PLATFORM_NO_SOCKET;
+    }
+
+    int client = accept4((int)listener, NULL, NULL, SOCK_CLOEXEC);
+    return client < 0 ? PLATFORM_NO_SOCKET : client;
+}
+
+int platformReceive(PlatformSocket socket, char* buffer, int size, int timeoutMs) {
+    struct pollfd poller = { (int)socket, POLLIN, 0 };
+    if(poll(&poller, 1, timeoutMs) <= 0) {
+        return 0;
+    }
+
+    ssize_t received = recv((int)socket, buffer, size, 0);
+    return received > 0 ? (int)received : 0;
+}
+
+bool platformSendAll(PlatformSocket socket, const char* data, long long size) {
+    while(size > 0) {
+        // MSG_NOSIGNAL, so a client hanging up early doesn't kill the process with SIGPIPE
+        ssize_t sent = send((int)socket, data, size, MSG_NOSIGNAL);
+        if(sent <= 0) {
+            return false;
+        }
+
+        data += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+void platformCloseSocket(PlatformSocket socket) {
+    close((int)socket);
+}
+
+void platformUnlinkLocal(const char* path) {
+    unlink(path);
+}
+
+long long platformNanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+bool platformMemoryUsage(long long* resident, long long* peakResident) {
+    // VmRSS and VmHWM (the "high water mark") are given in kB
+    FILE* status = fopen("/proc/self/status", "r");
+    if(status == NULL) {
+        return false;
+    }
+
+    int found = 0;
+    char line[256];
+    while(found < 2 && fgets(line, sizeof(line), status) != NULL) {
+        if(strncmp(line, "VmRSS:", 6) == 0) {
+            *resident = atoll(line + 6) * 1024;
+            found++;
+        } else if(strncmp(line, "VmHWM:", 6) == 0) {
+            *peakResident = atoll(line + 6) * 1024;
+            found++;
+        }
+    }
+
+    fclose(status);
+    return found == 2;
+}
+
+void platformProcessCounts(long long* pageFaults, long long* contextSwitches) {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {
+        *pageFaults = -1;
+        *contextSwitches = -1;
+        return;
+    }
+
+    *pageFaults = usage.ru_minflt + usage.ru_majflt;
+    *contextSwitches = usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+int platformBacktrace(void** frames, int maxFrames, int skip) {
+    // backtrace includes this function's own frame, which is dropped along with the skipped ones
+    void* all[256];
+    int wanted = maxFrames + skip + 1 < 256 ? maxFrames + skip + 1 : 256;
+    int count = backtrace(all, wanted) - skip - 1;
+    if(count <= 0) {
+        return 0;
+    }
+
+    memcpy(frames, all + skip + 1, count * sizeof(void*));
+    return count;
+}
+
+bool platformWriteModules(FILE* out) {
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if(maps == NULL) {
+        return false;
+    }
+
+    char buffer[4096];
+    size_t read;
+    while((read = fread(buffer, 1, sizeof(buffer), maps)) > 0) {
+        fwrite(buffer, 1, read, out);
+    }
+
+    fclose(maps);
+    return true;
+}
+
+#endif
+
+unsigned long long platformCycles() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return platformNanoseconds();
+#endif
+}
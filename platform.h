@@ -0,0 +1,151 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Platform Layer
+//
+//   Description:  Thin wrappers around the operating system calls used by the
+//                 buddy system that are not already covered by auxiliary.cpp
+//                 (shared memory mappings and similar). Each function has a
+//                 Win32 implementation and a POSIX (Linux) implementation,
+//                 selected by the _WIN32 preprocessor define.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __PLATFORM_H__
+#define __PLATFORM_H__
+
+#include <stdio.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#endif
+
+// Describes a mapping of memory that may be visible to more than one process.
+// 'created' is true when this process created the backing object, and false
+// when an existing object was opened (e.g. another worker got there first).
+typedef struct PlatformMapping {
+    void* address;
+    long long size;
+    bool created;
+
+#ifdef _WIN32
+    HANDLE handle;
+
+    // The file backing the mapping, or INVALID_HANDLE_VALUE if backed by the paging file
+    HANDLE file;
+#else
+    int fd;
+#endif
+} PlatformMapping;
+
+// Creates (or opens, if it already exists) a named shared memory object of at
+// least 'size' bytes and maps it in to this process. When 'name' is NULL an
+// anonymous shared mapping is created instead, which is inherited by child
+// processes. Returns false if the mapping could not be established.
+bool platformMapShared(const char* name, long long size, PlatformMapping* mapping);
+
+// Opens (creating it if it does not exist) the file at 'path' and maps it in
+// to this process, so that changes to the memory are written back to the file.
+// A newly created file is sized to 'size' bytes, and 'created' is set; an
+// existing file is mapped at its current size.
+bool platformMapFile(const char* path, long long size, PlatformMapping* mapping);
+
+// Writes any modified pages of the mapping back to its backing file.
+void platformFlush(PlatformMapping* mapping);
+
+// Unmaps a mapping previously established by this layer and closes the
+// underlying handle. The backing object itself is left alone.
+void platformUnmap(PlatformMapping* mapping);
+
+// Removes the name of a shared memory object so that no further processes
+// can open it; existing mappings stay valid until they are unmapped.
+void platformUnlinkShared(const char* name);
+
+// Returns the number of NUMA nodes in the machine; 1 if the machine
+// (or operating system) does not support NUMA.
+int platformNumaNodeCount();
+
+// Returns the NUMA node of the processor the calling thread is running on.
+int platformCurrentNumaNode();
+
+// Reserves and commits 'size' bytes of memory whose physical pages are
+// bound to NUMA node 'node'. If the binding cannot be applied (e.g. the node
+// does not exist) the memory is still returned, just without the binding.
+// Returns NULL if no memory could be allocated at all.
+void* platformAllocOnNode(long long size, int node);
+
+// Reserves and commits 'size' bytes of private, page aligned memory, with no
+// NUMA binding. Returns NULL if the memory could not be allocated.
+void* platformAllocPages(long long size);
+
+// Releases memory returned by platformAllocOnNode or platformAllocPages.
+void platformFreeRegion(void* address, long long size);
+
+// Tells the operating system the contents of 'size' bytes of private memory at
+// 'address' (both page aligned) are no longer needed, so the physical pages
+// can be reclaimed. The range stays mapped and usable. Returns true if it will
+// read back as zero the next time it is touched (as on Linux), and false if its
+// contents are undefined.
+bool platformPurge(void* address, long long size);
+
+// Faults in (for writing) the pages of 'size' bytes of memory at 'address'
+// (both page aligned), without changing their contents, so they won't fault
+// when first used: MADV_POPULATE_WRITE on Linux 5.14 and up. Returns false if
+// the operating system can't do this, in which case the caller touches them.
+bool platformPrefault(void* address, long long size);
+
+// A socket: a SOCKET on Windows, and a file descriptor elsewhere.
+typedef long long PlatformSocket;
+#define PLATFORM_NO_SOCKET -1
+
+// Creates a stream socket listening on the local (Unix domain) socket at
+// 'path', replacing any socket file left there by an earlier process. Windows
+// has these too, from Windows 10 1803. Returns PLATFORM_NO_SOCKET on failure.
+PlatformSocket platformListenLocal(const char* path);
+
+// Waits up to 'timeoutMs' milliseconds for a connection to a listening socket.
+// Returns PLATFORM_NO_SOCKET if nobody connected in that time.
+PlatformSocket platformAcceptLocal(PlatformSocket listener, int timeoutMs);
+
+// Receives up to 'size' bytes, waiting up to 'timeoutMs' milliseconds for them.
+// Returns the number received; 0 if none arrived in time, or the peer closed.
+int platformReceive(PlatformSocket socket, char* buffer, int size, int timeoutMs);
+
+// Sends all 'size' bytes of 'data'. Returns false if the peer went away first.
+bool platformSendAll(PlatformSocket socket, const char* data, long long size);
+
+// Closes a socket from any of the functions above.
+void platformCloseSocket(PlatformSocket socket);
+
+// Removes the socket file of a local socket, once it is no longer listening.
+void platformUnlinkLocal(const char* path);
+
+// Returns a monotonic clock reading in nanoseconds (QueryPerformanceCounter on
+// Windows, clock_gettime elsewhere), for timing a stretch of code.
+long long platformNanoseconds();
+
+// Returns the processor's time stamp counter (rdtsc) on x86, which ticks at a
+// fixed rate near the nominal clock speed whatever the core is running at. On
+// other processors it is platformNanoseconds.
+unsigned long long platformCycles();
+
+// Fills in the resident set size of this process, and its peak, in bytes.
+// Returns false if the operating system didn't say.
+bool platformMemoryUsage(long long* resident, long long* peakResident);
+
+// Fills in the page faults (minor and major) and context switches of this
+// process so far; -1 for a count the operating system doesn't keep.
+void platformProcessCounts(long long* pageFaults, long long* contextSwitches);
+
+// Fills 'frames' with up to 'maxFrames' return addresses of the calling
+// thread's stack, innermost first, leaving out this function and the 'skip'
+// frames above it. Returns the number of frames filled in.
+int platformBacktrace(void** frames, int maxFrames, int skip);
+
+// Writes the executable and libraries mapped in to this process to 'out', one
+// per line, in the format of /proc/self/maps (which on Linux is copied as it
+// is), so that the addresses of a backtrace can be symbolised later. Returns
+// false if they couldn't be listed.
+bool platformWriteModules(FILE* out);
+
+#endif
@@ -0,0 +1,260 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Buddy Purger
+//
+//   Description:  A background thread that hands the pages of large free blocks
+//                 back to the operating system once they have gone unused for a
+//                 while, so a heap that was once busy doesn't keep its peak
+//                 memory use forever.
+//
+// Notes:
+// * Time is kept in epochs: the purger advances the heap's purgeEpoch once per
+//   pass, and insertToFree stamps every block of at least the purge order with
+//   the epoch it was freed in. That stamp lives in the Node header, so keeping
+//   it costs the allocator a compare and two stores - no clock reads, and no
+//   extra work for blocks below the purge order.
+// * The purger never makes the allocator wait for its scan: if the heap lock
+//   is taken it skips the pass. Blocks to purge are taken out of the free list
+//   (and marked allocated so their buddies don't merge with them) and the lock
+//   is dropped while the system call runs. They are then put back just as free
+//   would put them back, coalescing included.
+// * The first page of a block is never purged, as the Node (and its links) is
+//   kept there. Only blocks of at least two pages are worth purging, and the
+//   heap must start on a page boundary so that its larger blocks do too.
+// * A purged block that is split, merged or allocated is simply in use again;
+//   the system brings the pages back (zeroed on Linux) as they are touched.
+//   Where they come back zeroed, the block's dirty order is lowered to its
+//   first page, so calloc doesn't clear the rest again.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <stdexcept>
+
+#include "purger.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+BuddyPurger::BuddyPurger() {
+    this->heap = NULL;
+    this->running = false;
+}
+
+BuddyPurger::~BuddyPurger() {
+    this->stop();
+}
+
+/**
+ * Starts purging free blocks of 'heap' of at least order 'minimumOrder' that have sat in the
+ * free list for 'decayMs' milliseconds or more. The heap is checked every 'intervalMs'
+ * milliseconds (so the decay is rounded to a whole number of intervals).
+ *
+ * The heap is made thread safe, as it is now shared with the purger thread. Only private
+ * heaps can be purged; shared and persistent heaps keep their pages in a shared object.
+ */
+void BuddyPurger::start(BuddySystem* heap, int minimumOrder, int decayMs, int intervalMs) {
+    if(this->running) {
+        throw std::logic_error("BuddyPurger::start has failed - the purger is already running!");
+    }
+
+    if(heap->shared || heap->persistent || (heap->baseMemoryAddress % PAGESIZE) != 0) {
+        throw std::logic_error("BuddyPurger::start has failed - only private, page aligned heaps can be purged!");
+    }
+
+    // Below two pages there would be nothing left to purge once the header's page is kept
+    int pageOrder = (int)std::log2(PAGESIZE);
+    if(minimumOrder <= pageOrder) {
+        minimumOrder = pageOrder + 1;
+    }
+
+    this->heap = heap;
+    this->intervalMs = intervalMs > 0 ? intervalMs : 1;
+    this->decayEpochs = decayMs / this->intervalMs > 0 ? decayMs / this->intervalMs : 1;
+    this->started = std::chrono::steady_clock::now();
+    this->stats = PurgeStats();
+    this->historyCount = 0;
+
+    heap->setThreadSafe(true);
+    heap->acquireLock();
+
+    // Blocks already free were never stamped; count them as freed now
+    unsigned int epoch = heap->purgeEpoch.load(std::memory_order_relaxed);
+    for(int k = minimumOrder; k <= heap->upperK; k++) {
+        for(Node* n = heap->nodeAt(heap->header->freeList[k]); n != NULL; n = heap->nodeAt(n->next)) {
+            n->flags &= ~NODE_PURGED;
+            n->freedEpoch = epoch;
+        }
+    }
+
+    heap->purgeOrder = minimumOrder;
+    heap->releaseLock();
+
+    this->running = true;
+    this->thread = std::thread(&BuddyPurger::run, this);
+}
+
+/**
+ * Stops the purger thread, waiting for any pass in progress to finish. Purged blocks stay
+ * purged until they are used again.
+ */
+void BuddyPurger::stop() {
+    {
+        std::lock_guard<std::mutex> guard(this->wakeLock);
+        if(!this->running) {
+            return;
+        }
+
+        this->running = false;
+    }
+
+    this->wake.notify_all();
+    this->thread.join();
+
+    this->heap->acquireLock();
+    this->heap->purgeOrder = SIZE_OF_FREE_LIST;
+    this->heap->releaseLock();
+}
+
+PurgeStats BuddyPurger::getStats() {
+    std::lock_guard<std::mutex> guard(this->statsLock);
+    return this->stats;
+}
+
+/**
+ * Copies up to 'maxSamples' of the most recent passes in to 'samples', oldest first, and
+ * returns how many were copied. Only the last PURGE_HISTORY_SIZE passes are kept.
+ */
+int BuddyPurger::getHistory(PurgeSample* samples, int maxSamples) {
+    std::lock_guard<std::mutex> guard(this->statsLock);
+
+    int count = this->historyCount < maxSamples ? this->historyCount : maxSamples;
+    long long first = this->stats.passCount - count;
+    for(int i = 0; i < count; i++) {
+        samples[i] = this->history[(first + i) % PURGE_HISTORY_SIZE];
+    }
+
+    return count;
+}
+
+/**
+ * The purger thread: one pass every interval, until stopped.
+ */
+void BuddyPurger::run() {
+    std::unique_lock<std::mutex> guard(this->wakeLock);
+    while(this->running) {
+        this->wake.wait_for(guard, std::chrono::milliseconds(this->intervalMs));
+        if(!this->running) {
+            break;
+        }
+
+        guard.unlock();
+        this->purgePass();
+        guard.lock();
+    }
+}
+
+/**
+ * Advances the epoch, and purges up to PURGE_BATCH_SIZE blocks that have been free for at
+ * least decayEpochs. The largest blocks are looked at first, as they return the most memory
+ * for each system call.
+ */
+void BuddyPurger::purgePass() {
+    BuddySystem* heap = this->heap;
+    unsigned int epoch = heap->purgeEpoch.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    Node* batch[PURGE_BATCH_SIZE];
+    int batchCount = 0;
+    long long resident = 0;
+    bool busy = !heap->tryAcquireLock();
+
+    if(!busy) {
+        int scanned = 0;
+        for(int k = heap->upperK; k >= heap->purgeOrder && scanned < PURGE_SCAN_LIMIT; k--) {
+            Node* n = heap->nodeAt(heap->header->freeList[k]);
+            while(n != NULL && scanned < PURGE_SCAN_LIMIT) {
+                Node* next = heap->nodeAt(n->next);
+                scanned++;
+
+                // Unsigned subtraction, so the epoch wrapping around does no harm
+                bool purged = (n->flags & NODE_PURGED) != 0;
+                if(!purged && batchCount < PURGE_BATCH_SIZE && epoch - n->freedEpoch >= this->decayEpochs) {
+                    heap->ejectFromFree(n);
+                    n->alloc = 1;
+                    heap->countAllocated(n, 1);
+                    batch[batchCount++] = n;
+                } else if(!purged) {
+                    resident += 1LL << n->order;
+                }
+
+                n = next;
+            }
+        }
+
+        heap->releaseLock();
+    }
+
+    // Nobody else can touch these blocks now, so the (slow) system calls are made without the lock
+    long long bytes = 0;
+    bool zeroed[PURGE_BATCH_SIZE];
+    for(int i = 0; i < batchCount; i++) {
+        long long size = (1LL << batch[i]->order) - PAGESIZE;
+        zeroed[i] = platformPurge((void*)((uintptr_t)batch[i] + PAGESIZE), size);
+        bytes += size;
+    }
+
+    if(batchCount > 0) {
+        AsyncRequest* served = NULL;
+        int largestOrder = 0;
+
+        heap->acquireLock();
+        for(int i = 0; i < batchCount; i++) {
+            Node* node = batch[i];
+            heap->countAllocated(node, -1);
+            node->alloc = 0;
+            node->next = BUDDY_NULL_OFFSET;
+            node->previous = BUDDY_NULL_OFFSET;
+
+            // Only the first page (which holds the Node) can still be dirty, if the system zeroed the rest
+            int pageOrder = (int)std::log2(PAGESIZE);
+            if(zeroed[i] && node->dirtyOrder > pageOrder) {
+                node->dirtyOrder = pageOrder;
+            }
+
+            // As with free; a block that merges with its buddy is partly in use again, so only
+            // a block that goes back by itself is marked as purged
+            Node* block = node;
+            for(Node* coalesced = heap->coalesceFree(node); coalesced != NULL; coalesced = heap->coalesceFree(coalesced)) {
+                block = coalesced;
+            }
+
+            if(block == node) {
+                node->flags |= NODE_PURGED;
+            }
+
+            if(block->order > largestOrder) {
+                largestOrder = block->order;
+            }
+        }
+
+        // The blocks were out of the free list while being purged, so a request may be waiting on them
+        served = heap->serveWaiters(largestOrder);
+        heap->releaseLock();
+        heap->completeWaiters(served);
+    }
+
+    std::lock_guard<std::mutex> guard(this->statsLock);
+    this->stats.passCount++;
+    this->stats.busyCount += busy ? 1 : 0;
+    this->stats.purgeCount += batchCount;
+    this->stats.bytesPurged += bytes;
+
+    PurgeSample* sample = &this->history[(this->stats.passCount - 1) % PURGE_HISTORY_SIZE];
+    sample->timeMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - this->started).count();
+    sample->purgeCount = this->stats.purgeCount;
+    sample->bytesPurged = this->stats.bytesPurged;
+    sample->bytesResident = resident;
+    if(this->historyCount < PURGE_HISTORY_SIZE) {
+        this->historyCount++;
+    }
+}
@@ -0,0 +1,92 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Buddy Purger
+//
+//   Description:  A background thread that hands the pages of large free blocks
+//                 back to the operating system once they have gone unused for a
+//                 while, so a heap that was once busy doesn't keep its peak
+//                 memory use forever.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __PURGER_H__
+#define __PURGER_H__
+
+// Standard headers go first, as auxiliary.h defines macros (e.g. 'ms') that
+// would otherwise clash with names used inside them.
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "buddysys.h"
+
+// Most free blocks looked at (under the heap lock) in one pass
+#define PURGE_SCAN_LIMIT 256
+
+// Most blocks taken out of the free list to be purged in one pass
+#define PURGE_BATCH_SIZE 16
+
+// Number of passes kept in the purge history
+#define PURGE_HISTORY_SIZE 64
+
+// Totals since the purger was started
+typedef struct PurgeStats {
+    long long passCount;
+
+    // Passes skipped because the heap was busy at the time
+    long long busyCount;
+
+    long long purgeCount;
+    long long bytesPurged;
+} PurgeStats;
+
+// One entry of the history: the totals as they stood after a pass
+typedef struct PurgeSample {
+    // Milliseconds since the purger was started
+    long long timeMs;
+
+    long long purgeCount;
+    long long bytesPurged;
+
+    // Bytes of free blocks the purger is tracking that still hold their pages
+    long long bytesResident;
+} PurgeSample;
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class BuddyPurger {
+    BuddySystem* heap;
+
+    std::thread thread;
+    std::mutex wakeLock;
+    std::condition_variable wake;
+    bool running;
+
+    int intervalMs;
+    unsigned int decayEpochs;
+    std::chrono::steady_clock::time_point started;
+
+    // Written only by the purger thread; read by anyone under statsLock
+    std::mutex statsLock;
+    PurgeStats stats;
+    PurgeSample history[PURGE_HISTORY_SIZE];
+    int historyCount;
+public:
+    BuddyPurger();
+    ~BuddyPurger();
+
+    void start(BuddySystem* heap, int minimumOrder, int decayMs, int intervalMs);
+    void stop();
+
+    PurgeStats getStats();
+    int getHistory(PurgeSample* samples, int maxSamples);
+protected:
+    void run();
+    void purgePass();
+};
+
+
+#endif
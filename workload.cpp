@@ -0,0 +1,275 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Workloads
+//
+//   Description:  A library of request size and lifetime distributions, chosen
+//                 at run time, to drive the simulation in main.cpp and the
+//                 thread benchmarks in place of the compile time simulations
+//                 in auxiliary.cpp.
+//
+// Notes:
+// * A workload answers two questions each round, as myrand and randomsize do
+//   in main.cpp: which pointer to free and reallocate (nextSlot), and the size
+//   to allocate for it (nextSize). How often a slot is picked is how long its
+//   blocks live, so lifetimes are shaped by nextSlot.
+// * The simulations keep their own copy of the generator in auxiliary.cpp, so
+//   SIMULATION_2 with seed 7652 is the sequence main.cpp has always used, and
+//   several workloads can run at once (one per benchmark thread).
+// * The other workloads use a 64 bit xorshift generator, which is quick and
+//   has none of the short cycles of the simulations' generator.
+// * The workload can be picked on the command line, e.g.
+//     main.exe --workload=bimodal --seed=42 --live=4000 --iterations=500000
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workload.h"
+
+using namespace std;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+// Command line names of the workloads, in the order of WorkloadKind
+static const char* workloadNames[] = { "simulation1", "simulation2", "uniform", "exponential", "bimodal", "pow2", "lifetime" };
+
+#define WORKLOAD_COUNT ((int)(sizeof(workloadNames) / sizeof(workloadNames[0])))
+
+/**
+ * No workload can be drawn from until init is called
+ */
+Workload::Workload() {
+    this->config = defaultWorkloadConfig();
+    this->simulationSeed = 0;
+    this->state = 0;
+}
+
+/**
+ * Starts the workload's sequence from the config's seed. Sizes are clamped so that
+ * minSize <= meanSize <= maxSize.
+ */
+void Workload::init(WorkloadConfig config) {
+    if(config.livePointers < 1) {
+        config.livePointers = 1;
+    }
+
+    if(config.minSize < 1) {
+        config.minSize = 1;
+    }
+
+    if(config.maxSize < config.minSize) {
+        config.maxSize = config.minSize;
+    }
+
+    if(config.meanSize < config.minSize || config.meanSize > config.maxSize) {
+        config.meanSize = config.minSize + (config.maxSize - config.minSize) / 8;
+    }
+
+    this->config = config;
+    this->simulationSeed = config.seed;
+
+    // xorshift is stuck at 0, and nearby seeds should still give unrelated sequences
+    this->state = (config.seed + 1ULL) * 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+ * Returns the pointer to free (if it is allocated) and allocate again this round
+ */
+int Workload::nextSlot() {
+    int live = this->config.livePointers;
+    switch(this->config.kind) {
+        case WORKLOAD_SIMULATION_1:
+        case WORKLOAD_SIMULATION_2:
+            return this->nextSimulation() % live;
+        case WORKLOAD_LIFETIME: {
+            // Cubing skews the picks towards the low slots: slot 0 is picked hundreds of
+            // times as often as the last, so its blocks live for a fraction of the time
+            double u = this->nextUnit();
+            return (int)(u * u * u * live);
+        }
+        default:
+            return (int)(this->nextRandom() % live);
+    }
+}
+
+/**
+ * Returns the size to allocate for 'slot'. Only the lifetime workload ties the size to the
+ * slot; given no slot (-1), it draws one, so callers without slots get the same mix of sizes.
+ */
+int Workload::nextSize(int slot) {
+    WorkloadConfig* c = &this->config;
+    switch(c->kind) {
+        case WORKLOAD_SIMULATION_1: {
+            int k = this->nextSimulation();
+            int j = 1 << ((k & 3) + (k >> 2 & 3) + (k >> 4 & 3) + (k >> 6 & 3) + (k >> 8 & 3) + (k >> 10 & 3));
+            return (this->nextSimulation() % j) + 1;
+        }
+        case WORKLOAD_SIMULATION_2: {
+            int k = this->nextSimulation();
+            int j = 1 << ((k & 3) + (k >> 2 & 3) + (k >> 4 & 3) + (k >> 6 & 3) + (k >> 4 & 3) + (k >> 4 & 3));
+            return 500 + (this->nextSimulation() % (j << 5));
+        }
+        case WORKLOAD_UNIFORM:
+            return this->nextBetween(c->minSize, c->maxSize);
+        case WORKLOAD_EXPONENTIAL: {
+            double size = c->minSize - log(1.0 - this->nextUnit()) * (c->meanSize - c->minSize);
+            return size < c->maxSize ? (int)size : c->maxSize;
+        }
+        case WORKLOAD_BIMODAL:
+            if(this->nextRandom() % 10 != 0) {
+                return this->nextBetween(c->minSize, c->minSize * 4 < c->maxSize ? c->minSize * 4 : c->maxSize);
+            }
+            return this->nextBetween(c->maxSize / 2 > c->minSize ? c->maxSize / 2 : c->minSize, c->maxSize);
+        case WORKLOAD_POWER_OF_TWO: {
+            int low = (int)ceil(log2((double)c->minSize));
+            int high = (int)floor(log2((double)c->maxSize));
+            return 1 << (high > low ? this->nextBetween(low, high) : low);
+        }
+        case WORKLOAD_LIFETIME: {
+            if(slot < 0) {
+                slot = this->nextSlot();
+            }
+
+            // The rarely picked (long lived) slots at the top get the largest sizes, with some
+            // spread so that neighbouring slots don't all land in the same order
+            double rank = (double)slot / c->livePointers;
+            int size = c->minSize + (int)((c->maxSize - c->minSize) * rank * rank);
+            return this->nextBetween(size / 2 > c->minSize ? size / 2 : c->minSize, size);
+        }
+    }
+
+    throw std::logic_error("Workload::nextSize has failed - unknown workload!");
+}
+
+/**
+ * Returns true if blocks allocated for 'slot' can be expected to live a long time, for
+ * allocators that take a lifetime hint. Only the lifetime workload knows: its top half of
+ * slots get a fifth of the picks between them, so their blocks live the longest.
+ */
+bool Workload::isLongLived(int slot) {
+    return this->config.kind == WORKLOAD_LIFETIME && slot >= this->config.livePointers / 2;
+}
+
+const char* Workload::getName() {
+    return workloadNames[this->config.kind];
+}
+
+/**
+ * The generator from auxiliary.cpp's myrand, for the selected simulation
+ */
+unsigned int Workload::nextSimulation() {
+    if(this->config.kind == WORKLOAD_SIMULATION_1) {
+        this->simulationSeed = (this->simulationSeed * 2416 + 374441) % 1771875;
+    } else {
+        this->simulationSeed = (this->simulationSeed * 2416 + 374441) % 1095976;
+    }
+
+    return this->simulationSeed;
+}
+
+/**
+ * xorshift64*
+ */
+unsigned long long Workload::nextRandom() {
+    this->state ^= this->state >> 12;
+    this->state ^= this->state << 25;
+    this->state ^= this->state >> 27;
+    return this->state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Returns a number in [0, 1), from the top 53 bits of the generator
+ */
+double Workload::nextUnit() {
+    return (this->nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Returns a number in [low, high], every one equally likely
+ */
+int Workload::nextBetween(int low, int high) {
+    return low + (int)(this->nextRandom() % (unsigned long long)(high - low + 1));
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+WorkloadConfig defaultWorkloadConfig() {
+    WorkloadConfig config;
+#ifdef USE_SIMULATION_2
+    config.kind = WORKLOAD_SIMULATION_2;
+#else
+    config.kind = WORKLOAD_SIMULATION_1;
+#endif
+    config.seed = 7652;
+    config.livePointers = NO_OF_POINTERS;
+    config.iterations = NO_OF_ITERATIONS;
+    config.minSize = 16;
+    config.maxSize = 16384;
+    config.meanSize = 2048;
+
+    return config;
+}
+
+/**
+ * Reads --workload=, --seed=, --live=, --iterations=, --min-size=, --max-size= and
+ * --mean-size= from the command line in to 'config', leaving anything not given as it is.
+ * Returns false (having printed why) if an argument isn't understood.
+ */
+bool parseWorkloadArgs(int argc, char** argv, WorkloadConfig* config) {
+    for(int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = strchr(arg, '=');
+        if(strncmp(arg, "--", 2) != 0 || value == NULL) {
+            printf("Unknown argument '%s'\n", arg);
+            return false;
+        }
+
+        value++;
+        if(strncmp(arg, "--workload=", 11) == 0) {
+            int kind = 0;
+            while(kind < WORKLOAD_COUNT && strcmp(workloadNames[kind], value) != 0) {
+                kind++;
+            }
+
+            if(kind == WORKLOAD_COUNT) {
+                printf("Unknown workload '%s'\n", value);
+                return false;
+            }
+
+            config->kind = (WorkloadKind)kind;
+        } else if(strncmp(arg, "--seed=", 7) == 0) {
+            config->seed = (unsigned int)strtoul(value, NULL, 10);
+        } else if(strncmp(arg, "--live=", 7) == 0) {
+            config->livePointers = atoi(value);
+        } else if(strncmp(arg, "--iterations=", 13) == 0) {
+            config->iterations = atoi(value);
+        } else if(strncmp(arg, "--min-size=", 11) == 0) {
+            config->minSize = atoi(value);
+        } else if(strncmp(arg, "--max-size=", 11) == 0) {
+            config->maxSize = atoi(value);
+        } else if(strncmp(arg, "--mean-size=", 12) == 0) {
+            config->meanSize = atoi(value);
+        } else {
+            printf("Unknown argument '%s'\n", arg);
+            return false;
+        }
+    }
+
+    if(config->livePointers < 1 || config->iterations < 0) {
+        printf("--live must be at least 1, and --iterations can't be negative\n");
+        return false;
+    }
+
+    return true;
+}
+
+void printWorkloadUsage(const char* program) {
+    printf("usage: %s [--workload=NAME] [--seed=N] [--live=N] [--iterations=N] [--min-size=N] [--max-size=N] [--mean-size=N]\n", program);
+    printf("workloads:");
+    for(int i = 0; i < WORKLOAD_COUNT; i++) {
+        printf(" %s", workloadNames[i]);
+    }
+    printf("\n");
+}
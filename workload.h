@@ -0,0 +1,84 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+//   Program Name:  Workloads
+//
+//   Description:  A library of request size and lifetime distributions, chosen
+//                 at run time, to drive the simulation in main.cpp and the
+//                 thread benchmarks in place of the compile time simulations
+//                 in auxiliary.cpp.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef __WORKLOAD_H__
+#define __WORKLOAD_H__
+
+#include "auxiliary.h"
+
+enum WorkloadKind {
+    // The two simulations from auxiliary.cpp, giving exactly the same sequence for the same seed
+    WORKLOAD_SIMULATION_1,
+    WORKLOAD_SIMULATION_2,
+
+    // Every size between minSize and maxSize is equally likely
+    WORKLOAD_UNIFORM,
+
+    // Mostly small sizes, averaging meanSize, with a long tail up to maxSize
+    WORKLOAD_EXPONENTIAL,
+
+    // Nine in ten sizes are small (minSize to 4 * minSize), the rest large (maxSize / 2 to maxSize)
+    WORKLOAD_BIMODAL,
+
+    // Exact powers of two between minSize and maxSize - the worst case once a header is added
+    WORKLOAD_POWER_OF_TWO,
+
+    // Small blocks are short lived and large blocks long lived: the slots picked most often
+    // are given the smallest sizes
+    WORKLOAD_LIFETIME
+};
+
+typedef struct WorkloadConfig {
+    WorkloadKind kind;
+    unsigned int seed;
+
+    // Pointers held at once, and malloc/free rounds made over them
+    int livePointers;
+    int iterations;
+
+    // Size bounds for the generated workloads (the two simulations have their own)
+    int minSize;
+    int maxSize;
+    int meanSize;
+} WorkloadConfig;
+
+///////////////////////////////////////////////////////////////////////////////////
+
+class Workload {
+    WorkloadConfig config;
+
+    // The state of the simulations' generator, and of the generator used by the others
+    unsigned int simulationSeed;
+    unsigned long long state;
+public:
+    Workload();
+    void init(WorkloadConfig config);
+
+    int nextSlot();
+    int nextSize(int slot = -1);
+    bool isLongLived(int slot);
+
+    const char* getName();
+protected:
+    unsigned int nextSimulation();
+    unsigned long long nextRandom();
+    double nextUnit();
+    int nextBetween(int low, int high);
+};
+
+// The simulation selected in auxiliary.h, with main.cpp's seed, pointers and iterations
+WorkloadConfig defaultWorkloadConfig();
+
+bool parseWorkloadArgs(int argc, char** argv, WorkloadConfig* config);
+void printWorkloadUsage(const char* program);
+
+#endif